@@ -0,0 +1,259 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+
+access_log *access_log::create(const char *spec) {
+    std::string path(spec);
+    long rotate_bytes = 0;
+    policy p = DROP_ON_FULL;
+    size_t comma = path.find(',');
+    if (comma != std::string::npos) {
+        const char *options = spec + comma + 1;
+        char *end = NULL;
+        rotate_bytes = strtol(options, &end, 10) * 1024 * 1024;
+        if (end == options || rotate_bytes < 0) {
+            return NULL;
+        }
+        if (*end == ',') {
+            if (strcmp(end + 1, "wait") == 0) {
+                p = WAIT_ON_FULL;
+            } else if (strcmp(end + 1, "drop") != 0) {
+                return NULL;
+            }
+        } else if (*end != '\0') {
+            return NULL;
+        }
+        path.resize(comma);
+    }
+    if (path.empty()) {
+        return NULL;
+    }
+    access_log *log = new access_log(path, rotate_bytes, p);
+    if (!log->open_file()) {
+        delete log;
+        return NULL;
+    }
+    return log;
+}
+
+access_log::access_log(const std::string &path, long rotate_bytes, policy p) :
+        m_path(path), m_rotate_bytes(rotate_bytes), m_policy(p), m_stop(false), m_reopen(false), m_thread(0),
+        m_started(false), m_fd(-1), m_written(0), m_time_second(0), m_line_count(0) {
+    for (int i = 0; i < MAX_THREADS; ++i) {
+        m_slots[i].store(NULL, std::memory_order_relaxed);
+    }
+    m_time_text[0] = '\0';
+}
+
+/* 先停后台线程, 它退出前会把队列里剩下的记录写完 */
+access_log::~access_log() {
+    if (m_started) {
+        m_stop.store(true, std::memory_order_release);
+        pthread_join(m_thread, NULL);
+    }
+    for (int i = 0; i < MAX_THREADS; ++i) {
+        delete m_slots[i].load(std::memory_order_relaxed);
+    }
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+}
+
+bool access_log::start() {
+    m_started = pthread_create(&m_thread, NULL, worker, this) == 0;
+    return m_started;
+}
+
+/* 超过MAX_THREADS的线程共用最后一个队列, mpmc_ring允许多个生产者 */
+int access_log::thread_index() {
+    static std::atomic<int> next(0);
+    static thread_local int index = next.fetch_add(1, std::memory_order_relaxed);
+    return index < MAX_THREADS ? index : MAX_THREADS - 1;
+}
+
+access_log::slot *access_log::local() {
+    int index = thread_index();
+    slot *s = m_slots[index].load(std::memory_order_acquire);
+    if (s) {
+        return s;
+    }
+    s = new slot(RING_SIZE);
+    slot *expected = NULL;
+    if (!m_slots[index].compare_exchange_strong(expected, s, std::memory_order_acq_rel)) {
+        delete s;
+        return expected;
+    }
+    return s;
+}
+
+void access_log::log(const sockaddr_in &addr, const char *method, const char *url, int status, off_t bytes,
+                     uint64_t latency_us) {
+    record r;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r.time_us = ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+    r.latency_us = latency_us;
+    r.bytes = bytes;
+    r.addr = addr.sin_addr;
+    r.status = status;
+    r.method = method;
+    r.url_len = 0;
+    if (url) {
+        size_t len = strnlen(url, URL_MAX);
+        memcpy(r.url, url, len);
+        r.url_len = (int) len;
+    }
+
+    slot *s = local();
+    while (!s->ring.push(r)) {
+        if (m_policy == DROP_ON_FULL) {
+            s->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        sched_yield();
+    }
+}
+
+long access_log::dropped() const {
+    long n = 0;
+    for (int i = 0; i < MAX_THREADS; ++i) {
+        const slot *s = m_slots[i].load(std::memory_order_acquire);
+        if (s) {
+            n += s->dropped.load(std::memory_order_relaxed);
+        }
+    }
+    return n;
+}
+
+void *access_log::worker(void *arg) {
+    access_log *log = (access_log *) arg;
+    log->run();
+    return log;
+}
+
+void access_log::run() {
+    while (!m_stop.load(std::memory_order_acquire)) {
+        if (m_reopen.exchange(false, std::memory_order_relaxed)) {
+            close(m_fd);
+            open_file();
+        }
+        if (!drain()) {
+            usleep(IDLE_SLEEP);
+        }
+    }
+    drain();
+}
+
+/* 把所有队列取空, 返回是否取到了记录 */
+bool access_log::drain() {
+    bool any = false;
+    for (int i = 0; i < MAX_THREADS; ++i) {
+        slot *s = m_slots[i].load(std::memory_order_acquire);
+        if (!s) {
+            continue;
+        }
+        record r;
+        while (s->ring.pop(r)) {
+            any = true;
+            m_iov[m_line_count].iov_base = m_lines[m_line_count];
+            m_iov[m_line_count].iov_len = format(r, m_lines[m_line_count]);
+            if (++m_line_count == BATCH) {
+                flush();
+            }
+        }
+    }
+    flush();
+    return any;
+}
+
+/* Common Log Format, 最后加一列处理时间(us); URL里的引号、反斜杠和不可见字符转成\xHH */
+int access_log::format(const record &r, char *line) {
+    time_t second = r.time_us / 1000000;
+    if (second != m_time_second) {
+        struct tm tm;
+        localtime_r(&second, &tm);
+        strftime(m_time_text, sizeof(m_time_text), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        m_time_second = second;
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &r.addr, ip, sizeof(ip));
+    int len = snprintf(line, LINE_SIZE, "%s - - [%s] \"", ip, m_time_text);
+    if (!r.method) {
+        len += snprintf(line + len, LINE_SIZE - len, "-\" %d %lld %llu\n", r.status, (long long) r.bytes,
+                        (unsigned long long) r.latency_us);
+        return len;
+    }
+    len += snprintf(line + len, LINE_SIZE - len, "%s ", r.method);
+
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < r.url_len; ++i) {
+        unsigned char c = r.url[i];
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            line[len++] = '\\';
+            line[len++] = 'x';
+            line[len++] = hex[c >> 4];
+            line[len++] = hex[c & 0xf];
+        } else {
+            line[len++] = c;
+        }
+    }
+    len += snprintf(line + len, LINE_SIZE - len, " HTTP/1.1\" %d %lld %llu\n", r.status, (long long) r.bytes,
+                    (unsigned long long) r.latency_us);
+    return len < LINE_SIZE ? len : LINE_SIZE - 1;
+}
+
+/* 一次writev写出攒下的行, 写不完的部分接着写; 写失败(比如磁盘满)就丢掉这一批 */
+void access_log::flush() {
+    struct iovec *iov = m_iov;
+    int count = m_line_count;
+    m_line_count = 0;
+    while (count > 0 && m_fd != -1) {
+        ssize_t n = writev(m_fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        m_written += n;
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    if (m_rotate_bytes > 0 && m_written >= m_rotate_bytes) {
+        rotate();
+    }
+}
+
+bool access_log::open_file() {
+    m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd == -1) {
+        printf("open access log %s failed: %s\n", m_path.c_str(), strerror(errno));
+        return false;
+    }
+    m_written = lseek(m_fd, 0, SEEK_END);
+    return true;
+}
+
+/* 只保留一个旧文件path.1 */
+void access_log::rotate() {
+    std::string old = m_path + ".1";
+    close(m_fd);
+    rename(m_path.c_str(), old.c_str());
+    open_file();
+}
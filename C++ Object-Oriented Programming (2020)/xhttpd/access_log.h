@@ -0,0 +1,107 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <string>
+#include "workqueue.h"
+
+/*
+ * 异步访问日志: 每个线程一个环形队列, 请求路径上只把定长记录拷进本线程的队列, 不格式化也不进内核;
+ * 后台线程轮询所有队列, 格式化后攒成一批用writev写进文件.
+ * 队列满时按配置丢弃(计入dropped())或者等后台线程腾出位置.
+ * 文件超过rotate_bytes时改名为path.1重新打开; 收到SIGUSR1时也重新打开, 配合外部的logrotate.
+ */
+class access_log {
+public:
+    static const int MAX_THREADS = 128;
+    static const int URL_MAX = 192;         //更长的URL截断
+    static const int RING_SIZE = 4096;      //每个线程的队列长度
+    static const int BATCH = 256;           //一次writev最多的行数
+    static const int LINE_SIZE = URL_MAX * 4 + 128;
+    static const int IDLE_SLEEP = 10 * 1000;    //没有日志时后台线程的轮询间隔(us)
+
+    enum policy {
+        DROP_ON_FULL = 0,
+        WAIT_ON_FULL
+    };
+
+    /* 格式: path[,rotate_mb[,drop|wait]], 格式错误返回NULL */
+    static access_log *create(const char *spec);
+
+    ~access_log();
+
+    bool start();
+
+    void log(const sockaddr_in &addr, const char *method, const char *url, int status, off_t bytes,
+             uint64_t latency_us);
+
+    /* 只改一个标志, 可以在信号处理函数里调用 */
+    void reopen() { m_reopen.store(true, std::memory_order_relaxed); }
+
+    long dropped() const;
+
+private:
+    struct record {
+        uint64_t    time_us;        //CLOCK_REALTIME
+        uint64_t    latency_us;
+        int64_t     bytes;
+        in_addr     addr;
+        int         status;
+        const char* method;         //指向静态字符串, NULL表示请求行无法解析
+        int         url_len;
+        char        url[URL_MAX];
+    };
+
+    struct slot {
+        explicit slot(size_t size) : ring(size), dropped(0) {}
+
+        mpmc_ring<record>   ring;
+        std::atomic<long>   dropped;
+    };
+
+    access_log(const std::string &path, long rotate_bytes, policy p);
+
+    static int thread_index();
+
+    slot *local();
+
+    static void *worker(void *arg);
+
+    void run();
+
+    bool drain();
+
+    int format(const record &r, char *line);
+
+    void flush();
+
+    bool open_file();
+
+    void rotate();
+
+private:
+    std::string             m_path;
+    long                    m_rotate_bytes;     //0为不按大小轮转
+    policy                  m_policy;
+    std::atomic<slot*>      m_slots[MAX_THREADS];
+    std::atomic<bool>       m_stop;
+    std::atomic<bool>       m_reopen;
+    pthread_t               m_thread;
+    bool                    m_started;
+
+    //以下只由后台线程使用
+    int                     m_fd;
+    long                    m_written;          //当前文件的大小
+    time_t                  m_time_second;      //m_time_text对应的秒
+    char                    m_time_text[32];
+    int                     m_line_count;
+    char                    m_lines[BATCH][LINE_SIZE];
+    struct iovec            m_iov[BATCH];
+};
+
+#endif
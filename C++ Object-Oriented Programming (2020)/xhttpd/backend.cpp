@@ -0,0 +1,201 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string>
+
+/*
+ * 测试反向代理用的上游: 每个连接一个线程, 支持keep-alive.
+ *   /xxx/echo          回显请求行、头部和请求体
+ *   /xxx/chunked?n=N   分N个chunk返回
+ *   /xxx/big?size=N    N字节的响应体, 分块写出
+ *   /xxx/slow?ms=N     等N毫秒再响应
+ *   /xxx/close         不带Content-Length, 发完关闭连接
+ *   /xxx/drop          不响应直接关闭连接
+ * 用法: ./backend port 或 ./backend unix:/path
+ */
+static long query_value(const std::string &url, const char *name, long def) {
+    std::string key = std::string(name) + "=";
+    size_t pos = url.find(key);
+    return pos == std::string::npos ? def : atol(url.c_str() + pos + key.size());
+}
+
+static bool send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_response(int fd, const char *extra, const std::string &body) {
+    char head[256];
+    snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n%s\r\n",
+             body.size(), extra);
+    return send_all(fd, head, strlen(head)) && send_all(fd, body.data(), body.size());
+}
+
+/* 处理一个请求, 返回false表示连接该关了 */
+static bool handle(int fd, const std::string &head, const std::string &body) {
+    size_t sp1 = head.find(' ');
+    size_t sp2 = head.find(' ', sp1 + 1);
+    std::string url = head.substr(sp1 + 1, sp2 - sp1 - 1);
+
+    if (url.find("/slow") != std::string::npos) {
+        usleep(query_value(url, "ms", 100) * 1000);
+    }
+    if (url.find("/drop") != std::string::npos) {
+        return false;
+    }
+    if (url.find("/close") != std::string::npos) {
+        const char *resp = "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nuntil close\n";
+        send_all(fd, resp, strlen(resp));
+        return false;
+    }
+    if (url.find("/chunked") != std::string::npos) {
+        const char *resp = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+        if (!send_all(fd, resp, strlen(resp))) {
+            return false;
+        }
+        long n = query_value(url, "n", 3);
+        for (long i = 0; i < n; ++i) {
+            char chunk[64];
+            int len = snprintf(chunk, sizeof(chunk), "chunk %ld\n", i);
+            char frame[96];
+            int flen = snprintf(frame, sizeof(frame), "%x;ext=1\r\n%s\r\n", len, chunk);
+            if (!send_all(fd, frame, flen)) {
+                return false;
+            }
+        }
+        const char *last = "0\r\nX-Trailer: done\r\n\r\n";
+        return send_all(fd, last, strlen(last));
+    }
+    if (url.find("/big") != std::string::npos) {
+        long size = query_value(url, "size", 1 << 20);
+        char head_buf[128];
+        snprintf(head_buf, sizeof(head_buf), "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", size);
+        if (!send_all(fd, head_buf, strlen(head_buf))) {
+            return false;
+        }
+        char block[16384];
+        for (size_t i = 0; i < sizeof(block); ++i) {
+            block[i] = 'a' + i % 26;
+        }
+        for (long sent = 0; sent < size; ) {
+            long n = size - sent < (long) sizeof(block) ? size - sent : (long) sizeof(block);
+            if (!send_all(fd, block, n)) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+    return send_response(fd, "", head + body);
+}
+
+static void *serve(void *arg) {
+    int fd = (int) (long) arg;
+    std::string buf;
+    char chunk[65536];
+    while (true) {
+        size_t end;
+        while ((end = buf.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) {
+                close(fd);
+                return NULL;
+            }
+            buf.append(chunk, n);
+        }
+        std::string head = buf.substr(0, end + 4);
+        long length = 0;
+        size_t pos = head.find("Content-Length:");
+        if (pos == std::string::npos) {
+            pos = head.find("content-length:");
+        }
+        if (pos != std::string::npos) {
+            length = atol(head.c_str() + pos + 15);
+        }
+        while (buf.size() < end + 4 + length) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) {
+                close(fd);
+                return NULL;
+            }
+            buf.append(chunk, n);
+        }
+        std::string body = buf.substr(end + 4, length);
+        buf.erase(0, end + 4 + length);
+        if (!handle(fd, head, body) || strcasestr(head.c_str(), "Connection: close")) {
+            close(fd);
+            return NULL;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        printf("usage: %s port|unix:/path\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int listenfd;
+    if (strncmp(argv[1], "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, argv[1] + 5, sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+        listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            perror("bind");
+            return 1;
+        }
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(atoi(argv[1]));
+        listenfd = socket(AF_INET, SOCK_STREAM, 0);
+        int flag = 1;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+        if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            perror("bind");
+            return 1;
+        }
+    }
+    listen(listenfd, 1024);
+
+    while (true) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        //响应头和响应体分两次写, 不关Nagle会碰上延迟ACK
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve, (void *) (long) fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
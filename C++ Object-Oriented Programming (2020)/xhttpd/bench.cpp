@@ -0,0 +1,462 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+#define MAX_EVENTS 1024
+#define READ_CHUNK 65536
+
+/*
+ * xhttpd的压测客户端: 每个线程一个epoll循环, 维持若干连接.
+ * 不指定-R时为闭环压测, 每个连接始终有depth个请求在途; 指定-R时按固定速率发请求,
+ * 延迟从计划发送时间算起, 服务端变慢时排队的时间也计入(避免coordinated omission).
+ */
+struct config {
+    struct sockaddr_in  address;
+    std::string         request;
+    int                 connections;
+    int                 threads;
+    int                 duration;       //秒
+    long                rate;           //每秒请求数, 0表示闭环
+    int                 depth;          //每个连接流水线上最多的在途请求数
+    bool                keep_alive;
+};
+
+struct connection {
+    int                 fd;
+    bool                ready;          //已连上
+    std::string         out;            //待发送的请求
+    size_t              out_off;
+    std::deque<long>    sent;           //在途请求的发送时间(ns)
+    std::string         head;           //还没收完的响应头
+    long                body_left;      //响应体剩余字节, -1表示在读响应头
+    int                 status;
+};
+
+class worker {
+public:
+    worker(const config *cfg, int connections) : m_requests(0), m_bytes(0), m_errors(0), m_cfg(cfg), m_epollfd(-1),
+            m_conns(connections), m_stop_at(0), m_thread(0) {
+        memset(m_status, 0, sizeof(m_status));
+    }
+
+    bool start() { return pthread_create(&m_thread, NULL, entry, this) == 0; }
+
+    void join() { pthread_join(m_thread, NULL); }
+
+    histogram   m_latency;          //微秒
+    long        m_requests;
+    long        m_bytes;
+    long        m_errors;
+    long        m_status[6];        //按状态码首位计数
+
+private:
+    static void *entry(void *arg);
+
+    void run();
+
+    void open(int index);
+
+    void close(int index);
+
+    void on_ready(int index, long now);
+
+    void issue(int index, long at);
+
+    void flush(int index);
+
+    void on_readable(int index);
+
+    void feed(int index, const char *data, size_t len);
+
+    void complete(int index);
+
+    void watch(int index, bool out);
+
+private:
+    const config*               m_cfg;
+    int                         m_epollfd;
+    std::vector<connection>     m_conns;
+    std::vector<int>            m_idle;     //固定速率模式下可以再发一个请求的连接, 一个在途名额一项
+    long                        m_stop_at;
+    pthread_t                   m_thread;
+};
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void *worker::entry(void *arg) {
+    ((worker *) arg)->run();
+    return arg;
+}
+
+void worker::watch(int index, bool out) {
+    epoll_event event;
+    event.data.u32 = index;
+    event.events = EPOLLIN | (out ? EPOLLOUT : 0);
+    epoll_ctl(m_epollfd, EPOLL_CTL_MOD, m_conns[index].fd, &event);
+}
+
+void worker::open(int index) {
+    connection &c = m_conns[index];
+    c.fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    c.ready = false;
+    c.out.clear();
+    c.out_off = 0;
+    c.sent.clear();
+    c.head.clear();
+    c.body_left = -1;
+    if (c.fd < 0) {
+        ++m_errors;
+        return;
+    }
+    int flag = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (connect(c.fd, (struct sockaddr *) &m_cfg->address, sizeof(m_cfg->address)) < 0 && errno != EINPROGRESS) {
+        ++m_errors;
+    }
+
+    epoll_event event;
+    event.data.u32 = index;
+    event.events = EPOLLIN | EPOLLOUT;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, c.fd, &event);
+}
+
+void worker::close(int index) {
+    connection &c = m_conns[index];
+    if (c.fd >= 0) {
+        m_errors += c.sent.size();
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, c.fd, 0);
+        ::close(c.fd);
+        c.fd = -1;
+    }
+    for (size_t i = 0; i < m_idle.size(); ) {
+        if (m_idle[i] == index) {
+            m_idle[i] = m_idle.back();
+            m_idle.pop_back();
+        } else {
+            ++i;
+        }
+    }
+}
+
+void worker::on_ready(int index, long now) {
+    connection &c = m_conns[index];
+    c.ready = true;
+    for (int i = 0; i < m_cfg->depth; ++i) {
+        if (m_cfg->rate == 0) {
+            issue(index, now);
+        } else {
+            m_idle.push_back(index);
+        }
+    }
+    flush(index);
+}
+
+void worker::issue(int index, long at) {
+    connection &c = m_conns[index];
+    c.out += m_cfg->request;
+    c.sent.push_back(at);
+}
+
+void worker::flush(int index) {
+    connection &c = m_conns[index];
+    while (c.out_off < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                watch(index, true);
+                return;
+            }
+            close(index);
+            open(index);
+            return;
+        }
+        c.out_off += n;
+    }
+    c.out.clear();
+    c.out_off = 0;
+    watch(index, false);
+}
+
+void worker::complete(int index) {
+    connection &c = m_conns[index];
+    long now = now_ns();
+    m_latency.record((now - c.sent.front()) / 1000);
+    c.sent.pop_front();
+    ++m_requests;
+    if (c.status >= 100 && c.status < 600) {
+        ++m_status[c.status / 100];
+    } else {
+        ++m_status[0];
+    }
+
+    if (!m_cfg->keep_alive) {
+        close(index);
+        if (now < m_stop_at) {
+            open(index);
+        }
+    } else if (m_cfg->rate == 0) {
+        if (now < m_stop_at) {
+            issue(index, now);
+        }
+    } else {
+        m_idle.push_back(index);
+    }
+}
+
+/* 按Content-Length切分响应; 响应体直接跳过, 不拷贝 */
+void worker::feed(int index, const char *data, size_t len) {
+    connection &c = m_conns[index];
+    int fd = c.fd;
+    while (len > 0 && c.fd == fd) {
+        if (c.body_left > 0) {
+            size_t take = len < (size_t) c.body_left ? len : (size_t) c.body_left;
+            c.body_left -= take;
+            data += take;
+            len -= take;
+            if (c.body_left == 0) {
+                c.body_left = -1;
+                complete(index);
+            }
+            continue;
+        }
+
+        size_t old = c.head.size();
+        c.head.append(data, len);
+        size_t end = c.head.find("\r\n\r\n", old > 3 ? old - 3 : 0);
+        if (end == std::string::npos) {
+            return;
+        }
+        size_t extra = c.head.size() - (end + 4);
+        data += len - extra;
+        len = extra;
+
+        c.head.resize(end);
+        c.status = c.head.size() > 9 ? atoi(c.head.c_str() + 9) : 0;
+        const char *cl = strcasestr(c.head.c_str(), "\r\nContent-Length:");
+        c.body_left = cl ? atol(cl + 17) : 0;
+        c.head.clear();
+        if (c.body_left == 0) {
+            c.body_left = -1;
+            complete(index);
+        }
+    }
+}
+
+void worker::on_readable(int index) {
+    char buf[READ_CHUNK];
+    int fd = m_conns[index].fd;
+    while (m_conns[index].fd == fd) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                close(index);
+                open(index);
+            }
+            return;
+        }
+        if (n == 0) {
+            close(index);
+            open(index);
+            return;
+        }
+        m_bytes += n;
+        feed(index, buf, n);
+    }
+}
+
+void worker::run() {
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    for (size_t i = 0; i < m_conns.size(); ++i) {
+        open(i);
+    }
+
+    long start = now_ns();
+    long interval = m_cfg->rate ? 1000000000L * m_cfg->threads / m_cfg->rate : 0;
+    long next = start;
+    m_stop_at = start + m_cfg->duration * 1000000000L;
+    epoll_event events[MAX_EVENTS];
+    while (true) {
+        long now = now_ns();
+        if (now >= m_stop_at) {
+            break;
+        }
+        long wait = m_stop_at - now;
+        if (interval && !m_idle.empty() && next - now < wait) {
+            wait = next > now ? next - now : 0;
+        }
+        int number = epoll_wait(m_epollfd, events, MAX_EVENTS, (int) ((wait + 999999) / 1000000));
+        now = now_ns();
+
+        for (int i = 0; i < number; ++i) {
+            int index = events[i].data.u32;
+            connection &c = m_conns[index];
+            if (c.fd < 0) {
+                continue;
+            }
+            if (!c.ready) {
+                int error = 0;
+                socklen_t len = sizeof(error);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                if (error || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                    ++m_errors;
+                    close(index);
+                    usleep(1000);
+                    open(index);
+                    continue;
+                }
+                on_ready(index, now);
+                continue;
+            }
+            if (events[i].events & EPOLLIN) {
+                on_readable(index);
+            }
+            if (m_conns[index].fd >= 0 && m_conns[index].ready
+                    && (!m_conns[index].out.empty() || (events[i].events & EPOLLOUT))) {
+                flush(index);
+            }
+        }
+
+        while (interval && next <= now && !m_idle.empty()) {
+            int index = m_idle.back();
+            m_idle.pop_back();
+            issue(index, next);
+            flush(index);
+            next += interval;
+        }
+    }
+
+    for (size_t i = 0; i < m_conns.size(); ++i) {
+        if (m_conns[i].fd >= 0) {
+            m_conns[i].sent.clear();
+            close(i);
+        }
+    }
+    ::close(m_epollfd);
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [-c connections] [-t threads] [-d seconds] [-R rate] [-p depth] [-n] ip port path\n"
+           "  -n  send Connection: close and reconnect after every response\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    config cfg;
+    cfg.connections = 64;
+    cfg.threads = 1;
+    cfg.duration = 10;
+    cfg.rate = 0;
+    cfg.depth = 1;
+    cfg.keep_alive = true;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:d:R:p:n")) != -1) {
+        switch (opt) {
+        case 'c':
+            cfg.connections = atoi(optarg);
+            break;
+        case 't':
+            cfg.threads = atoi(optarg);
+            break;
+        case 'd':
+            cfg.duration = atoi(optarg);
+            break;
+        case 'R':
+            cfg.rate = atol(optarg);
+            break;
+        case 'p':
+            cfg.depth = atoi(optarg);
+            break;
+        case 'n':
+            cfg.keep_alive = false;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 3 || cfg.connections <= 0 || cfg.threads <= 0 || cfg.duration <= 0 || cfg.rate < 0
+            || cfg.depth <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!cfg.keep_alive) {
+        cfg.depth = 1;
+    }
+    if (cfg.threads > cfg.connections) {
+        cfg.threads = cfg.connections;
+    }
+
+    bzero(&cfg.address, sizeof(cfg.address));
+    cfg.address.sin_family = AF_INET;
+    cfg.address.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &cfg.address.sin_addr) != 1) {
+        printf("bad address %s\n", argv[optind]);
+        return 1;
+    }
+    cfg.request = std::string("GET ") + argv[optind + 2] + " HTTP/1.1\r\nHost: " + argv[optind] + "\r\nConnection: "
+                  + (cfg.keep_alive ? "keep-alive" : "close") + "\r\n\r\n";
+
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<worker *> workers;
+    for (int i = 0; i < cfg.threads; ++i) {
+        int share = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads ? 1 : 0);
+        workers.push_back(new worker(&cfg, share));
+    }
+    long start = now_ns();
+    for (int i = 0; i < cfg.threads; ++i) {
+        if (!workers[i]->start()) {
+            printf("create the %dth thread failed\n", i);
+            return 1;
+        }
+    }
+
+    histogram latency;
+    long requests = 0, bytes = 0, errors = 0;
+    long status[6] = {0};
+    for (int i = 0; i < cfg.threads; ++i) {
+        workers[i]->join();
+        latency.merge(workers[i]->m_latency);
+        requests += workers[i]->m_requests;
+        bytes += workers[i]->m_bytes;
+        errors += workers[i]->m_errors;
+        for (int j = 0; j < 6; ++j) {
+            status[j] += workers[i]->m_status[j];
+        }
+        delete workers[i];
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%d connections, %d threads, depth %d, %s, %s\n", cfg.connections, cfg.threads, cfg.depth,
+           cfg.keep_alive ? "keep-alive" : "close", cfg.rate ? "fixed rate" : "closed loop");
+    printf("requests   %12ld in %.2fs, %ld errors\n", requests, elapsed, errors);
+    printf("status     2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld, other %ld\n", status[2], status[3], status[4], status[5],
+           status[0] + status[1]);
+    printf("req/s      %12.1f\n", requests / elapsed);
+    printf("transfer   %12.2f MB/s\n", bytes / elapsed / 1e6);
+    printf("latency    %8s %8s %8s %8s %8s %8s (us)\n", "mean", "p50", "p90", "p99", "p99.9", "max");
+    printf("           %8.0f %8lu %8lu %8lu %8lu %8lu\n", latency.mean(), (unsigned long) latency.percentile(50),
+           (unsigned long) latency.percentile(90), (unsigned long) latency.percentile(99),
+           (unsigned long) latency.percentile(99.9), (unsigned long) latency.max());
+    return 0;
+}
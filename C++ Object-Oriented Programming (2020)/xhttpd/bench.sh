@@ -0,0 +1,73 @@
+#!/bin/sh
+# 压测场景: ./bench.sh [port], 需要先 make xhttpd bench
+# 每个场景单独启动一次xhttpd, 测试文件生成在doc_root(要和http_conn.cpp里的doc_root一致)下
+#
+# 可用环境变量调整: DOC_ROOT DURATION CONNS THREADS RATE XHTTPD_ARGS
+
+PORT=${1:-8080}
+DOC_ROOT=${DOC_ROOT:-/home/weijie/server}
+DURATION=${DURATION:-10}
+CONNS=${CONNS:-64}
+THREADS=${THREADS:-2}
+RATE=${RATE:-20000}
+XHTTPD_ARGS=${XHTTPD_ARGS:-}
+
+cd "$(dirname "$0")"
+if [ ! -x ./xhttpd ] || [ ! -x ./bench ]; then
+    echo "run 'make xhttpd bench' first"
+    exit 1
+fi
+
+mkdir -p "$DOC_ROOT" || exit 1
+head -c 1024 /dev/urandom > "$DOC_ROOT/bench_small.bin"
+head -c 1048576 /dev/urandom > "$DOC_ROOT/bench_1m.bin"
+chmod o+r "$DOC_ROOT/bench_small.bin" "$DOC_ROOT/bench_1m.bin"
+
+scenario() {
+    name=$1
+    path=$2
+    shift 2
+    echo "== $name"
+    ./xhttpd $XHTTPD_ARGS "$PORT" > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    ./bench -d "$DURATION" -t "$THREADS" -c "$CONNS" "$@" 127.0.0.1 "$PORT" "$path"
+    kill "$pid"
+    wait "$pid" 2> /dev/null
+    echo
+}
+
+scenario "small file, keep-alive"       /bench_small.bin
+scenario "small file, new connection"   /bench_small.bin    -n
+scenario "1 MB file, keep-alive"        /bench_1m.bin
+scenario "404, keep-alive"              /bench_missing.bin
+scenario "small file, pipelined x16"    /bench_small.bin    -p 16
+scenario "small file, $RATE req/s"      /bench_small.bin    -R "$RATE"
+
+# 同样的小文件场景在reactor线程里直接处理(-n), 和上面全部交给线程池的结果对比
+XHTTPD_ARGS="$XHTTPD_ARGS -n"
+scenario "small file, keep-alive, inline"       /bench_small.bin
+scenario "small file, pipelined x16, inline"    /bench_small.bin    -p 16
+scenario "small file, $RATE req/s, inline"      /bench_small.bin    -R "$RATE"
+
+# 混合负载: 后台不停下载1 MB文件, 同时按固定速率请求小文件, 看小请求的延迟;
+# 先用-z 0 -q 0(FIFO, 不限写配额)跑一次作对比
+mixed() {
+    name=$1
+    shift
+    echo "== $name"
+    ./xhttpd "$@" "$PORT" > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    ./bench -d $((DURATION + 2)) -t 1 -c 16 127.0.0.1 "$PORT" /bench_1m.bin > /dev/null 2>&1 &
+    bulk=$!
+    sleep 1
+    ./bench -d "$DURATION" -t 1 -c 8 -R 2000 127.0.0.1 "$PORT" /bench_small.bin
+    wait "$bulk"
+    kill "$pid"
+    wait "$pid" 2> /dev/null
+    echo
+}
+
+mixed "small file under 1 MB downloads, FIFO"           -z 0 -q 0
+mixed "small file under 1 MB downloads, size-aware"
@@ -0,0 +1,81 @@
+#include "buffer_pool.h"
+
+thread_local int buffer_pool::m_local_node = 0;
+
+/* 预算按节点平分 */
+buffer_pool::buffer_pool(size_t budget, int nodes) : m_nodes(nodes), m_in_use(0) {
+    if (m_nodes < 1) {
+        m_nodes = 1;
+    } else if (m_nodes > MAX_NODES) {
+        m_nodes = MAX_NODES;
+    }
+    for (int n = 0; n < m_nodes; ++n) {
+        for (int i = 0; i < BUFFER_CLASSES; ++i) {
+            size_t count = budget / m_nodes / BUFFER_CLASSES / class_size(i);
+            m_free[n][i] = new mpmc_ring<char*>(count < 2 ? 2 : count);
+        }
+    }
+}
+
+buffer_pool::~buffer_pool() {
+    for (int n = 0; n < m_nodes; ++n) {
+        for (int i = 0; i < BUFFER_CLASSES; ++i) {
+            char *buf;
+            while (m_free[n][i]->pop(buf)) {
+                delete[] buf;
+            }
+            delete m_free[n][i];
+        }
+    }
+}
+
+void buffer_pool::set_local_node(int node) {
+    m_local_node = node;
+}
+
+mpmc_ring<char*> *buffer_pool::free_list(int index) const {
+    int node = m_local_node < m_nodes ? m_local_node : 0;
+    return m_free[node][index];
+}
+
+size_t buffer_pool::class_size(int index) {
+    static const size_t sizes[BUFFER_CLASSES] = {MIN_SIZE, 8 * 1024, MAX_SIZE};
+    return sizes[index];
+}
+
+int buffer_pool::class_of(size_t size) {
+    for (int i = 0; i < BUFFER_CLASSES; ++i) {
+        if (size <= class_size(i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* 返回能容纳size字节的最小一档, 超过MAX_SIZE返回NULL */
+char *buffer_pool::alloc(size_t size, int &capacity) {
+    int index = class_of(size);
+    if (index < 0) {
+        return NULL;
+    }
+    capacity = class_size(index);
+    m_in_use.fetch_add(capacity, std::memory_order_relaxed);
+
+    char *buf = NULL;
+    if (!free_list(index)->pop(buf)) {
+        buf = new char[capacity];
+    }
+    return buf;
+}
+
+void buffer_pool::free(char *buf, int capacity) {
+    if (!buf) {
+        return;
+    }
+    m_in_use.fetch_sub(capacity, std::memory_order_relaxed);
+
+    int index = class_of(capacity);
+    if (index < 0 || !free_list(index)->push(buf)) {
+        delete[] buf;
+    }
+}
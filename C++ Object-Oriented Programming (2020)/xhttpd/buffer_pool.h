@@ -0,0 +1,49 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include "workqueue.h"
+
+#define BUFFER_CLASSES 3
+
+/*
+ * 连接读写缓冲区的池: 2K/8K/64K三档, 每档一个无锁空闲队列, 满了直接释放回堆.
+ * 多个NUMA节点时每个节点一组空闲队列, 按调用线程所在的节点(set_local_node())取还:
+ * 缓冲区由绑在这个节点上的线程第一次写入, 内核按first-touch把页分配在本节点, 之后也只在本节点内复用.
+ */
+class buffer_pool {
+public:
+    static const size_t MIN_SIZE = 2 * 1024;
+    static const size_t MAX_SIZE = 64 * 1024;
+    static const int MAX_NODES = 8;
+
+    explicit buffer_pool(size_t budget = 32 * 1024 * 1024, int nodes = 1);
+
+    ~buffer_pool();
+
+    char *alloc(size_t size, int &capacity);
+
+    void free(char *buf, int capacity);
+
+    static size_t class_size(int index);
+
+    /* 调用线程所在的节点, 没设置过的线程用节点0 */
+    static void set_local_node(int node);
+
+    long in_use() const { return m_in_use.load(std::memory_order_relaxed); }
+
+private:
+    static int class_of(size_t size);
+
+    mpmc_ring<char*> *free_list(int index) const;
+
+private:
+    static thread_local int m_local_node;
+
+    int                 m_nodes;
+    mpmc_ring<char*>*   m_free[MAX_NODES][BUFFER_CLASSES];     //每个节点每档缓存的空闲缓冲区
+    std::atomic<long>   m_in_use;                               //借出中的字节数
+};
+
+#endif
@@ -0,0 +1,39 @@
+#include <new>
+
+#include "coro.h"
+
+thread_local frame_pool::node *frame_pool::m_free[frame_pool::CLASSES];
+
+void *frame_pool::alloc(size_t size) {
+    size_t index = (size + GRANULE - 1) / GRANULE;
+    if (index >= CLASSES) {
+        return ::operator new(size);
+    }
+    node *frame = m_free[index];
+    if (frame) {
+        m_free[index] = frame->next;
+        return frame;
+    }
+    return ::operator new(index * GRANULE);
+}
+
+void frame_pool::free(void *frame, size_t size) {
+    size_t index = (size + GRANULE - 1) / GRANULE;
+    if (index >= CLASSES) {
+        ::operator delete(frame);
+        return;
+    }
+    node *n = (node *) frame;
+    n->next = m_free[index];
+    m_free[index] = n;
+}
+
+void frame_pool::release() {
+    for (size_t i = 0; i < CLASSES; ++i) {
+        while (m_free[i]) {
+            node *n = m_free[i];
+            m_free[i] = n->next;
+            ::operator delete(n);
+        }
+    }
+}
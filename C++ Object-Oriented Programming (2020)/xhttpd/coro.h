@@ -0,0 +1,110 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+
+/*
+ * 协程帧的分配器: 按GRANULE字节分级的空闲链表, 每个线程一份.
+ * 帧只在创建它的reactor线程里分配和释放, 不用加锁; 释放的帧挂回链表下次复用,
+ * 连接数稳定后新连接和每个请求都不再调用malloc. 超过最大级别的帧直接用operator new.
+ */
+class frame_pool {
+public:
+    static const size_t GRANULE = 64;
+    static const size_t CLASSES = 64;
+
+    static void *alloc(size_t size);
+
+    static void free(void *frame, size_t size);
+
+    /* 释放本线程缓存的空闲帧, 线程退出前调用 */
+    static void release();
+
+private:
+    struct node {
+        node *next;
+    };
+
+    static thread_local node *m_free[CLASSES];
+};
+
+/* 帧从frame_pool分配的promise基类 */
+struct pooled_promise {
+    static void *operator new(size_t size) { return frame_pool::alloc(size); }
+
+    static void operator delete(void *frame, size_t size) { frame_pool::free(frame, size); }
+
+    void unhandled_exception() { std::terminate(); }
+};
+
+/* 连接的根协程: 创建后立即运行, 没有人等它, 结束时自己释放帧 */
+struct detached_task {
+    struct promise_type : pooled_promise {
+        detached_task get_return_object() { return detached_task(); }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+
+        std::suspend_never final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+    };
+};
+
+/* 可以co_await的子协程: 被等待时才开始运行, 结束后直接切回等待者(对称转移, 不增加栈深度) */
+template<typename T>
+class task {
+public:
+    struct promise_type : pooled_promise {
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> self) noexcept {
+                return self.promise().continuation;
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        final_awaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T v) { value = std::move(v); }
+
+        T                       value;
+        std::coroutine_handle<> continuation;
+    };
+
+    explicit task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+
+    task(task &&other) noexcept : m_handle(other.m_handle) { other.m_handle = nullptr; }
+
+    task(const task &) = delete;
+
+    task &operator=(const task &) = delete;
+
+    ~task() {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        m_handle.promise().continuation = caller;
+        return m_handle;
+    }
+
+    T await_resume() { return std::move(m_handle.promise().value); }
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+#endif
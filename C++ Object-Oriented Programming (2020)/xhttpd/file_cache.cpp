@@ -0,0 +1,339 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "file_cache.h"
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static const char *encoding_names[ENCODING_COUNT] = {"br", "gzip"};
+static const char *encoding_suffixes[ENCODING_COUNT] = {".br", ".gz"};
+
+const char *encoding_name(file_encoding encoding) {
+    return encoding_names[encoding];
+}
+
+file_entry::~file_entry() {
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+void file_entry::set_stale(bool value) {
+    stale.store(value, std::memory_order_release);
+    for (int i = 0; i < ENCODING_COUNT; ++i) {
+        if (sidecar[i]) {
+            sidecar[i]->stale.store(value, std::memory_order_release);
+        }
+    }
+}
+
+bool file_entry::has_sidecar() const {
+    for (int i = 0; i < ENCODING_COUNT; ++i) {
+        if (sidecar[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* 按扩展名猜的类型, 认不出的当成二进制 */
+static const char *mime_type(const char *url) {
+    static const char *types[][2] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"}, {".js", "text/javascript"},
+        {".json", "application/json"}, {".txt", "text/plain"}, {".xml", "application/xml"},
+        {".svg", "image/svg+xml"}, {".png", "image/png"}, {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"}, {".webp", "image/webp"}, {".ico", "image/x-icon"}, {".pdf", "application/pdf"},
+        {".wasm", "application/wasm"}, {".woff2", "font/woff2"}, {".mp4", "video/mp4"},
+        {".gz", "application/gzip"}
+    };
+    const char *dot = strrchr(url, '.');
+    if (dot && !strchr(dot, '/')) {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+            if (strcasecmp(dot, types[i][0]) == 0) {
+                return types[i][1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+/* 压缩版本的文件名, 不是压缩版本时返回0 */
+static size_t sidecar_suffix(const std::string &url) {
+    for (int i = 0; i < ENCODING_COUNT; ++i) {
+        size_t len = strlen(encoding_suffixes[i]);
+        if (url.size() > len && url.compare(url.size() - len, len, encoding_suffixes[i]) == 0) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+/* 只接受规范路径: ".."会跑出doc_root, "//a" "/./a" 之类的别名收不到inotify失效 */
+static bool canonical(const char *url) {
+    if (url[0] != '/') {
+        return false;
+    }
+    for (const char *p = url; *p; ++p) {
+        if (p[0] == '/' && (p[1] == '/' || (p[1] == '.' && (p[2] == '/' || p[2] == '\0'
+                || (p[2] == '.' && (p[3] == '/' || p[3] == '\0')))))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+file_cache::file_cache(const char *root, size_t fd_budget) :
+        m_root(root), m_shard_budget(fd_budget / FILE_CACHE_SHARDS + 1), m_inotifyfd(-1), m_thread(0), m_root_wd(-1),
+        m_active(false), m_stop(false) {
+    while (m_root.size() > 1 && m_root[m_root.size() - 1] == '/') {
+        m_root.erase(m_root.size() - 1);
+    }
+    for (int i = 0; i < FILE_CACHE_SHARDS; ++i) {
+        m_shards[i].generation = 0;
+    }
+}
+
+/* 删掉一个watch会产生IN_IGNORED事件, 阻塞在read()里的后台线程醒来后看到m_stop退出 */
+file_cache::~file_cache() {
+    if (m_thread) {
+        m_stop.store(true);
+        inotify_rm_watch(m_inotifyfd, m_root_wd);
+        pthread_join(m_thread, NULL);
+    }
+    if (m_inotifyfd != -1) {
+        close(m_inotifyfd);
+    }
+}
+
+bool file_cache::start() {
+    m_inotifyfd = inotify_init1(IN_CLOEXEC);
+    if (m_inotifyfd < 0) {
+        return false;
+    }
+    add_watch("/");
+    if (m_watches.empty()) {
+        close(m_inotifyfd);
+        m_inotifyfd = -1;
+        return false;
+    }
+    //第一个watch是doc_root, wd最小; 后台线程启动后m_watches只归它访问
+    m_root_wd = m_watches.begin()->first;
+    m_active.store(true);
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        m_active.store(false);
+        close(m_inotifyfd);
+        m_inotifyfd = -1;
+        m_thread = 0;
+        return false;
+    }
+    return true;
+}
+
+void file_cache::add_watch(const std::string &dir) {
+    std::string path = m_root + dir;
+    int wd = inotify_add_watch(m_inotifyfd, path.c_str(), WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        return;
+    }
+    m_watches[wd] = dir;
+
+    DIR *d = opendir(path.c_str());
+    if (!d) {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        bool is_dir = ent->d_type == DT_DIR;
+        if (ent->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = stat((path + "/" + ent->d_name).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+            add_watch(dir + ent->d_name + "/");
+        }
+    }
+    closedir(d);
+}
+
+void *file_cache::worker(void *arg) {
+    file_cache *cache = (file_cache *) arg;
+    cache->run();
+    return cache;
+}
+
+void file_cache::run() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!m_stop.load()) {
+        ssize_t len = read(m_inotifyfd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                clear();
+                continue;
+            }
+            std::map<int, std::string>::iterator it = m_watches.find(ev->wd);
+            if (it == m_watches.end()) {
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                m_watches.erase(it);
+                continue;
+            }
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                clear();
+                continue;
+            }
+            if (ev->len == 0) {
+                continue;
+            }
+
+            std::string url = it->second + ev->name;
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    add_watch(url + "/");
+                }
+                clear();
+            } else {
+                invalidate(url);
+                size_t suffix = sidecar_suffix(url);
+                if (suffix) {
+                    invalidate(url.substr(0, url.size() - suffix));
+                }
+            }
+        }
+    }
+
+    //先停用缓存再清空, fd留给析构函数关
+    m_active.store(false);
+    clear();
+}
+
+file_cache::shard &file_cache::shard_of(const std::string &url) {
+    return m_shards[std::hash<std::string>()(url) % FILE_CACHE_SHARDS];
+}
+
+/* sidecars为true时顺便找同目录下的预压缩版本, 和原文件缓存在同一个条目里, 命中时不用再stat */
+file_ref file_cache::load(const char *url, bool sidecars) {
+    file_ref ref = std::make_shared<file_entry>();
+    std::string path = m_root + url;
+    if (stat(path.c_str(), &ref->st) < 0) {
+        ref->error = errno;
+        return ref;
+    }
+
+    if (S_ISREG(ref->st.st_mode) && (ref->st.st_mode & S_IROTH)) {
+        ref->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+
+    struct tm tm;
+    gmtime_r(&ref->st.st_mtime, &tm);
+    snprintf(ref->content_length, sizeof(ref->content_length), "Content-Length: %ld\r\n", (long) ref->st.st_size);
+    snprintf(ref->content_type, sizeof(ref->content_type), "Content-Type: %s\r\n", mime_type(url));
+    strftime(ref->last_modified, sizeof(ref->last_modified), "Last-Modified: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    snprintf(ref->etag, sizeof(ref->etag), "\"%lx-%lx-%lx\"", (unsigned long) ref->st.st_ino,
+             (unsigned long) ref->st.st_size, (unsigned long) ref->st.st_mtime);
+
+    if (sidecars && ref->fd != -1 && !sidecar_suffix(url)) {
+        for (int i = 0; i < ENCODING_COUNT; ++i) {
+            std::string name = std::string(url) + encoding_suffixes[i];
+            file_ref sidecar = load(name.c_str(), false);
+            if (sidecar->fd != -1 && sidecar->st.st_mtime >= ref->st.st_mtime) {
+                memcpy(sidecar->content_type, ref->content_type, sizeof(ref->content_type));
+                ref->sidecar[i] = sidecar;
+            }
+        }
+    }
+    return ref;
+}
+
+/*
+ * load_missing为false时只查缓存, 不在缓存里返回空, 调用方不能阻塞在open/stat上时用.
+ * 查询串先去掉; 不规范的路径(含"..", "//"等)一律返回EACCES, 不去碰文件系统.
+ */
+file_ref file_cache::lookup(const char *url, bool load_missing) {
+    //查询串不属于文件名, 不去掉的话每个"/x?随机串"都会占一个条目, 把缓存的fd挤出去
+    std::string key(url, strcspn(url, "?"));
+    if (!canonical(key.c_str())) {
+        file_ref ref = std::make_shared<file_entry>();
+        ref->error = EACCES;
+        return ref;
+    }
+    if (!m_active.load()) {
+        return load_missing ? load(key.c_str()) : file_ref();
+    }
+
+    shard &s = shard_of(key);
+    s.lock.lock();
+    std::unordered_map<std::string, shard::value>::iterator it = s.map.find(key);
+    if (it != s.map.end()) {
+        s.lru.splice(s.lru.begin(), s.lru, it->second.second);
+        file_ref ref = it->second.first;
+        s.lock.unlock();
+        return ref;
+    }
+    unsigned long generation = s.generation;
+    s.lock.unlock();
+    if (!load_missing) {
+        return file_ref();
+    }
+
+    file_ref ref = load(key.c_str());
+
+    s.lock.lock();
+    if (s.generation == generation && s.map.find(key) == s.map.end()) {
+        s.lru.push_front(key);
+        s.map[key] = shard::value(ref, s.lru.begin());
+        ref->set_stale(false);
+        if (s.map.size() > m_shard_budget) {
+            erase(s, s.map.find(s.lru.back()));
+        }
+    }
+    s.lock.unlock();
+    return ref;
+}
+
+void file_cache::erase(shard &s, std::unordered_map<std::string, shard::value>::iterator it) {
+    it->second.first->set_stale(true);
+    s.lru.erase(it->second.second);
+    s.map.erase(it);
+}
+
+void file_cache::invalidate(const std::string &url) {
+    shard &s = shard_of(url);
+    s.lock.lock();
+    std::unordered_map<std::string, shard::value>::iterator it = s.map.find(url);
+    if (it != s.map.end()) {
+        erase(s, it);
+    }
+    ++s.generation;
+    s.lock.unlock();
+}
+
+void file_cache::clear() {
+    for (int i = 0; i < FILE_CACHE_SHARDS; ++i) {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        for (std::unordered_map<std::string, shard::value>::iterator it = s.map.begin(); it != s.map.end(); ++it) {
+            it->second.first->set_stale(true);
+        }
+        s.map.clear();
+        s.lru.clear();
+        ++s.generation;
+        s.lock.unlock();
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "locker.h"
+
+#define FILE_CACHE_SHARDS 64
+
+/* 预压缩版本, 按协商时的优先顺序排列 */
+enum file_encoding {
+    ENCODING_BR = 0,
+    ENCODING_GZIP,
+    ENCODING_COUNT
+};
+
+struct file_entry;
+
+typedef std::shared_ptr<file_entry> file_ref;
+
+/* 一个已解析路径的元数据: 打开的fd, stat结果, 预先格式化好的响应头 */
+struct file_entry {
+    file_entry() : fd(-1), error(0), stale(true) {}
+
+    ~file_entry();
+
+    void set_stale(bool value);
+
+    bool has_sidecar() const;
+
+    int             fd;                     //只读fd, 非普通文件或无权限时为-1
+    int             error;                  //stat失败时的errno
+    struct stat     st;
+    char            content_length[48];     //"Content-Length: ...\r\n"
+    char            content_type[64];       //"Content-Type: ...\r\n", 按扩展名; 预压缩版本沿用原文件的
+    char            last_modified[64];      //"Last-Modified: ...\r\n"
+    char            etag[64];               //带引号的强ETag: "inode-size-mtime"
+    std::atomic<bool> stale;                //不在缓存中(被失效或淘汰)
+    file_ref        sidecar[ENCODING_COUNT];    //旁边的.br/.gz文件, 不存在或比原文件旧时为空, 随原文件一起失效
+};
+
+const char *encoding_name(file_encoding encoding);
+
+class file_cache {
+public:
+    file_cache(const char *root, size_t fd_budget = 4096);
+
+    ~file_cache();
+
+    bool start();
+
+    file_ref lookup(const char *url, bool load_missing = true);
+
+    void invalidate(const std::string &url);
+
+    void clear();
+
+private:
+    struct shard {
+        typedef std::list<std::string> lru_list;
+        typedef std::pair<file_ref, lru_list::iterator> value;
+
+        locker                                  lock;
+        std::unordered_map<std::string, value>  map;
+        lru_list                                lru;        //表头为最近使用
+        unsigned long                           generation; //每次失效加一
+    };
+
+    static void *worker(void *arg);
+
+    void run();
+
+    void add_watch(const std::string &dir);
+
+    file_ref load(const char *url, bool sidecars = true);
+
+    shard &shard_of(const std::string &url);
+
+    void erase(shard &s, std::unordered_map<std::string, shard::value>::iterator it);
+
+private:
+    std::string                 m_root;         //doc_root, 不含末尾的'/'
+    size_t                      m_shard_budget; //每个分片最多缓存的条目数
+    shard                       m_shards[FILE_CACHE_SHARDS];
+    int                         m_inotifyfd;
+    std::map<int, std::string>  m_watches;      //wd -> 相对doc_root的目录, 以'/'结尾
+    pthread_t                   m_thread;
+    int                         m_root_wd;      //doc_root本身的watch, 析构时删掉它来唤醒后台线程
+    std::atomic<bool>           m_active;       //后台线程在处理失效事件, 为false时不用缓存
+    std::atomic<bool>           m_stop;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#include <string.h>
+#include <string>
+
+#include "handlers.h"
+#include "http_conn.h"
+
+static const char *no_store = "Cache-Control: no-store\r\n";
+
+/* /__stats 返回文本格式, /__stats.json 或 Accept: application/json 返回JSON */
+static void stats_handler(http_conn &conn) {
+    const char *suffix = conn.path_info();
+    bool json = strncmp(suffix, ".json", 5) == 0 && (suffix[5] == '\0' || suffix[5] == '?');
+    if (!json && suffix[0] != '\0' && suffix[0] != '?') {
+        const char *msg = "The requested file was not found on this server.\n";
+        conn.reply(404, "text/html", msg, strlen(msg));
+        return;
+    }
+    const char *accept = conn.header(HEADER_ACCEPT);
+    if (accept && strstr(accept, "application/json")) {
+        json = true;
+    }
+    std::string body = json ? http_conn::m_stats->json() : http_conn::m_stats->text();
+    conn.reply(200, json ? "application/json" : "text/plain; charset=utf-8", body.data(), body.size(), no_store);
+}
+
+/* 给负载均衡用: 过载时回503, 让它暂时把流量分给别的实例 */
+static void health_handler(http_conn &conn) {
+    if (http_conn::m_overload->overloaded()) {
+        conn.reply(503, "text/plain", "overloaded\n", 11, no_store);
+    } else {
+        conn.reply(200, "text/plain", "ok\n", 3, no_store);
+    }
+}
+
+void add_builtin_routes() {
+    unsigned get = 1U << http_conn::GET | 1U << http_conn::HEAD;
+    router::add(get, "/__stats", stats_handler, true);
+    router::add(get, "/__health", health_handler, true);
+}
@@ -0,0 +1,7 @@
+#ifndef HANDLERS_H
+#define HANDLERS_H
+
+/* 内置的处理函数: /__stats 运行时统计, /__health 健康检查 */
+void add_builtin_routes();
+
+#endif
@@ -0,0 +1,91 @@
+#include "histogram.h"
+
+/* 只有写者线程自己递增, 读-改-写不需要lock前缀 */
+static inline void bump(std::atomic<uint64_t> &counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+histogram::histogram() {
+    reset();
+}
+
+void histogram::reset() {
+    for (int i = 0; i < BUCKETS; ++i) {
+        m_counts[i].store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+int histogram::index_of(uint64_t value) {
+    if (value < 2 * HALF) {
+        return (int) value;
+    }
+    int shift = (63 - __builtin_clzll(value)) - SUB_BITS + 1;
+    return HALF * shift + (int) (value >> shift);
+}
+
+/* 桶内的最大值, 和HDR一样按"最高等价值"报告百分位 */
+uint64_t histogram::value_at(int index) {
+    if (index < 2 * HALF) {
+        return index;
+    }
+    int shift = index / HALF - 1;
+    uint64_t top = index - HALF * shift;
+    return ((top + 1) << shift) - 1;
+}
+
+void histogram::record(uint64_t value) {
+    bump(m_counts[index_of(value)], 1);
+    bump(m_count, 1);
+    bump(m_sum, value);
+    if (value > m_max.load(std::memory_order_relaxed)) {
+        m_max.store(value, std::memory_order_relaxed);
+    }
+}
+
+/* other可以正在被它的写者更新; 合并进来的是近似值, 但每个桶本身不会读坏 */
+void histogram::merge(const histogram &other) {
+    uint64_t count = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        uint64_t n = other.m_counts[i].load(std::memory_order_relaxed);
+        if (n) {
+            bump(m_counts[i], n);
+            count += n;
+        }
+    }
+    bump(m_count, count);
+    bump(m_sum, other.m_sum.load(std::memory_order_relaxed));
+    uint64_t max = other.m_max.load(std::memory_order_relaxed);
+    if (max > m_max.load(std::memory_order_relaxed)) {
+        m_max.store(max, std::memory_order_relaxed);
+    }
+}
+
+double histogram::mean() const {
+    uint64_t count = m_count.load(std::memory_order_relaxed);
+    return count ? (double) m_sum.load(std::memory_order_relaxed) / count : 0;
+}
+
+/* p取0~100 */
+uint64_t histogram::percentile(double p) const {
+    uint64_t total = m_count.load(std::memory_order_relaxed);
+    uint64_t max = m_max.load(std::memory_order_relaxed);
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (p / 100 * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += m_counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t value = value_at(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
@@ -0,0 +1,45 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+ * HDR风格的对数线性直方图: 小于2*HALF的值逐个计数, 更大的值每个2的幂区间再等分成HALF份,
+ * 相对误差不超过1/HALF(约0.2%). 单写者: 每个线程一个, 读取前merge.
+ * 计数器用relaxed原子量读写(x86上就是普通mov), 其他线程可以边写边merge, 读到的是近似快照.
+ */
+class histogram {
+public:
+    static const int SUB_BITS = 10;
+    static const int HALF = 1 << (SUB_BITS - 1);
+    static const int BUCKETS = HALF * (64 - SUB_BITS + 2);
+
+    histogram();
+
+    void record(uint64_t value);
+
+    void merge(const histogram &other);
+
+    void reset();
+
+    uint64_t percentile(double p) const;
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+
+    uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+
+    double mean() const;
+
+    static int index_of(uint64_t value);
+
+    static uint64_t value_at(int index);
+
+private:
+    std::atomic<uint64_t>   m_counts[BUCKETS];
+    std::atomic<uint64_t>   m_count;
+    std::atomic<uint64_t>   m_sum;
+    std::atomic<uint64_t>   m_max;
+};
+
+#endif
@@ -1,15 +1,29 @@
 #include "http_conn.h"
 
 const char *ok_200_title = "OK";
+const char *created_201_title = "Created";
+const char *no_content_204_title = "No Content";
+const char *partial_206_title = "Partial Content";
+const char *not_modified_304_title = "Not Modified";
 const char *error_400_title = "Bad Request";
 const char *error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char *error_403_title = "Forbidden";
 const char *error_403_form = "You do not have permission to get file from this server.\n";
 const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
+const char *error_411_title = "Length Required";
+const char *error_411_form = "A chunked request body is only accepted for uploads.\n";
+const char *error_413_title = "Payload Too Large";
+const char *error_413_form = "The request body is larger than this server accepts.\n";
+const char *error_416_title = "Range Not Satisfiable";
+const char *error_416_form = "The requested range is not satisfiable.\n";
+const char *error_429_title = "Too Many Requests";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the requested file.\n";
 const char *doc_root = "/home/weijie/server/";
+const char *range_boundary = "xhttpd_byteranges_7f3a9c";
+const char *range_part_format = "%s--%s\r\n%sContent-Range: bytes %ld-%ld/%ld\r\n\r\n";
+const char *range_tail_format = "\r\n--%s--\r\n";
 
 int setnonblocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
@@ -20,6 +34,7 @@ int setnonblocking(int fd) {
 
 void addfd(int epollfd, int fd, bool one_shot) {
     epoll_event event;
+    event.data.u64 = 0;
     event.data.fd = fd;
     event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
     if (one_shot) {
@@ -36,24 +51,187 @@ void removefd(int epollfd, int fd) {
 
 void modfd(int epollfd, int fd, int ev) {
     epoll_event event;
+    event.data.u64 = 0;
     event.data.fd = fd;
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
-int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+/* 小文件的页是不是全在page cache里; 不在的话读它会阻塞在磁盘上 */
+static bool pages_resident(int fd, off_t size) {
+    if (size == 0) {
+        return true;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char vec[http_conn::SENDFILE_THRESHOLD / 4096];
+    if ((size + page - 1) / page > (off_t) sizeof(vec)) {
+        return false;
+    }
+    void *address = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+    bool resident = mincore(address, size, vec) == 0;
+    for (off_t i = 0; resident && i < (size + page - 1) / page; ++i) {
+        resident = vec[i] & 1;
+    }
+    munmap(address, size);
+    return resident;
+}
+
+std::atomic<int> http_conn::m_user_count(0);
+file_cache *http_conn::m_file_cache = NULL;
+response_cache *http_conn::m_response_cache = NULL;
+buffer_pool *http_conn::m_buffer_pool = NULL;
+stats *http_conn::m_stats = NULL;
+overload *http_conn::m_overload = NULL;
+rate_limit *http_conn::m_rate_limit = NULL;
+access_log *http_conn::m_access_log = NULL;
+off_t http_conn::m_write_quantum = 512 * 1024;
+
+/* 按METHOD的顺序 */
+static const char *method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH"};
+
+static int status_of(http_conn::HTTP_CODE code) {
+    switch (code) {
+    case http_conn::FILE_REQUEST:
+        return 200;
+    case http_conn::CREATED_REQUEST:
+        return 201;
+    case http_conn::REPLACED_REQUEST:
+        return 204;
+    case http_conn::PARTIAL_CONTENT:
+        return 206;
+    case http_conn::NOT_MODIFIED:
+        return 304;
+    case http_conn::RANGE_NOT_SATISFIABLE:
+        return 416;
+    case http_conn::BAD_REQUEST:
+        return 400;
+    case http_conn::FORBIDDEN_REQUEST:
+        return 403;
+    case http_conn::NO_RESOURCE:
+        return 404;
+    case http_conn::LENGTH_REQUIRED:
+        return 411;
+    case http_conn::PAYLOAD_TOO_LARGE:
+        return 413;
+    default:
+        return 500;
+    }
+}
+
+/* 处理函数可以回任意状态码, 这里只列出常用的 */
+static const char *status_title(int status) {
+    switch (status) {
+    case 200:
+        return ok_200_title;
+    case 201:
+        return created_201_title;
+    case 202:
+        return "Accepted";
+    case 204:
+        return no_content_204_title;
+    case 301:
+        return "Moved Permanently";
+    case 302:
+        return "Found";
+    case 304:
+        return not_modified_304_title;
+    case 400:
+        return error_400_title;
+    case 401:
+        return "Unauthorized";
+    case 403:
+        return error_403_title;
+    case 404:
+        return error_404_title;
+    case 405:
+        return "Method Not Allowed";
+    case 409:
+        return "Conflict";
+    case 413:
+        return error_413_title;
+    case 429:
+        return error_429_title;
+    case 500:
+        return error_500_title;
+    case 503:
+        return "Service Unavailable";
+    default:
+        return status < 400 ? "OK" : "Error";
+    }
+}
+
+/* Accept-Encoding里客户端接受的预压缩编码(按file_encoding编号的位), q=0表示明确拒绝 */
+static int parse_accept_encoding(const char *value) {
+    int accepted = 0;
+    int refused = 0;
+    const char *p = value;
+    while (true) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') {
+            break;
+        }
+        size_t len = strcspn(p, " \t,;");
+        const char *params = p + len;
+        size_t params_len = strcspn(params, ",");
+        const char *q = strstr(params, "q=");
+        int mask = 0;
+        if (len == 1 && *p == '*') {
+            mask = (1 << ENCODING_COUNT) - 1;
+        } else {
+            for (int i = 0; i < ENCODING_COUNT; ++i) {
+                const char *name = encoding_name((file_encoding) i);
+                if (len == strlen(name) && strncasecmp(p, name, len) == 0) {
+                    mask = 1 << i;
+                }
+            }
+        }
+        if (q && q < params + params_len && atof(q + 2) == 0) {
+            refused |= mask;
+        } else {
+            accepted |= mask;
+        }
+        p = params + params_len;
+    }
+    return accepted & ~refused;
+}
+
+/* 只认RFC 7231要求生成的IMF-fixdate格式, 其他格式返回-1 */
+static time_t parse_http_date(const char *value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
 
 void http_conn::close_conn(bool real_close) {
     if (real_close && (m_sockfd != -1)) {
         //modfd( m_epollfd, m_sockfd, EPOLLIN );
-        removefd(m_epollfd, m_sockfd);
+        unmap();
+        delete m_upload;
+        m_upload = NULL;
+        delete m_stream;
+        m_stream = NULL;
+        m_read_idx = 0;
+        release_buffers();
+        m_generation.fetch_add(1, std::memory_order_acq_rel);
+        if (m_epollfd != -1) {
+            removefd(m_epollfd, m_sockfd);
+        } else {
+            close(m_sockfd);
+        }
         m_sockfd = -1;
         --m_user_count;
     }
 }
 
-void http_conn::init(int sockfd, const sockaddr_in &addr) {
+void http_conn::init(int sockfd, const sockaddr_in &addr, int epollfd) {
+    m_epollfd = epollfd;
     m_sockfd = sockfd;
     m_address = addr;
     int error = 0;
@@ -61,13 +239,39 @@ void http_conn::init(int sockfd, const sockaddr_in &addr) {
     getsockopt(m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
     int reuse = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    addfd(m_epollfd, sockfd, true);
+    if (m_epollfd != -1) {
+        addfd(m_epollfd, sockfd, true);
+    } else {
+        setnonblocking(sockfd);
+    }
     m_user_count++;
+    m_timer.deadline = 0;
+    m_timer.queued = 0;
 
     init();
 }
 
 void http_conn::init() {
+    m_checked_idx = 0;
+    m_read_idx = 0;
+    reset_request();
+
+    m_keep_alive = false;
+    m_inline = false;
+    m_deferred = false;
+    m_write_idx = 0;
+    m_file_address = 0;
+    m_file_fd = -1;
+    m_file_offset = 0;
+    m_batch_count = 0;
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+}
+
+/* 一个请求处理完后只重置解析状态, 读缓冲区里流水线上的后续请求保留 */
+void http_conn::reset_request() {
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
 
@@ -75,51 +279,143 @@ void http_conn::init() {
     m_url = nullptr;
     m_version = nullptr;
     m_content_length = 0;
+    m_chunked = false;
+    m_streaming = false;
     m_host = nullptr;
-    m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
+    memset(m_headers, 0, sizeof(m_headers));
+    m_range_count = 0;
+    m_accept_encoding = 0;
+    m_encoding = -1;
+    m_vary = false;
+    m_upstream = NULL;
+    m_route = NULL;
+    m_reply_status = 0;
+    m_stream_bytes = 0;
+    m_start_line = m_checked_idx;
+    m_request_start = m_checked_idx;
+}
+
+/* 把未处理完的请求挪到读缓冲区头部, 腾出空间继续recv */
+void http_conn::compact() {
+    if (m_request_start != 0) {
+        move_read(m_read_buf, m_request_start);
+    }
+}
+
+/* 把读缓冲区里from之后的内容搬到buf开头, 解析出的指针跟着一起移动 */
+void http_conn::move_read(char *buf, int from) {
+    memmove(buf, m_read_buf + from, m_read_idx - from);
+    if (m_url) {
+        m_url = buf + (m_url - m_read_buf - from);
+    }
+    if (m_version) {
+        m_version = buf + (m_version - m_read_buf - from);
+    }
+    if (m_host) {
+        m_host = buf + (m_host - m_read_buf - from);
+    }
+    for (int i = 0; i < HEADER_COUNT; ++i) {
+        if (m_headers[i].value) {
+            m_headers[i].value = buf + (m_headers[i].value - m_read_buf - from);
+        }
+    }
+    m_read_idx -= from;
+    m_checked_idx -= from;
+    m_start_line -= from;
+    m_request_start -= from;
+    m_read_buf = buf;
+}
+
+/* 换到大一档的读缓冲区, 已经是最大一档时返回false */
+bool http_conn::grow_read() {
+    int capacity = 0;
+    char *buf = m_buffer_pool->alloc(m_read_size + 1, capacity);
+    if (!buf) {
+        return false;
+    }
+    char *old = m_read_buf;
+    move_read(buf, m_request_start);
+    m_buffer_pool->free(old, m_read_size);
+    m_read_size = capacity;
+    return true;
+}
+
+/* 保证当前写缓冲块还剩size字节, 放不下就挂到本批次的块链上, 另借一块 */
+bool http_conn::reserve_write(int size) {
+    if (m_write_buf && m_write_size - m_write_idx >= size) {
+        return true;
+    }
+    if (m_write_buf) {
+        m_write_chunks[m_write_chunk_count++] = m_write_buf;
+    }
+    m_write_buf = m_buffer_pool->alloc(WRITE_BUFFER_SIZE, m_write_size);
+    m_write_idx = 0;
+    return m_write_buf != NULL;
+}
+
+/* 归还本批次写满的块; 读缓冲区里没有半个请求时, 连接空闲, 读写缓冲区也一起归还 */
+void http_conn::release_buffers() {
+    for (int i = 0; i < m_write_chunk_count; ++i) {
+        m_buffer_pool->free(m_write_chunks[i], WRITE_BUFFER_SIZE);
+    }
+    m_write_chunk_count = 0;
     m_write_idx = 0;
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-    memset(m_real_file, '\0', FILENAME_LEN);
+    if (m_stream_buf && !m_stream) {
+        m_buffer_pool->free(m_stream_buf, m_stream_size);
+        m_stream_buf = NULL;
+        m_stream_size = 0;
+    }
+    if (m_read_idx != 0) {
+        return;
+    }
+    m_buffer_pool->free(m_read_buf, m_read_size);
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_buffer_pool->free(m_write_buf, m_write_size);
+    m_write_buf = NULL;
+    m_write_size = 0;
 }
 
 http_conn::LINE_STATUS http_conn::parse_line() {
-    char temp;
-    for (; m_checked_idx < m_read_idx; ++m_checked_idx) {
-        temp = m_read_buf[m_checked_idx];
-        if (temp == '\r') {
-            if ((m_checked_idx + 1) == m_read_idx) {
-                return LINE_OPEN;
-            } else if (m_read_buf[m_checked_idx + 1] == '\n') {
-                m_read_buf[m_checked_idx++] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
-                return LINE_OK;
-            }
+    m_checked_idx = find_eol(m_read_buf + m_checked_idx, m_read_buf + m_read_idx) - m_read_buf;
+    if (m_checked_idx == m_read_idx) {
+        return LINE_OPEN;
+    }
 
-            return LINE_BAD;
-        } else if (temp == '\n') {
-            if ((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r')) {
-                m_read_buf[m_checked_idx - 1] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+    if (m_read_buf[m_checked_idx] == '\r') {
+        if ((m_checked_idx + 1) == m_read_idx) {
+            return LINE_OPEN;
+        } else if (m_read_buf[m_checked_idx + 1] == '\n') {
+            m_read_buf[m_checked_idx++] = '\0';
+            m_read_buf[m_checked_idx++] = '\0';
+            return LINE_OK;
         }
+        return LINE_BAD;
     }
 
-    return LINE_OPEN;
+    if ((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r')) {
+        m_read_buf[m_checked_idx - 1] = '\0';
+        m_read_buf[m_checked_idx++] = '\0';
+        return LINE_OK;
+    }
+    return LINE_BAD;
 }
 
 bool http_conn::read() {
-    if (m_read_idx >= READ_BUFFER_SIZE) {
-        return false;
+    if (m_streaming) {
+        //请求体留在socket里, 由工作线程receive_body()直接splice进文件
+        return true;
+    }
+    if (!m_read_buf) {
+        m_read_buf = m_buffer_pool->alloc(READ_BUFFER_SIZE, m_read_size);
     }
 
     int bytes_read = 0;
     while (true) {
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        if (m_read_idx == m_read_size && !grow_read()) {
+            break;
+        }
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, m_read_size - m_read_idx, 0);
         if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
@@ -134,6 +430,52 @@ bool http_conn::read() {
     return true;
 }
 
+/* io_uring引擎收到的数据由内核写在provided buffer里, 拷进读缓冲区; 请求超过最大缓冲区时返回false */
+bool http_conn::feed(const char *data, int len) {
+    if (!m_read_buf) {
+        m_read_buf = m_buffer_pool->alloc(READ_BUFFER_SIZE, m_read_size);
+    }
+    while (len > 0) {
+        if (m_read_idx == m_read_size && !grow_read()) {
+            return false;
+        }
+        int n = m_read_size - m_read_idx < len ? m_read_size - m_read_idx : len;
+        memcpy(m_read_buf + m_read_idx, data, n);
+        m_read_idx += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* 协程引擎直接recv进读缓冲区: 返回空闲部分和它的长度, 满了先扩大, 已经到上限返回NULL */
+char *http_conn::read_space(int &len) {
+    if (!m_read_buf) {
+        m_read_buf = m_buffer_pool->alloc(READ_BUFFER_SIZE, m_read_size);
+    }
+    if (m_read_idx == m_read_size && !grow_read()) {
+        return NULL;
+    }
+    len = m_read_size - m_read_idx;
+    return m_read_buf + m_read_idx;
+}
+
+/*
+ * 协程引擎收到received字节后先看请求头收齐了没有, 收齐了才交给process_read(),
+ * 逐行解析的状态机不会因为半个请求头反复进出. 只在新数据(加上前面3个字节)里找空行.
+ * 请求行已经解析过(请求头后半或请求体还没收完)时交给状态机继续.
+ */
+bool http_conn::head_ready(int received) const {
+    if (m_check_state != CHECK_STATE_REQUESTLINE) {
+        return true;
+    }
+    int from = m_read_idx - received - 3;
+    if (from < m_checked_idx) {
+        from = m_checked_idx;
+    }
+    return memmem(m_read_buf + from, m_read_idx - from, "\r\n\r\n", 4) != NULL;
+}
+
 http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
     m_url = strpbrk(text, " \t");
     if (!m_url) {
@@ -141,12 +483,17 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
     }
     *m_url++ = '\0';
 
+    //GET以外的方法只能转发给上游, 静态文件在do_request()里拒绝
     char *method = text;
-    if (strcasecmp(method, "GET") == 0) {
-        m_method = GET;
-    } else {
+    int index = 0;
+    int count = sizeof(method_names) / sizeof(method_names[0]);
+    while (index < count && strcasecmp(method, method_names[index]) != 0) {
+        ++index;
+    }
+    if (index == count || index == TRACE || index == CONNECT) {
         return BAD_REQUEST;
     }
+    m_method = (METHOD) index;
 
     m_url += strspn(m_url, " \t");
     m_version = strpbrk(m_url, " \t");
@@ -174,77 +521,243 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
 
 http_conn::HTTP_CODE http_conn::parse_headers(char *text) {
     if (text[0] == '\0') {
-        if (m_method == HEAD) {
-            return GET_REQUEST;
+        //HEAD的请求体和其它方法一样处理, 否则会被当成流水线上的下一个请求转发出去
+        //上传的请求体不进读缓冲区, 由receive_body()边收边写; 路由和转发的前缀优先
+        m_streaming = (m_method == PUT || m_method == POST) && upload::accepts(m_url) && !upstream::match(m_url)
+                      && !router::match(m_method, m_url);
+        if (m_streaming) {
+            m_check_state = CHECK_STATE_CONTENT;
+            return NO_REQUEST;
+        }
+        if (m_chunked) {
+            return LENGTH_REQUIRED;
         }
-
         if (m_content_length != 0) {
+            //其它请求体要整个放进读缓冲区, 放不下的直接拒绝
+            if (m_content_length > READ_BUFFER_MAX - (m_checked_idx - m_request_start)) {
+                return PAYLOAD_TOO_LARGE;
+            }
+            send_continue();
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
 
         return GET_REQUEST;
-    } else if (strncasecmp(text, "Connection:", 11) == 0) {
-        text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0) {
+    }
+
+    char *colon = strchr(text, ':');
+    if (!colon) {
+        return NO_REQUEST;
+    }
+    header_id id = lookup_header(text, colon - text);
+    if (id == HEADER_UNKNOWN) {
+        return NO_REQUEST;
+    }
+    char *value = colon + 1;
+    value += strspn(value, " \t");
+    bool repeated = m_headers[id].value != NULL;
+    m_headers[id].value = value;
+    m_headers[id].length = strlen(value);
+
+    switch (id) {
+    case HEADER_CONNECTION: {
+        if (strcasecmp(value, "keep-alive") == 0) {
             m_linger = true;
         }
-    } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
-    } else if (strncasecmp(text, "Host:", 5) == 0) {
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
-    } else {
-        printf("oop! unknow header %s\n", text);
+        break;
+    }
+    case HEADER_CONTENT_LENGTH: {
+        //只接受纯数字, 重复的头必须一致: 和上游对请求体边界的理解不同就能夹带请求
+        char *end = NULL;
+        long length = strtol(value, &end, 10);
+        end += strspn(end, " \t");
+        if (!isdigit((unsigned char) value[0]) || *end != '\0' || length < 0
+            || (repeated && length != m_content_length)) {
+            return BAD_REQUEST;
+        }
+        m_content_length = length;
+        break;
+    }
+    case HEADER_TRANSFER_ENCODING: {
+        //只支持chunked, 其它编码解不开
+        if (strcasecmp(value, "chunked") != 0) {
+            return BAD_REQUEST;
+        }
+        m_chunked = true;
+        break;
+    }
+    case HEADER_HOST: {
+        m_host = value;
+        break;
+    }
+    case HEADER_ACCEPT_ENCODING: {
+        m_accept_encoding = parse_accept_encoding(value);
+        break;
+    }
+    default: {
+        break;
+    }
     }
 
     return NO_REQUEST;
 }
 
-http_conn::HTTP_CODE http_conn::parse_content(char *text) {
+http_conn::HTTP_CODE http_conn::parse_content() {
     if (m_read_idx >= (m_content_length + m_checked_idx)) {
-        text[m_content_length] = '\0';
+        m_checked_idx += m_content_length;
         return GET_REQUEST;
     }
 
     return NO_REQUEST;
 }
 
+/*
+ * 上传的请求体: 读缓冲区里已经收到的先写进文件, 再直接从socket接着收, 直到收完或socket暂时没有数据.
+ * 收过的部分从读缓冲区里去掉, 只留下请求头, 占的内存和请求体大小无关.
+ * 一次最多收upload::QUANTUM字节; 之后才重新注册EPOLLIN, 写磁盘慢时对端由TCP窗口限速.
+ */
+http_conn::HTTP_CODE http_conn::receive_body() {
+    if (m_inline) {
+        //要写磁盘, 交给线程池
+        return DEFERRED_REQUEST;
+    }
+    if (!m_upload) {
+        int status = 0;
+        m_upload = upload::create(m_url, m_chunked, m_content_length, status);
+        if (!m_upload) {
+            return upload_failed(status);
+        }
+        send_continue();
+        //chunked的要在读缓冲区里解码, 换成最大一档, 每次recv多收一些
+        while (!m_upload->spliceable() && m_read_size < READ_BUFFER_MAX && grow_read()) {
+        }
+    }
+
+    long budget = upload::QUANTUM;
+    while (true) {
+        long used = m_upload->write(m_read_buf + m_checked_idx, m_read_idx - m_checked_idx);
+        if (used < 0) {
+            return upload_failed(m_upload->status());
+        }
+        m_checked_idx += used;
+        if (m_upload->done()) {
+            return GET_REQUEST;
+        }
+        //写进文件的请求体丢掉, 从请求头后面(process_read()里记下的m_start_line)接着收
+        m_checked_idx = m_start_line;
+        m_read_idx = m_start_line;
+        if (budget <= 0) {
+            return NO_REQUEST;
+        }
+
+        long n;
+        if (m_upload->spliceable()) {
+            n = m_upload->splice_from(m_sockfd, budget);
+            if (n < 0) {
+                return upload_failed(m_upload->status());
+            }
+        } else {
+            n = recv(m_sockfd, m_read_buf + m_read_idx, m_read_size - m_read_idx, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN) {
+                n = 0;
+            } else if (n <= 0) {
+                return upload_failed(0);
+            }
+            m_read_idx += n;
+        }
+        if (n == 0) {
+            return NO_REQUEST;
+        }
+        budget -= n;
+    }
+}
+
+/* 请求体收完了, 临时文件改名成目标文件: 原来没有的回201, 覆盖的回204 */
+http_conn::HTTP_CODE http_conn::finish_upload() {
+    bool created = false;
+    bool ok = m_upload->commit(created);
+    if (ok) {
+        m_stats->add(stats::BYTES_UPLOADED, m_upload->received());
+    }
+    delete m_upload;
+    m_upload = NULL;
+    if (!ok) {
+        m_stats->add(stats::UPLOAD_FAILURES);
+        return INTERNAL_ERROR;
+    }
+    return created ? CREATED_REQUEST : REPLACED_REQUEST;
+}
+
+/* 上传失败, 删掉临时文件. 请求体没有收完, 回完错误就关闭连接; status为0时连接已经断了 */
+http_conn::HTTP_CODE http_conn::upload_failed(int status) {
+    delete m_upload;
+    m_upload = NULL;
+    m_linger = false;
+    switch (status) {
+    case 0:
+        return CLOSED_CONNECTION;
+    case 400:
+        return BAD_REQUEST;
+    case 403:
+        return FORBIDDEN_REQUEST;
+    case 413:
+        return PAYLOAD_TOO_LARGE;
+    default:
+        //磁盘的问题不在请求路径上打印, 只计数
+        m_stats->add(stats::UPLOAD_FAILURES);
+        return INTERNAL_ERROR;
+    }
+}
+
+/*
+ * 客户端带了Expect: 100-continue, 等这个中间响应才发请求体.
+ * 这一批前面还有没发出去的响应时不发(不能插到它们前面), 客户端等一会儿也会接着发.
+ */
+void http_conn::send_continue() {
+    static const char response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    const char *expect = m_headers[HEADER_EXPECT].value;
+    if (expect && strcasecmp(expect, "100-continue") == 0 && m_bytes_to_send == 0) {
+        send(m_sockfd, response, sizeof(response) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+}
+
 http_conn::HTTP_CODE http_conn::process_read() {
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
     char *text = 0;
 
-    while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK)) || ((line_status = parse_line()) == LINE_OK)) {
+    //请求体不按行解析: 在CHECK_STATE_CONTENT里调parse_line()会把已收到的半个请求体当成行跳过
+    while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK))
+           || ((m_check_state != CHECK_STATE_CONTENT) && (line_status = parse_line()) == LINE_OK)) {
         text = get_line();
         m_start_line = m_checked_idx;
-        printf("got 1 http line: %s\n", text);
 
         switch (m_check_state) {
         case CHECK_STATE_REQUESTLINE: {
             ret = parse_request_line(text);
-            if (ret == BAD_REQUEST) {
-                return BAD_REQUEST;
+            if (ret != NO_REQUEST) {
+                return ret;
             }
             break;
         }
         case CHECK_STATE_HEADER: {
             ret = parse_headers(text);
-            if (ret == BAD_REQUEST) {
-                return BAD_REQUEST;
-            } else if (ret == GET_REQUEST) {
+            if (ret == GET_REQUEST) {
                 return do_request();
+            } else if (ret != NO_REQUEST) {
+                return ret;
             }
             break;
         }
         case CHECK_STATE_CONTENT: {
-            ret = parse_content(text);
+            ret = m_streaming ? receive_body() : parse_content();
             if (ret == GET_REQUEST) {
-                return do_request();
+                return m_streaming ? finish_upload() : do_request();
+            } else if (ret != NO_REQUEST) {
+                return ret;
             }
             line_status = LINE_OPEN;
             break;
@@ -259,12 +772,39 @@ http_conn::HTTP_CODE http_conn::process_read() {
 }
 
 http_conn::HTTP_CODE http_conn::do_request() {
-    strcpy(m_real_file, doc_root);
-    int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-    if (stat(m_real_file, &m_file_stat) < 0) {
-        return NO_RESOURCE;
+    m_route = router::match(m_method, m_url);
+    if (m_route) {
+        return m_inline && !m_route->inline_ok ? DEFERRED_REQUEST : ROUTE_REQUEST;
+    }
+    m_upstream = upstream::match(m_url);
+    if (m_upstream) {
+        return PROXY_REQUEST;
+    }
+    if (m_method != GET && m_method != HEAD) {
+        return BAD_REQUEST;
+    }
+    if (m_inline && m_content_length > 0) {
+        return DEFERRED_REQUEST;
+    }
+
+    bool conditional = m_headers[HEADER_IF_NONE_MATCH].value || m_headers[HEADER_IF_MODIFIED_SINCE].value
+                       || m_headers[HEADER_RANGE].value;
+    //缓存的响应带着响应体, HEAD不能用
+    if (m_response_cache && !conditional && m_method == GET) {
+        m_response = m_response_cache->lookup(response_key());
+        if (m_response) {
+            return FILE_REQUEST;
+        }
+    }
+
+    m_file = m_file_cache->lookup(m_url, !m_inline);
+    if (!m_file) {
+        return DEFERRED_REQUEST;
     }
+    if (m_file->error) {
+        return m_file->error == EACCES ? FORBIDDEN_REQUEST : NO_RESOURCE;
+    }
+    m_file_stat = m_file->st;
 
     if (!(m_file_stat.st_mode & S_IROTH)) {
         return FORBIDDEN_REQUEST;
@@ -274,10 +814,177 @@ http_conn::HTTP_CODE http_conn::do_request() {
         return BAD_REQUEST;
     }
 
-    int fd = open(m_real_file, O_RDONLY);
-    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    return FILE_REQUEST;
+    if (m_file->fd < 0) {
+        return INTERNAL_ERROR;
+    }
+
+    //换成客户端接受的预压缩版本, 之后的条件请求、Range和发送都针对压缩后的文件
+    m_vary = m_file->has_sidecar();
+    for (int i = 0; i < ENCODING_COUNT && m_vary; ++i) {
+        if ((m_accept_encoding & (1 << i)) && m_file->sidecar[i]) {
+            m_file = m_file->sidecar[i];
+            m_file_stat = m_file->st;
+            m_encoding = i;
+            break;
+        }
+    }
+
+    //reactor线程里只处理页都在内存里的小文件; sendfile大文件和冷数据会阻塞在磁盘上, 条件请求一起交给线程池.
+    //HEAD不读文件内容, 都留在reactor线程
+    if (m_inline && m_method == GET && (conditional || m_file_stat.st_size >= SENDFILE_THRESHOLD
+                                        || !pages_resident(m_file->fd, m_file_stat.st_size))) {
+        return DEFERRED_REQUEST;
+    }
+
+    HTTP_CODE ret = conditional ? check_preconditions() : FILE_REQUEST;
+    if (ret != FILE_REQUEST && ret != PARTIAL_CONTENT) {
+        return ret;
+    }
+    //HEAD只要响应头, 不用准备文件内容
+    if (m_method == HEAD) {
+        return ret;
+    }
+    if (ret == FILE_REQUEST && m_response_cache && m_file_stat.st_size < response_cache::MAX_FILE_SIZE) {
+        return FILE_REQUEST;
+    }
+    if (m_file_stat.st_size >= SENDFILE_THRESHOLD && m_range_count <= 1) {
+        m_file_fd = m_file->fd;
+        m_file_offset = m_range_count == 1 ? m_ranges[0].start : 0;
+        return ret;
+    }
+    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, m_file->fd, 0);
+    if (m_file_address == MAP_FAILED) {
+        m_file_address = 0;
+        return INTERNAL_ERROR;
+    }
+    return ret;
+}
+
+/*
+ * 条件请求: If-None-Match优先于If-Modified-Since, 命中时返回304.
+ * 否则处理Range(有If-Range且不匹配时忽略Range): 返回206或416, 没有可用的Range时返回FILE_REQUEST发整个文件.
+ */
+http_conn::HTTP_CODE http_conn::check_preconditions() {
+    const char *if_none_match = m_headers[HEADER_IF_NONE_MATCH].value;
+    const char *if_modified_since = m_headers[HEADER_IF_MODIFIED_SINCE].value;
+    if (if_none_match) {
+        if (etag_matches(if_none_match)) {
+            return NOT_MODIFIED;
+        }
+    } else if (if_modified_since) {
+        time_t since = parse_http_date(if_modified_since);
+        if (since != -1 && m_file_stat.st_mtime <= since) {
+            return NOT_MODIFIED;
+        }
+    }
+
+    const char *range = m_headers[HEADER_RANGE].value;
+    if (!range) {
+        return FILE_REQUEST;
+    }
+    const char *if_range = m_headers[HEADER_IF_RANGE].value;
+    if (if_range) {
+        if (if_range[0] == '"' ? strcmp(if_range, m_file->etag) != 0
+                               : parse_http_date(if_range) != m_file_stat.st_mtime) {
+            return FILE_REQUEST;
+        }
+    }
+    if (!parse_range(range)) {
+        return FILE_REQUEST;
+    }
+    return m_range_count > 0 ? PARTIAL_CONTENT : RANGE_NOT_SATISFIABLE;
+}
+
+/* If-None-Match用弱比较: 逗号分隔的标签逐个比较, 忽略W/前缀, "*"匹配任何存在的文件 */
+bool http_conn::etag_matches(const char *list) const {
+    const char *etag = m_file->etag;
+    size_t len = strlen(etag);
+    const char *p = list;
+    while (true) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') {
+            return false;
+        }
+        if (*p == '*') {
+            return true;
+        }
+        if (strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+        size_t n = strcspn(p, ",");
+        size_t tag = n;
+        while (tag > 0 && (p[tag - 1] == ' ' || p[tag - 1] == '\t')) {
+            --tag;
+        }
+        if (tag == len && memcmp(p, etag, len) == 0) {
+            return true;
+        }
+        p += n;
+    }
+}
+
+/*
+ * 解析"bytes=a-b,c-,-n", 越界的区间直接丢掉, 全部越界时m_range_count为0(416).
+ * 语法错误、区间多于MAX_RANGES或区间总长超过文件大小(重叠区间放大流量)时返回false, 按普通请求发整个文件.
+ */
+bool http_conn::parse_range(const char *value) {
+    if (strncasecmp(value, "bytes=", 6) != 0) {
+        return false;
+    }
+    off_t size = m_file_stat.st_size;
+    off_t total = 0;
+    m_range_count = 0;
+    const char *p = value + 6;
+    while (true) {
+        p += strspn(p, " \t");
+        char *next = NULL;
+        off_t start = 0;
+        off_t end = size - 1;
+        if (*p == '-' && isdigit(p[1])) {
+            off_t suffix = strtoll(p + 1, &next, 10);
+            start = suffix >= size ? 0 : size - suffix;
+            if (suffix == 0) {
+                start = size;
+            }
+        } else if (isdigit(*p)) {
+            start = strtoll(p, &next, 10);
+            if (*next++ != '-') {
+                return false;
+            }
+            if (isdigit(*next)) {
+                end = strtoll(next, &next, 10);
+                if (end < start) {
+                    return false;
+                }
+                if (end >= size) {
+                    end = size - 1;
+                }
+            }
+        } else {
+            return false;
+        }
+
+        if (start < size) {
+            if (m_range_count == MAX_RANGES) {
+                return false;
+            }
+            m_ranges[m_range_count].start = start;
+            m_ranges[m_range_count].length = end - start + 1;
+            total += m_ranges[m_range_count].length;
+            ++m_range_count;
+            if (total > size) {
+                return false;
+            }
+        }
+
+        p = next + strspn(next, " \t");
+        if (*p == '\0') {
+            return true;
+        }
+        if (*p++ != ',') {
+            return false;
+        }
+    }
 }
 
 void http_conn::unmap() {
@@ -285,20 +992,110 @@ void http_conn::unmap() {
         munmap(m_file_address, m_file_stat.st_size);
         m_file_address = 0;
     }
+    for (int i = 0; i < m_batch_count; ++i) {
+        if (m_batch[i].address) {
+            munmap(m_batch[i].address, m_batch[i].length);
+        }
+        m_batch[i].file.reset();
+        m_batch[i].response.reset();
+    }
+    m_batch_count = 0;
+    m_file_fd = -1;
+    m_file.reset();
+    m_response.reset();
 }
 
-bool http_conn::write() {
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    if (bytes_to_send == 0) {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init();
-        return true;
+/* 响应已排进m_iv, 把它引用的文件和映射移交给批次, 直到整批发送完才释放 */
+void http_conn::hold() {
+    if (!m_file && !m_response && !m_file_address) {
+        return;
+    }
+    batch_item &item = m_batch[m_batch_count++];
+    item.file = m_file;
+    item.response = m_response;
+    item.address = m_file_address;
+    item.length = m_file_stat.st_size;
+    m_file.reset();
+    m_response.reset();
+    m_file_address = 0;
+}
+
+std::string http_conn::response_key() const {
+    std::string key(m_url);
+    key += m_linger ? "\nkeep-alive" : "\nclose";
+    if (m_accept_encoding) {
+        key += '\n';
+        key += (char) ('0' + m_accept_encoding);
+    }
+    return key;
+}
+
+bool http_conn::cache_response(int start) {
+    int header_len = m_write_idx - start;
+    response_ref response = std::make_shared<cached_response>();
+    response->source = m_file;
+    response->data.resize(header_len + m_file_stat.st_size);
+    memcpy(&response->data[0], m_write_buf + start, header_len);
+    if (pread(m_file->fd, &response->data[header_len], m_file_stat.st_size, 0) != m_file_stat.st_size) {
+        return false;
+    }
+    m_response_cache->insert(response_key(), response);
+    m_response = response;
+    m_write_idx = start;
+
+    add_iv(&m_response->data[0], m_response->data.size());
+    m_bytes_to_send += m_response->data.size();
+    return true;
+}
+
+/* 与上一段在内存中相邻(同在m_write_buf里的连续响应)时直接合并 */
+void http_conn::add_iv(void *base, size_t len) {
+    if (m_iv_count > 0 && (char *) m_iv[m_iv_count - 1].iov_base + m_iv[m_iv_count - 1].iov_len == base) {
+        m_iv[m_iv_count - 1].iov_len += len;
+        return;
+    }
+    m_iv[m_iv_count].iov_base = base;
+    m_iv[m_iv_count].iov_len = len;
+    ++m_iv_count;
+}
+
+void http_conn::consume_iv(size_t len) {
+    while (m_iv_idx < m_iv_count && len >= m_iv[m_iv_idx].iov_len) {
+        len -= m_iv[m_iv_idx].iov_len;
+        ++m_iv_idx;
+    }
+    if (m_iv_idx < m_iv_count) {
+        m_iv[m_iv_idx].iov_base = (char *) m_iv[m_iv_idx].iov_base + len;
+        m_iv[m_iv_idx].iov_len -= len;
     }
+}
 
-    while (1) {
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+/*
+ * 一直发到EAGAIN或者发完; 大文件每发满m_write_quantum字节就重新注册EPOLLOUT让出reactor线程,
+ * 对端读得快时也不会一直占着, 同一reactor上的其它连接穿插着处理.
+ */
+bool http_conn::write() {
+    ssize_t temp = 0;
+    off_t sent = 0;
+    while (m_bytes_to_send > 0) {
+        if (m_write_quantum > 0 && sent >= m_write_quantum) {
+            m_stats->add(stats::WRITE_YIELDS);
+            modfd(m_epollfd, m_sockfd, EPOLLOUT);
+            return true;
+        }
+        if (m_iv_idx < m_iv_count) {
+            temp = writev(m_sockfd, m_iv + m_iv_idx, m_iv_count - m_iv_idx);
+        } else {
+            off_t count = m_bytes_to_send;
+            if (m_write_quantum > 0 && count > m_write_quantum - sent) {
+                count = m_write_quantum - sent;
+            }
+            temp = sendfile(m_sockfd, m_file_fd, &m_file_offset, count);
+            if (temp == 0) {
+                unmap();
+                return false;
+            }
+        }
         if (temp <= -1) {
             if (errno == EAGAIN) {
                 modfd(m_epollfd, m_sockfd, EPOLLOUT);
@@ -308,30 +1105,154 @@ bool http_conn::write() {
             return false;
         }
 
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if (bytes_to_send <= 0) {
-            unmap();
-            if (m_linger) {
-                init();
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
-                return true;
-            } else {
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
-                return false;
-            }
+        advance(temp, false);
+        sent += temp;
+    }
+
+    if (!finish_write()) {
+        return false;
+    }
+    if (pending() || m_upstream) {
+        return true;
+    }
+    modfd(m_epollfd, m_sockfd, EPOLLIN);
+    return true;
+}
+
+/*
+ * 投递给线程池前估计这次要发的字节数, 只在reactor线程里调用(这时连接不在线程池里).
+ * 已经查过文件的直接用文件大小; 否则从读缓冲区里取下一个请求的URL, 在文件缓存里查大小, 不会去读磁盘.
+ * 查不到的(没缓存、代理、请求行不完整)当作小请求.
+ */
+off_t http_conn::estimate_size() const {
+    //上传每次要搬一个QUANTUM, 和大文件一样排在小请求后面
+    if (m_streaming) {
+        return upload::QUANTUM;
+    }
+    if (m_deferred) {
+        return m_file ? m_file_stat.st_size : 0;
+    }
+    if (m_check_state != CHECK_STATE_REQUESTLINE || !m_file_cache) {
+        return 0;
+    }
+    const char *start = m_read_buf + m_start_line;
+    const char *end = m_read_buf + m_read_idx;
+    const char *url = (const char *) memchr(start, ' ', end - start);
+    if (!url || ++url >= end || *url != '/') {
+        return 0;
+    }
+    const char *url_end = url;
+    while (url_end < end && *url_end != ' ' && *url_end != '\r') {
+        ++url_end;
+    }
+    char path[256];
+    if (url_end == end || url_end - url >= (long) sizeof(path)) {
+        return 0;
+    }
+    memcpy(path, url, url_end - url);
+    path[url_end - url] = '\0';
+    file_ref file = m_file_cache->lookup(path, false);
+    return file && !file->error ? file->st.st_size : 0;
+}
+
+/* 发出了len字节; file表示这些字节是从文件里读出来发的, 要推进文件偏移(sendfile自己会推进) */
+void http_conn::advance(size_t len, bool file) {
+    m_bytes_to_send -= len;
+    m_bytes_have_send += len;
+    m_stats->add(stats::BYTES_SENT, len);
+    if (file) {
+        m_file_offset += len;
+    } else {
+        consume_iv(len);
+    }
+}
+
+/* 整批响应发完, 释放文件和缓冲区; 返回false表示不是keep-alive, 连接该关了 */
+bool http_conn::finish_write() {
+    unmap();
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+    if (!m_keep_alive) {
+        return false;
+    }
+    compact();
+    release_buffers();
+    return true;
+}
+
+/*
+ * 生成发给上游的请求: 请求行和头部从读缓冲区里还原(解析时行尾的\r\n被改成了\0\0),
+ * 去掉逐跳的头部, 换成和上游保持连接的Connection, 再加上X-Forwarded-For和请求体.
+ */
+void http_conn::proxy_request(std::string &out) const {
+    static const char *hop_headers[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade"};
+
+    out.clear();
+    out += method_names[m_method];
+    out += ' ';
+    out += m_url;
+    out += " HTTP/1.1\r\n";
+
+    const char *line = m_version + strlen(m_version) + 2;
+    for (size_t len = strlen(line); len > 0; line += len + 2, len = strlen(line)) {
+        const char *colon = strchr(line, ':');
+        bool hop = false;
+        for (size_t i = 0; colon && i < sizeof(hop_headers) / sizeof(hop_headers[0]) && !hop; ++i) {
+            hop = strlen(hop_headers[i]) == (size_t) (colon - line) && strncasecmp(line, hop_headers[i], colon - line) == 0;
+        }
+        if (!hop) {
+            out.append(line, len);
+            out += "\r\n";
         }
     }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, ip, sizeof(ip));
+    out += "X-Forwarded-For: ";
+    out += ip;
+    out += "\r\nConnection: keep-alive\r\n\r\n";
+    if (m_content_length > 0) {
+        out.append(m_read_buf + m_checked_idx - m_content_length, m_content_length);
+    }
+}
+
+/*
+ * 记一条访问日志, 要在reset_request()之前调用, 这时请求行还在.
+ * 延迟从请求第一个字节到达算起: 静态文件到响应生成为止, 代理到响应转发完为止.
+ */
+void http_conn::log_access(int status, off_t bytes, uint64_t now) {
+    if (m_access_log) {
+        //请求行没解析成功时m_method和m_url不可信, 记成"-"
+        bool parsed = m_check_state != CHECK_STATE_REQUESTLINE;
+        m_access_log->log(m_address, parsed ? method_names[m_method] : NULL, parsed ? m_url : NULL, status, bytes,
+                          now - m_arrival);
+    }
+}
+
+/* 代理的响应转发完了, 和finish_write()一样准备处理下一个请求; 返回false表示连接该关了 */
+bool http_conn::finish_proxy(bool keep_alive) {
+    reset_request();
+    if (!keep_alive) {
+        return false;
+    }
+    compact();
+    release_buffers();
+    if (!pending()) {
+        rearm(EPOLLIN);
+    }
+    return true;
 }
 
 bool http_conn::add_response(const char *format, ...) {
-    if (m_write_idx >= WRITE_BUFFER_SIZE) {
+    if (m_write_idx >= m_write_size) {
         return false;
     }
     va_list arg_list;
     va_start(arg_list, format);
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    if (len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx)) {
+    int len = vsnprintf(m_write_buf + m_write_idx, m_write_size - 1 - m_write_idx, format, arg_list);
+    if (len >= (m_write_size - 1 - m_write_idx)) {
         return false;
     }
     m_write_idx += len;
@@ -343,29 +1264,254 @@ bool http_conn::add_status_line(int status, const char *title) {
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
-bool http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_linger();
-    add_blank_line();
+bool http_conn::add_headers(off_t content_len) {
+    return add_content_length(content_len) && add_linger() && add_blank_line();
 }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response("Content-Length: %d\r\n", content_len);
+bool http_conn::add_content_length(off_t content_len) {
+    return add_response("Content-Length: %ld\r\n", (long) content_len);
 }
 
 bool http_conn::add_linger() {
     return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
 }
 
+bool http_conn::add_encoding() {
+    if (m_encoding >= 0 && !add_response("Content-Encoding: %s\r\n", encoding_name((file_encoding) m_encoding))) {
+        return false;
+    }
+    return !m_vary || add_string("Vary: Accept-Encoding\r\n");
+}
+
 bool http_conn::add_blank_line() {
     return add_response("%s", "\r\n");
 }
 
+/* HEAD只回响应头, Content-Length还是GET时的长度 */
 bool http_conn::add_content(const char *content) {
-    return add_response("%s", content);
+    return m_method == HEAD || add_response("%s", content);
+}
+
+bool http_conn::add_string(const char *str) {
+    int len = strlen(str);
+    if (len >= m_write_size - 1 - m_write_idx) {
+        return false;
+    }
+    memcpy(m_write_buf + m_write_idx, str, len);
+    m_write_idx += len;
+    return true;
+}
+
+/*
+ * 206响应. 单个区间: 响应头后面直接接文件的一段(mmap切片, 或由sendfile从m_file_offset开始发);
+ * 多个区间: multipart/byteranges, 每段的分段头写在写缓冲区里, 和mmap切片交替排进m_iv.
+ */
+bool http_conn::add_partial_content() {
+    int start = m_write_idx;
+    long size = m_file_stat.st_size;
+    add_status_line(206, partial_206_title);
+    off_t body = 0;
+    if (m_range_count == 1) {
+        const byte_range &r = m_ranges[0];
+        add_response("Content-Range: bytes %ld-%ld/%ld\r\n", (long) r.start, (long) (r.start + r.length - 1), size);
+        add_string(m_file->content_type);
+        body = r.length;
+    } else {
+        for (int i = 0; i < m_range_count; ++i) {
+            const byte_range &r = m_ranges[i];
+            body += snprintf(NULL, 0, range_part_format, i ? "\r\n" : "", range_boundary, m_file->content_type,
+                             (long) r.start, (long) (r.start + r.length - 1), size) + r.length;
+        }
+        body += snprintf(NULL, 0, range_tail_format, range_boundary);
+        add_response("Content-Type: multipart/byteranges; boundary=%s\r\n", range_boundary);
+    }
+    add_content_length(body);
+    add_response("ETag: %s\r\n", m_file->etag);
+    add_string(m_file->last_modified);
+    add_encoding();
+    add_linger();
+    if (!add_blank_line()) {
+        return false;
+    }
+
+    if (m_method == HEAD) {
+        add_iv(m_write_buf + start, m_write_idx - start);
+        m_bytes_to_send += m_write_idx - start;
+        return true;
+    }
+    if (m_range_count == 1) {
+        add_iv(m_write_buf + start, m_write_idx - start);
+        if (m_file_address) {
+            add_iv(m_file_address + m_ranges[0].start, m_ranges[0].length);
+        }
+        m_bytes_to_send += m_write_idx - start + body;
+        return true;
+    }
+
+    int head = start;
+    for (int i = 0; i < m_range_count; ++i) {
+        const byte_range &r = m_ranges[i];
+        //每一段都带上文件本身的类型, 整个响应的类型是multipart/byteranges
+        if (!add_response(range_part_format, i ? "\r\n" : "", range_boundary, m_file->content_type,
+                          (long) r.start, (long) (r.start + r.length - 1), size)) {
+            return false;
+        }
+        add_iv(m_write_buf + head, m_write_idx - head);
+        add_iv(m_file_address + r.start, r.length);
+        head = m_write_idx;
+    }
+    if (!add_response(range_tail_format, range_boundary)) {
+        return false;
+    }
+    add_iv(m_write_buf + head, m_write_idx - head);
+    m_bytes_to_send += m_write_idx - start;
+    for (int i = 0; i < m_range_count; ++i) {
+        m_bytes_to_send += m_ranges[i].length;
+    }
+    return true;
+}
+
+/* 推迟到线程池的请求从哪里接着做 */
+http_conn::HTTP_CODE http_conn::resume_request() {
+    if (m_stream) {
+        return ROUTE_REQUEST;
+    }
+    if (m_streaming) {
+        //上传是在收请求体之前推迟的, 回到状态机接着收
+        return process_read();
+    }
+    return do_request();
+}
+
+const char *http_conn::method_name() const {
+    return method_names[m_method];
+}
+
+const char *http_conn::query() const {
+    const char *q = strchr(m_url, '?');
+    return q ? q + 1 : NULL;
+}
+
+const char *http_conn::body(long &len) const {
+    len = m_content_length;
+    return m_content_length > 0 ? m_read_buf + m_checked_idx - m_content_length : NULL;
+}
+
+/* 调处理函数; 它没有回(或者回的响应头放不下)时回500 */
+bool http_conn::call_route() {
+    m_route->handler(*this);
+    if (m_reply_status == 0) {
+        return reply(500, "text/html", error_500_form, strlen(error_500_form));
+    }
+    return !m_stream || produce_stream();
+}
+
+/*
+ * 响应头写进写缓冲块; 响应体放得下就跟在后面, 和响应头一起是m_iv里的一段,
+ * 放不下的拷进一个不入缓存的cached_response, 和缓存命中的响应一样随批次释放.
+ */
+bool http_conn::reply(int status, const char *content_type, const char *body, size_t len, const char *headers) {
+    if (m_reply_status != 0) {
+        return false;
+    }
+    int start = m_write_idx;
+    bool ok = add_status_line(status, status_title(status))
+              && (!content_type || add_response("Content-Type: %s\r\n", content_type))
+              && (!headers || add_string(headers)) && add_headers(len);
+    if (!ok) {
+        m_write_idx = start;
+        return false;
+    }
+    if (m_method == HEAD) {
+        len = 0;
+    }
+    if (len > 0 && len < (size_t) (m_write_size - m_write_idx)) {
+        memcpy(m_write_buf + m_write_idx, body, len);
+        m_write_idx += len;
+        len = 0;
+    }
+    add_iv(m_write_buf + start, m_write_idx - start);
+    m_bytes_to_send += m_write_idx - start;
+    if (len > 0) {
+        m_response = std::make_shared<cached_response>();
+        m_response->data.assign(body, len);
+        add_iv(&m_response->data[0], len);
+        m_bytes_to_send += len;
+    }
+    m_reply_status = status;
+    return true;
+}
+
+bool http_conn::reply_stream(int status, const char *content_type, response_stream *stream, const char *headers) {
+    if (m_reply_status != 0) {
+        delete stream;
+        return false;
+    }
+    int start = m_write_idx;
+    bool ok = add_status_line(status, status_title(status))
+              && (!content_type || add_response("Content-Type: %s\r\n", content_type))
+              && (!headers || add_string(headers)) && add_string("Transfer-Encoding: chunked\r\n") && add_linger()
+              && add_blank_line();
+    if (!ok) {
+        m_write_idx = start;
+        delete stream;
+        return false;
+    }
+    add_iv(m_write_buf + start, m_write_idx - start);
+    m_bytes_to_send += m_write_idx - start;
+    m_reply_status = status;
+    if (m_method == HEAD) {
+        delete stream;
+        return true;
+    }
+    m_stream = stream;
+    return true;
+}
+
+/* 每个分块是"长度\r\n数据\r\n", 末尾留出最后的0长度分块的位置 */
+bool http_conn::write_chunk(const char *data, size_t len) {
+    static const int TAIL = 5;
+    if (!m_stream_buf || len == 0) {
+        return len == 0;
+    }
+    char head[24];
+    int n = snprintf(head, sizeof(head), "%lx\r\n", (unsigned long) len);
+    if ((size_t) (m_stream_size - m_stream_len - TAIL) < n + len + 2) {
+        return false;
+    }
+    memcpy(m_stream_buf + m_stream_len, head, n);
+    memcpy(m_stream_buf + m_stream_len + n, data, len);
+    memcpy(m_stream_buf + m_stream_len + n + len, "\r\n", 2);
+    m_stream_len += n + len + 2;
+    return true;
+}
+
+/*
+ * 生成流式响应的一批: 每批写进同一个借来的缓冲区, 上一批发完才会生成下一批, 占的内存和响应大小无关.
+ * 数据源结束(或者这一批什么都没写)时补上0长度分块, 响应结束.
+ */
+bool http_conn::produce_stream() {
+    if (!m_stream_buf) {
+        m_stream_buf = m_buffer_pool->alloc(STREAM_BUFFER_SIZE, m_stream_size);
+        if (!m_stream_buf) {
+            return false;
+        }
+    }
+    m_stream_len = 0;
+    bool more = m_stream->produce(*this);
+    if (!more || m_stream_len == 0) {
+        memcpy(m_stream_buf + m_stream_len, "0\r\n\r\n", 5);
+        m_stream_len += 5;
+        delete m_stream;
+        m_stream = NULL;
+    }
+    add_iv(m_stream_buf, m_stream_len);
+    m_bytes_to_send += m_stream_len;
+    return true;
 }
 
 bool http_conn::process_write(HTTP_CODE ret) {
+    int start = m_write_idx;
     switch (ret) {
     case INTERNAL_ERROR: {
         add_status_line(500, error_500_title);
@@ -376,6 +1522,7 @@ bool http_conn::process_write(HTTP_CODE ret) {
         break;
     }
     case BAD_REQUEST: {
+        m_linger = false;
         add_status_line(400, error_400_title);
         add_headers(strlen(error_400_form));
         if (!add_content(error_400_form)) {
@@ -383,6 +1530,41 @@ bool http_conn::process_write(HTTP_CODE ret) {
         }
         break;
     }
+    case LENGTH_REQUIRED: {
+        m_linger = false;
+        add_status_line(411, error_411_title);
+        add_headers(strlen(error_411_form));
+        if (!add_content(error_411_form)) {
+            return false;
+        }
+        break;
+    }
+    case PAYLOAD_TOO_LARGE: {
+        //请求体没有读, 只能关闭连接
+        m_linger = false;
+        add_status_line(413, error_413_title);
+        add_headers(strlen(error_413_form));
+        if (!add_content(error_413_form)) {
+            return false;
+        }
+        break;
+    }
+    case CREATED_REQUEST: {
+        add_status_line(201, created_201_title);
+        if (!add_headers(0)) {
+            return false;
+        }
+        break;
+    }
+    case REPLACED_REQUEST: {
+        //204不能带Content-Length
+        add_status_line(204, no_content_204_title);
+        add_linger();
+        if (!add_blank_line()) {
+            return false;
+        }
+        break;
+    }
     case NO_RESOURCE: {
         add_status_line(404, error_404_title);
         add_headers(strlen(error_404_form));
@@ -399,15 +1581,61 @@ bool http_conn::process_write(HTTP_CODE ret) {
         }
         break;
     }
+    case RANGE_NOT_SATISFIABLE: {
+        add_status_line(416, error_416_title);
+        add_response("Content-Range: bytes */%ld\r\n", (long) m_file_stat.st_size);
+        add_headers(strlen(error_416_form));
+        if (!add_content(error_416_form)) {
+            return false;
+        }
+        break;
+    }
+    case NOT_MODIFIED: {
+        add_status_line(304, not_modified_304_title);
+        add_response("ETag: %s\r\n", m_file->etag);
+        add_string(m_file->last_modified);
+        add_encoding();
+        add_linger();
+        if (!add_blank_line()) {
+            return false;
+        }
+        break;
+    }
+    case PARTIAL_CONTENT: {
+        return add_partial_content();
+    }
+    case ROUTE_REQUEST: {
+        return m_stream ? produce_stream() : call_route();
+    }
     case FILE_REQUEST: {
+        if (m_response) {
+            add_iv(&m_response->data[0], m_response->data.size());
+            m_bytes_to_send += m_response->data.size();
+            return true;
+        }
         add_status_line(200, ok_200_title);
         if (m_file_stat.st_size != 0) {
-            add_headers(m_file_stat.st_size);
-            m_iv[0].iov_base = m_write_buf;
-            m_iv[0].iov_len = m_write_idx;
-            m_iv[1].iov_base = m_file_address;
-            m_iv[1].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
+            add_string(m_file->content_type);
+            add_string(m_file->content_length);
+            add_string(m_file->last_modified);
+            add_response("ETag: %s\r\n", m_file->etag);
+            add_string("Accept-Ranges: bytes\r\n");
+            add_encoding();
+            add_linger();
+            if (!add_blank_line()) {
+                return false;
+            }
+            if (m_method == HEAD) {
+                break;
+            }
+            if (!m_file_address && m_file_fd == -1) {
+                return cache_response(start);
+            }
+            add_iv(m_write_buf + start, m_write_idx - start);
+            if (m_file_address) {
+                add_iv(m_file_address, m_file_stat.st_size);
+            }
+            m_bytes_to_send += m_write_idx - start + m_file_stat.st_size;
             return true;
         } else {
             const char *ok_string = "<html><body></body></html>";
@@ -416,29 +1644,128 @@ bool http_conn::process_write(HTTP_CODE ret) {
                 return false;
             }
         }
+        break;
     }
     default: {
         return false;
     }
     }
 
-    m_iv[0].iov_base = m_write_buf;
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1;
+    add_iv(m_write_buf + start, m_write_idx - start);
+    m_bytes_to_send += m_write_idx - start;
     return true;
 }
 
-void http_conn::process() {
-    HTTP_CODE read_ret = process_read();
-    if (read_ret == NO_REQUEST) {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        return;
+/*
+ * 在reactor线程里直接处理, 不经过线程池. io_uring引擎什么请求都在这里处理;
+ * epoll引擎用inline_only, 遇到可能阻塞的请求停下来(deferred()), 由reactor投递给线程池接着做.
+ * inline_only时有数据要发也不注册EPOLLOUT, 由reactor直接write().
+ */
+void http_conn::handle(bool inline_only) {
+    uint64_t start = stats::now_us();
+    m_inline = inline_only;
+    serve();
+    m_inline = false;
+    m_stats->record(stats::PHASE_HANDLE, stats::now_us() - start);
+}
+
+/* epoll模式下重新注册事件; io_uring引擎(m_epollfd为-1)自己决定下一步提交什么 */
+void http_conn::rearm(int ev) {
+    if (m_epollfd != -1) {
+        modfd(m_epollfd, m_sockfd, ev);
     }
+}
+
+/* 由线程池调用; reactor在投递前mark_busy(), 处理完之前不会让这个连接超时 */
+void http_conn::process() {
+    uint64_t start = stats::now_us();
+    m_stats->record(stats::PHASE_QUEUE, start - m_dispatched);
+    m_overload->observe(start - m_dispatched, start);
+    serve();
+    m_stats->record(stats::PHASE_HANDLE, stats::now_us() - start);
+    unmark_busy();
+}
+
+/*
+ * 流水线: 依次解析读缓冲区里所有完整的请求, 响应攒成一批交给一次writev.
+ * 遇到非keep-alive请求, 交给sendfile的大文件(只能排在最后), 多区间响应或批次满时停下,
+ * 剩下的请求等这一批发完后由reactor重新投递(见pending()).
+ */
+void http_conn::serve() {
+    for (int count = 0; count < MAX_PIPELINE; ) {
+        HTTP_CODE read_ret;
+        if (m_deferred) {
+            m_deferred = false;
+            read_ret = resume_request();
+        } else if (m_stream) {
+            //流式响应的上一批发完了, 接着生成
+            read_ret = m_inline && !m_route->inline_ok ? DEFERRED_REQUEST : ROUTE_REQUEST;
+        } else {
+            read_ret = process_read();
+        }
+        if (read_ret == NO_REQUEST) {
+            break;
+        }
+        if (read_ret == DEFERRED_REQUEST) {
+            //已经攒好的响应先发, 发完后pending()让reactor把这个请求投递出去
+            m_deferred = true;
+            break;
+        }
+        if (read_ret == PROXY_REQUEST) {
+            //同样先发完已有的响应, 之后由reactor转发(见proxy_ready())
+            break;
+        }
 
-    bool write_ret = process_write(read_ret);
-    if (!write_ret) {
-        close_conn();
+        //处理函数的响应尽量整个放进一个写缓冲块
+        int reserve = (read_ret == PARTIAL_CONTENT && m_range_count > 1) || (read_ret == ROUTE_REQUEST && !m_stream)
+                      ? WRITE_BUFFER_SIZE : RESPONSE_RESERVE;
+        off_t queued = m_bytes_to_send;
+        if (!reserve_write(reserve) || !process_write(read_ret)) {
+            close_conn();
+            return;
+        }
+        if (m_stream) {
+            //流式响应还没完, 这一批发完后不能关连接, pending()回到这里接着生成, 后面的请求等它结束
+            m_stream_bytes += m_bytes_to_send - queued;
+            m_keep_alive = true;
+            break;
+        }
+        int status = read_ret == ROUTE_REQUEST ? m_reply_status : status_of(read_ret);
+        m_stats->count_status(status);
+        if (m_access_log) {
+            log_access(status, m_stream_bytes + m_bytes_to_send - queued, stats::now_us());
+        }
+        hold();
+        m_keep_alive = m_linger;
+        bool multipart = m_range_count > 1;
+        reset_request();
+        ++count;
+        if (!m_keep_alive || m_file_fd != -1 || multipart) {
+            break;
+        }
     }
 
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+    if (m_bytes_to_send == 0) {
+        if (m_deferred) {
+            return;
+        }
+        if (m_upstream) {
+            //注册EPOLLOUT把连接交还给reactor, 客户端socket可写, 马上就会触发
+            if (!m_inline) {
+                rearm(EPOLLOUT);
+            }
+            return;
+        }
+        compact();
+        if (m_read_idx == READ_BUFFER_MAX) {
+            close_conn();
+            return;
+        }
+        release_buffers();
+        rearm(EPOLLIN);
+        return;
+    }
+    if (!m_inline) {
+        rearm(EPOLLOUT);
+    }
 }
@@ -2,8 +2,21 @@
 #define HTTPCONNECTION_H
 
 #include "locker.h"
+#include "buffer_pool.h"
+#include "file_cache.h"
+#include "response_cache.h"
+#include "http_parser.h"
+#include "stats.h"
+#include "overload.h"
+#include "upstream.h"
+#include "upload.h"
+#include "router.h"
+#include "rate_limit.h"
+#include "access_log.h"
+#include <atomic>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
@@ -15,18 +28,25 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/uio.h>
 
 class http_conn {
   public:
-    static const int FILENAME_LEN = 200;
-    static const int READ_BUFFER_SIZE = 2048;
-    static const int WRITE_BUFFER_SIZE = 1024;
+    static const int READ_BUFFER_SIZE = buffer_pool::MIN_SIZE;
+    static const int READ_BUFFER_MAX = buffer_pool::MAX_SIZE;
+    static const int WRITE_BUFFER_SIZE = buffer_pool::MIN_SIZE;
+    static const off_t SENDFILE_THRESHOLD = 256 * 1024;
+    static const int MAX_PIPELINE = 16;
+    static const int RESPONSE_RESERVE = 384;
+    static const int MAX_RANGES = 8;
+    static const int STREAM_BUFFER_SIZE = buffer_pool::MAX_SIZE;
     enum METHOD {
         GET = 0,
         POST,
@@ -50,8 +70,18 @@ class http_conn {
         NO_RESOURCE,
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
+        NOT_MODIFIED,
+        PARTIAL_CONTENT,
+        RANGE_NOT_SATISFIABLE,
         INTERNAL_ERROR,
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        DEFERRED_REQUEST,
+        PROXY_REQUEST,
+        CREATED_REQUEST,
+        REPLACED_REQUEST,
+        LENGTH_REQUIRED,
+        PAYLOAD_TOO_LARGE,
+        ROUTE_REQUEST
     };
     enum LINE_STATUS {
         LINE_OK = 0,
@@ -59,13 +89,24 @@ class http_conn {
         LINE_OPEN
     };
 
+    /* 超时状态, 只由接受这个连接的reactor线程读写 */
+    struct timer_state {
+        long deadline;      //到期时间(ms), 0表示不超时
+        long queued;        //时间轮里有效条目的到期时间, 0表示没有
+    };
+
   public:
-    http_conn() {}
+    http_conn() : m_dispatched(0), m_arrival(0), m_generation(0), m_busy(0), m_sockfd(-1), m_read_buf(NULL), m_read_size(0), m_write_buf(NULL), m_write_size(0),
+                  m_write_chunk_count(0), m_upload(NULL),
+                  m_stream(NULL), m_stream_buf(NULL), m_stream_size(0) {
+        m_timer.deadline = 0;
+        m_timer.queued = 0;
+    }
 
     ~http_conn() {}
 
   public:
-    void init(int sockfd, const sockaddr_in &addr);
+    void init(int sockfd, const sockaddr_in &addr, int epollfd);
 
     void close_conn(bool real_close = true);
 
@@ -75,9 +116,140 @@ class http_conn {
 
     bool write();
 
+    off_t estimate_size() const;
+
+    void handle(bool inline_only = false);
+
+    bool feed(const char *data, int len);
+
+    char *read_space(int &len);
+
+    void commit_read(int len) { m_read_idx += len; }
+
+    bool head_ready(int received) const;
+
+    void advance(size_t len, bool file);
+
+    bool finish_write();
+
+    /* 还没发出去的部分: 先是iov里的内存块, 剩下的(send_left()减去iov的长度)从send_fd()的send_offset()处读 */
+    int send_iov(const struct iovec *&iov) const {
+        iov = m_iv + m_iv_idx;
+        return m_iv_count - m_iv_idx;
+    }
+
+    int send_fd() const { return m_file_fd; }
+
+    off_t send_offset() const { return m_file_offset; }
+
+    off_t send_left() const { return m_bytes_to_send; }
+
+    bool pending() const {
+        return m_bytes_to_send == 0 && !m_upstream && (m_deferred || m_stream || m_checked_idx < m_read_idx);
+    }
+
+    /* 解析出了要转发的请求, 之前攒的响应也发完了, 由reactor接手 */
+    bool proxy_ready() const { return m_upstream && m_bytes_to_send == 0; }
+
+    upstream *proxy_target() const { return m_upstream; }
+
+    void proxy_request(std::string &out) const;
+
+    bool proxy_keep_alive() const { return m_linger; }
+
+    bool proxy_head() const { return m_method == HEAD; }
+
+    bool finish_proxy(bool keep_alive);
+
+    void log_access(int status, off_t bytes, uint64_t now);
+
+    bool deferred() const { return m_deferred; }
+
+    /* 正在接收上传的请求体 */
+    bool streaming() const { return m_streaming; }
+
+    bool idle() const { return m_read_idx == 0; }
+
+    /* 读缓冲区里下一个请求还没开始解析, 也就是还没为它取过令牌 */
+    bool awaiting_request() const {
+        return m_check_state == CHECK_STATE_REQUESTLINE && !m_deferred && !m_stream;
+    }
+
+    const sockaddr_in &peer() const { return m_address; }
+
+    bool writing() const { return m_bytes_to_send > 0; }
+
+    unsigned generation() const { return m_generation.load(std::memory_order_acquire); }
+
+    bool busy() const { return m_busy.load(std::memory_order_acquire) > 0; }
+
+    void mark_busy() { m_busy.fetch_add(1, std::memory_order_acq_rel); }
+
+    void unmark_busy() { m_busy.fetch_sub(1, std::memory_order_acq_rel); }
+
+    /* 以下给路由的处理函数用, 只在处理函数(或response_stream::produce())运行期间调用 */
+    METHOD method() const { return m_method; }
+
+    const char *method_name() const;
+
+    const char *url() const { return m_url; }
+
+    /* URL里路由前缀后面的部分 */
+    const char *path_info() const { return m_url + m_route->prefix_len; }
+
+    /* '?'后面的部分, 没有时返回NULL */
+    const char *query() const;
+
+    /* 请求头的值, 没有这个头时返回NULL */
+    const char *header(header_id id) const { return m_headers[id].value; }
+
+    /* 请求体, 整个在读缓冲区里(不超过READ_BUFFER_MAX); 没有时len为0 */
+    const char *body(long &len) const;
+
+    const sockaddr_in &address() const { return m_address; }
+
+    /* 回一个完整的响应; headers是额外的头部行, 每行以\r\n结尾. HEAD请求只发响应头 */
+    bool reply(int status, const char *content_type, const char *body, size_t len, const char *headers = NULL);
+
+    /* 回chunked响应, 之后由stream分批生成, stream归连接所有 */
+    bool reply_stream(int status, const char *content_type, response_stream *stream, const char *headers = NULL);
+
+    /* 在produce()里写一个分块; 这一批放不下(每批最多约STREAM_BUFFER_SIZE字节)时返回false, 下一批再写 */
+    bool write_chunk(const char *data, size_t len);
+
   private:
+    struct byte_range {
+        off_t start;
+        off_t length;
+    };
+
+    struct batch_item {
+        file_ref file;
+        response_ref response;
+        char *address;
+        off_t length;
+    };
+
     void init();
 
+    void serve();
+
+    void rearm(int ev);
+
+    void reset_request();
+
+    void compact();
+
+    void move_read(char *buf, int from);
+
+    bool grow_read();
+
+    bool reserve_write(int size = RESPONSE_RESERVE);
+
+    void release_buffers();
+
+    void hold();
+
     HTTP_CODE process_read();
 
     bool process_write(HTTP_CODE ret);
@@ -86,59 +258,140 @@ class http_conn {
 
     HTTP_CODE parse_headers(char *text);
 
-    HTTP_CODE parse_content(char *text);
+    HTTP_CODE parse_content();
+
+    HTTP_CODE receive_body();
+
+    HTTP_CODE finish_upload();
+
+    HTTP_CODE upload_failed(int status);
+
+    void send_continue();
 
     HTTP_CODE do_request();
 
+    HTTP_CODE resume_request();
+
+    bool call_route();
+
+    bool produce_stream();
+
+    HTTP_CODE check_preconditions();
+
+    bool etag_matches(const char *list) const;
+
+    bool parse_range(const char *value);
+
     char *get_line() { return m_read_buf + m_start_line; }
 
     LINE_STATUS parse_line();
 
     void unmap();
 
+    void add_iv(void *base, size_t len);
+
+    void consume_iv(size_t len);
+
+    std::string response_key() const;
+
+    bool cache_response(int start);
+
+    bool add_partial_content();
+
     bool add_response(const char *format, ...);
 
     bool add_content(const char *content);
 
+    bool add_string(const char *str);
+
     bool add_status_line(int status, const char *title);
 
-    bool add_headers(int content_length);
+    bool add_headers(off_t content_length);
 
-    bool add_content_length(int content_length);
+    bool add_content_length(off_t content_length);
 
     bool add_linger();
 
+    bool add_encoding();
+
     bool add_blank_line();
 
   public:
-    static int m_epollfd;
-    static int m_user_count;
+    static std::atomic<int> m_user_count;
+    static file_cache *m_file_cache;
+    static response_cache *m_response_cache;
+    static buffer_pool *m_buffer_pool;
+    static stats *m_stats;
+    static overload *m_overload;
+    static rate_limit *m_rate_limit;
+    static access_log *m_access_log;
+    static off_t m_write_quantum;    //一次write()最多发的字节数, 0为不限制
+
+    timer_state m_timer;
+    uint64_t m_dispatched;      //投递给线程池的时间(us), reactor写, 工作线程读
+    uint64_t m_arrival;         //当前请求第一个字节到达的时间(us), 只由reactor读写
 
   private:
+    std::atomic<unsigned> m_generation;     //每关闭一次加一, 时间轮据此丢弃旧连接的条目
+    std::atomic<int> m_busy;                //已投递给线程池还没处理完的次数
+    int m_epollfd;
     int m_sockfd;
     sockaddr_in m_address;
 
-    char m_read_buf[READ_BUFFER_SIZE];
+    char *m_read_buf;
+    int m_read_size;
     int m_read_idx;
     int m_checked_idx;
     int m_start_line;
-    char m_write_buf[WRITE_BUFFER_SIZE];
+    int m_request_start;
+    char *m_write_buf;
+    int m_write_size;
     int m_write_idx;
+    char *m_write_chunks[MAX_PIPELINE];     //本批次已写满的块, 整批发送完后归还
+    int m_write_chunk_count;
 
     CHECK_STATE m_check_state;
     METHOD m_method;
 
-    char m_real_file[FILENAME_LEN];
     char *m_url;
     char *m_version;
     char *m_host;
-    int m_content_length;
+    long m_content_length;
+    bool m_chunked;             //Transfer-Encoding: chunked
+    bool m_streaming;           //请求体写进m_upload, 不整个放进读缓冲区
+    header_field m_headers[HEADER_COUNT];
+    byte_range m_ranges[MAX_RANGES];
+    int m_range_count;
+    int m_accept_encoding;      //客户端接受的预压缩编码, 按file_encoding编号的位
+    int m_encoding;             //本次响应用的预压缩编码, -1表示原文件
+    bool m_vary;                //文件有预压缩版本, 响应要带Vary
     bool m_linger;
-
+    bool m_keep_alive;
+    bool m_inline;              //在reactor线程里处理, 可能阻塞的请求要留给线程池
+    bool m_deferred;            //请求已解析完, 等线程池调用do_request()
+    upstream *m_upstream;       //要转发到的上游, 不为空时请求由reactor代理
+    upload *m_upload;           //正在接收的上传, 第一次收请求体时才创建
+    const route *m_route;       //匹配到的路由
+    int m_reply_status;         //处理函数回的状态码, 0表示还没回
+    response_stream *m_stream;  //没生成完的流式响应, 这时后面的请求要等它结束
+    char *m_stream_buf;         //流式响应每一批的分块, 响应结束后归还
+    int m_stream_size;
+    int m_stream_len;
+    off_t m_stream_bytes;       //流式响应之前几批的字节数, 记访问日志用
+
+    file_ref m_file;
+    response_ref m_response;
     char *m_file_address;
+    int m_file_fd;
+    off_t m_file_offset;
     struct stat m_file_stat;
-    struct iovec m_iv[2];
+    batch_item m_batch[MAX_PIPELINE];
+    int m_batch_count;
+    struct iovec m_iv[MAX_PIPELINE * 2 + MAX_RANGES * 2 + 1];
     int m_iv_count;
+    int m_iv_idx;
+    off_t m_bytes_to_send;
+    off_t m_bytes_have_send;
 };
 
 #endif
@@ -0,0 +1,143 @@
+#include <string.h>
+#include <strings.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "http_parser.h"
+
+#define HEADER_HASH_SIZE 32
+
+static constexpr const char *header_names[HEADER_COUNT] = {
+    "",
+    "host",
+    "connection",
+    "content-length",
+    "content-type",
+    "transfer-encoding",
+    "range",
+    "if-range",
+    "if-none-match",
+    "if-modified-since",
+    "accept",
+    "accept-encoding",
+    "user-agent",
+    "cookie",
+    "expect",
+    "referer",
+    "upgrade"
+};
+
+static constexpr int name_length(const char *s) {
+    return *s ? 1 + name_length(s + 1) : 0;
+}
+
+static constexpr unsigned lower(char c) {
+    return (unsigned char) c | 0x20;
+}
+
+/* 长度, 首字符, 末字符就能把上面的名字区分开; 改动名字表后如果冲突, 编译时static_assert会报错 */
+static constexpr unsigned header_hash(const char *name, int len) {
+    return (len * 2 + lower(name[0]) + lower(name[len - 1]) * 27) & (HEADER_HASH_SIZE - 1);
+}
+
+static constexpr unsigned hash_of(int id) {
+    return header_hash(header_names[id], name_length(header_names[id]));
+}
+
+static constexpr bool collides(int id, int other) {
+    return other < HEADER_COUNT && ((other != id && hash_of(other) == hash_of(id)) || collides(id, other + 1));
+}
+
+static constexpr bool perfect(int id) {
+    return id == HEADER_COUNT || (!collides(id, 1) && perfect(id + 1));
+}
+
+static_assert(perfect(1), "header name hash has collisions, retune header_hash()");
+
+static constexpr header_id slot_owner(unsigned slot, int id) {
+    return id == HEADER_COUNT ? HEADER_UNKNOWN : hash_of(id) == slot ? (header_id) id : slot_owner(slot, id + 1);
+}
+
+#define SLOT(n) slot_owner(n, 1)
+
+static constexpr header_id header_table[HEADER_HASH_SIZE] = {
+    SLOT(0),  SLOT(1),  SLOT(2),  SLOT(3),  SLOT(4),  SLOT(5),  SLOT(6),  SLOT(7),
+    SLOT(8),  SLOT(9),  SLOT(10), SLOT(11), SLOT(12), SLOT(13), SLOT(14), SLOT(15),
+    SLOT(16), SLOT(17), SLOT(18), SLOT(19), SLOT(20), SLOT(21), SLOT(22), SLOT(23),
+    SLOT(24), SLOT(25), SLOT(26), SLOT(27), SLOT(28), SLOT(29), SLOT(30), SLOT(31)
+};
+
+#undef SLOT
+
+header_id lookup_header(const char *name, size_t len) {
+    if (len == 0) {
+        return HEADER_UNKNOWN;
+    }
+    header_id id = header_table[header_hash(name, len)];
+    const char *candidate = header_names[id];
+    if (id != HEADER_UNKNOWN && strncasecmp(name, candidate, len) == 0 && candidate[len] == '\0') {
+        return id;
+    }
+    return HEADER_UNKNOWN;
+}
+
+const char *header_name(header_id id) {
+    return header_names[id];
+}
+
+const char *find_eol_scalar(const char *begin, const char *end) {
+    for (; begin < end; ++begin) {
+        if (*begin == '\r' || *begin == '\n') {
+            break;
+        }
+    }
+    return begin;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* 每次比较16字节, 不足16字节的尾巴交给标量实现, 不会越界读 */
+__attribute__((target("sse4.2")))
+const char *find_eol_sse42(const char *begin, const char *end) {
+    const __m128i delims = _mm_setr_epi8('\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    while (end - begin >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) begin);
+        int idx = _mm_cmpestri(delims, 2, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16) {
+            return begin + idx;
+        }
+        begin += 16;
+    }
+    return find_eol_scalar(begin, end);
+}
+
+__attribute__((target("avx2")))
+const char *find_eol_avx2(const char *begin, const char *end) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    while (end - begin >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) begin);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, cr), _mm256_cmpeq_epi8(chunk, lf)));
+        if (mask) {
+            return begin + __builtin_ctz(mask);
+        }
+        begin += 32;
+    }
+    return find_eol_scalar(begin, end);
+}
+#endif
+
+static find_eol_fn select_find_eol() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return find_eol_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return find_eol_sse42;
+    }
+#endif
+    return find_eol_scalar;
+}
+
+find_eol_fn find_eol = select_find_eol();
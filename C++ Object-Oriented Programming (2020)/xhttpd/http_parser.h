@@ -0,0 +1,52 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+/* 需要解析的请求头, 其余的一律当作HEADER_UNKNOWN跳过 */
+enum header_id {
+    HEADER_UNKNOWN = 0,
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_USER_AGENT,
+    HEADER_COOKIE,
+    HEADER_EXPECT,
+    HEADER_REFERER,
+    HEADER_UPGRADE,
+    HEADER_COUNT
+};
+
+/* 一个请求头的值, 指向读缓冲区, 以'\0'结尾 */
+struct header_field {
+    char*   value;
+    int     length;
+};
+
+typedef const char *(*find_eol_fn)(const char *begin, const char *end);
+
+/* 按名字(不区分大小写)查请求头编号, 名字用编译期生成的完美哈希表定位, 只比较一次 */
+header_id lookup_header(const char *name, size_t len);
+
+const char *header_name(header_id id);
+
+/* 返回[begin, end)中第一个'\r'或'\n'的位置, 没有时返回end; 启动时按CPU选用AVX2/SSE4.2/标量实现 */
+extern find_eol_fn find_eol;
+
+const char *find_eol_scalar(const char *begin, const char *end);
+
+#if defined(__x86_64__) || defined(__i386__)
+const char *find_eol_sse42(const char *begin, const char *end);
+
+const char *find_eol_avx2(const char *begin, const char *end);
+#endif
+
+#endif
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "io_ring.h"
+
+static int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t size) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+io_ring::io_ring() :
+        m_fd(-1), m_features(0), m_sq_ptr(MAP_FAILED), m_sq_len(0), m_cq_ptr(MAP_FAILED), m_cq_len(0),
+        m_sq_head(NULL), m_sq_tail(NULL), m_sq_mask(0), m_sq_entries(0), m_sqes((io_uring_sqe *) MAP_FAILED),
+        m_sqes_len(0), m_sqe_tail(0), m_submitted(0), m_cq_head(NULL), m_cq_tail(NULL), m_cq_mask(0), m_cqes(NULL),
+        m_buf_ring((io_uring_buf_ring *) MAP_FAILED), m_buf_ring_len(0), m_buf_base(NULL), m_buf_count(0),
+        m_buf_size(0), m_buf_group(0) {
+}
+
+io_ring::~io_ring() {
+    if (m_buf_ring != MAP_FAILED) {
+        munmap(m_buf_ring, m_buf_ring_len);
+    }
+    delete[] m_buf_base;
+    if (m_sqes != MAP_FAILED) {
+        munmap(m_sqes, m_sqes_len);
+    }
+    if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr) {
+        munmap(m_cq_ptr, m_cq_len);
+    }
+    if (m_sq_ptr != MAP_FAILED) {
+        munmap(m_sq_ptr, m_sq_len);
+    }
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+}
+
+/* 需要单次mmap和带超时的io_uring_enter(5.11+), 不满足时返回false, 由调用方退回epoll */
+bool io_ring::init(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    m_fd = io_uring_setup(entries, &params);
+    if (m_fd < 0) {
+        return false;
+    }
+    m_features = params.features;
+    if (!(m_features & IORING_FEAT_SINGLE_MMAP) || !(m_features & IORING_FEAT_EXT_ARG)) {
+        return false;
+    }
+
+    m_sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (m_cq_len > m_sq_len) {
+        m_sq_len = m_cq_len;
+    }
+    m_sq_ptr = mmap(0, m_sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ptr == MAP_FAILED) {
+        return false;
+    }
+    m_cq_ptr = m_sq_ptr;
+    m_cq_len = m_sq_len;
+
+    m_sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = (io_uring_sqe *) mmap(0, m_sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                                   IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        return false;
+    }
+
+    char *sq = (char *) m_sq_ptr;
+    m_sq_head = (unsigned *) (sq + params.sq_off.head);
+    m_sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    m_sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    m_sq_entries = *(unsigned *) (sq + params.sq_off.ring_entries);
+    unsigned *array = (unsigned *) (sq + params.sq_off.array);
+    for (unsigned i = 0; i < m_sq_entries; ++i) {
+        array[i] = i;
+    }
+    m_sqe_tail = *m_sq_tail;
+    m_submitted = m_sqe_tail;
+
+    char *cq = (char *) m_cq_ptr;
+    m_cq_head = (unsigned *) (cq + params.cq_off.head);
+    m_cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    m_cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+}
+
+/* SQ满时先把已填好的提交掉, 还是满就返回NULL */
+io_uring_sqe *io_ring::get_sqe() {
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    if (m_sqe_tail - head >= m_sq_entries) {
+        submit(0, -1);
+        head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_sqe_tail - head >= m_sq_entries) {
+            return NULL;
+        }
+    }
+    io_uring_sqe *sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++m_sqe_tail;
+    return sqe;
+}
+
+/* 提交所有新填的sqe, 并等待至少wait_nr个完成; timeout_ms为-1时不限时 */
+int io_ring::submit(unsigned wait_nr, int timeout_ms) {
+    __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = m_sqe_tail - m_submitted;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    if (wait_nr && timeout_ms >= 0) {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (unsigned long) &ts;
+        ret = io_uring_enter(m_fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } else {
+        ret = io_uring_enter(m_fd, to_submit, wait_nr, flags, NULL, 0);
+    }
+    if (ret > 0) {
+        m_submitted += ret;
+    }
+    return ret;
+}
+
+/* 注册一组count个size字节的缓冲区(count须为2的幂), recv用IOSQE_BUFFER_SELECT从中取 */
+bool io_ring::setup_buffers(unsigned short group, unsigned count, unsigned size) {
+    m_buf_ring_len = count * sizeof(io_uring_buf);
+    m_buf_ring = (io_uring_buf_ring *) mmap(0, m_buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                            -1, 0);
+    if (m_buf_ring == MAP_FAILED) {
+        return false;
+    }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) m_buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+
+    m_buf_base = new char[(size_t) count * size];
+    m_buf_count = count;
+    m_buf_size = size;
+    m_buf_group = group;
+    m_buf_ring->tail = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        io_uring_buf &buf = ring_buffer(i);
+        buf.addr = (unsigned long) buffer(i);
+        buf.len = size;
+        buf.bid = i;
+    }
+    __atomic_store_n(&m_buf_ring->tail, (unsigned short) count, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* 数据拷走后把缓冲区还给内核 */
+void io_ring::recycle_buffer(unsigned short id) {
+    unsigned short tail = m_buf_ring->tail;
+    io_uring_buf &buf = ring_buffer(tail & (m_buf_count - 1));
+    buf.addr = (unsigned long) buffer(id);
+    buf.len = m_buf_size;
+    buf.bid = id;
+    __atomic_store_n(&m_buf_ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
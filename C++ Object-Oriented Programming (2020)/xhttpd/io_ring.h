@@ -0,0 +1,90 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * io_uring的最小封装, 直接用系统调用, 不依赖liburing.
+ * SQ数组在初始化时填成恒等映射, 取sqe只需移动本地的tail; submit()时一次发布并进入内核.
+ * 另外管理一组provided buffer ring, 给不指定缓冲区的recv用.
+ * 只能在一个线程里使用.
+ */
+class io_ring {
+public:
+    io_ring();
+
+    ~io_ring();
+
+    bool init(unsigned entries);
+
+    io_uring_sqe *get_sqe();
+
+    int submit(unsigned wait_nr, int timeout_ms);
+
+    template<typename F>
+    unsigned for_each_cqe(F handler);
+
+    bool setup_buffers(unsigned short group, unsigned count, unsigned size);
+
+    char *buffer(unsigned short id) const { return m_buf_base + (size_t) id * m_buf_size; }
+
+    unsigned buffer_size() const { return m_buf_size; }
+
+    void recycle_buffer(unsigned short id);
+
+    int fd() const { return m_fd; }
+
+private:
+    /* 不用bufs成员: 头文件里的柔性数组在C++下前面多了一个空结构体, 偏移不对 */
+    io_uring_buf &ring_buffer(unsigned index) const { return ((io_uring_buf *) m_buf_ring)[index]; }
+
+    int             m_fd;
+    unsigned        m_features;
+
+    void*           m_sq_ptr;
+    size_t          m_sq_len;
+    void*           m_cq_ptr;
+    size_t          m_cq_len;
+    unsigned*       m_sq_head;
+    unsigned*       m_sq_tail;
+    unsigned        m_sq_mask;
+    unsigned        m_sq_entries;
+    io_uring_sqe*   m_sqes;
+    size_t          m_sqes_len;
+    unsigned        m_sqe_tail;     //本地已填好的sqe位置
+    unsigned        m_submitted;    //已经交给内核的位置
+
+    unsigned*       m_cq_head;
+    unsigned*       m_cq_tail;
+    unsigned        m_cq_mask;
+    io_uring_cqe*   m_cqes;
+
+    io_uring_buf_ring*  m_buf_ring;
+    size_t              m_buf_ring_len;
+    char*               m_buf_base;
+    unsigned            m_buf_count;
+    unsigned            m_buf_size;
+    unsigned short      m_buf_group;
+};
+
+/* 依次处理已完成的cqe, 全部处理完后一次性移动head; handler里可以继续get_sqe() */
+template<typename F>
+unsigned io_ring::for_each_cqe(F handler) {
+    unsigned head = *m_cq_head;
+    unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+    while (head != tail) {
+        handler(m_cqes[head & m_cq_mask]);
+        ++head;
+        ++count;
+        if (head == tail) {
+            __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+    __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+#endif
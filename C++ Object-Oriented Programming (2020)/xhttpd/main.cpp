@@ -9,17 +9,27 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <algorithm>
+#include <vector>
 
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "file_cache.h"
+#include "response_cache.h"
+#include "buffer_pool.h"
+#include "stats.h"
+#include "overload.h"
+#include "upstream.h"
+#include "access_log.h"
+#include "upload.h"
+#include "rate_limit.h"
+#include "router.h"
+#include "handlers.h"
+#include "reactor.h"
+#include "topology.h"
 
-#define MAX_FD 65536
-#define MAX_EVENT_NUMBER 10000
-
-extern int addfd(int epollfd, int fd, bool one_shot);
-
-extern int removefd(int epollfd, int fd);
+extern const char *doc_root;
 
 void addsig(int sig, void( handler )(int), bool restart = true) {
     struct sigaction sa;
@@ -32,101 +42,305 @@ void addsig(int sig, void( handler )(int), bool restart = true) {
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-void show_error(int connfd, const char *info) {
-    printf("%s", info);
-    send(connfd, info, strlen(info), 0);
-    close(connfd);
+/* SIGTERM/SIGINT: 各reactor退出事件循环, main回收所有线程和连接后退出 */
+void stop_server(int) {
+    reactor::request_stop();
+}
+
+/* logrotate改名后发SIGUSR1, 后台线程下一轮重新打开日志文件 */
+void reopen_log(int) {
+    if (http_conn::m_access_log) {
+        http_conn::m_access_log->reopen();
+    }
 }
 
+void usage(const char *name) {
+    printf("usage: %s [-r reactor_number] [-f fd_cache_size] [-m response_cache_bytes] [-b buffer_pool_bytes]\n"
+           "       [-k idle_timeout] [-t header_timeout] [-w write_timeout] [-e epoll|uring|coro]\n"
+           "       [-l backlog] [-a accept_batch] [-d defer_accept_seconds] [-o fastopen_queue]\n"
+           "       [-s shed_target_ms] [-i shed_interval_ms] [-n] [-P prefix=upstream[,connect_ms[,read_ms]]]...\n"
+           "       [-z large_request_bytes] [-q write_quantum_bytes] [-L path[,rotate_mb[,drop|wait]]]\n"
+           "       [-U prefix=dir[,max_mb]] [-R rate[,burst[,slots]]] [-T worker_threads] [-Q max_queued_requests]\n"
+           "       [-A none|cpu|node] port_number\n"
+           "       -e coro runs each connection as a coroutine on its reactor thread, without the pool\n"
+           "       -n serve cached responses on the reactor thread, only blocking work goes to the pool\n"
+           "       -P proxy urls under prefix to host:port or unix:/path, may be repeated\n"
+           "       -z requests for files at least this large queue behind small ones, 0 keeps FIFO order\n"
+           "       -q yield the reactor after sending this many bytes of one response, 0 for no limit\n"
+           "       -L write an access log, rotated to path.1 past rotate_mb; when the buffer is full drop (default) or wait\n"
+           "       -U store PUT/POST bodies for urls under prefix as files in dir, at most max_mb each (0 for no limit)\n"
+           "       -R allow each client address rate requests per second with bursts of burst, tracking up to slots addresses\n"
+           "       -Q reject new requests once this many are waiting for a worker, counted per worker pool\n"
+           "       -A pin reactors and workers to single cpus or to numa nodes; each node used gets its own worker pool,\n"
+           "          fed only by the reactors on that node, and buffers allocated on it\n",
+           basename(name));
+}
 
 int main(int argc, char *argv[]) {
-    if (argc <= 1) {
-        printf("usage: %s ip_address port_number\n", basename(argv[0]));
+    int reactor_number = 1;
+    int fd_cache_size = 4096;
+    long response_cache_bytes = 64 * 1024 * 1024;
+    long buffer_pool_bytes = 32 * 1024 * 1024;
+    reactor::engine engine = reactor::ENGINE_EPOLL;
+    int shed_target = 5;
+    int shed_interval = 100;
+    int worker_number = 4;
+    int max_requests = 10000;
+    cpu_topology::mode affinity = cpu_topology::NONE;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:f:m:b:k:t:w:e:l:a:d:o:s:i:nP:z:q:L:U:R:T:Q:A:")) != -1) {
+        switch (opt) {
+        case 'r':
+            reactor_number = atoi(optarg);
+            break;
+        case 'f':
+            fd_cache_size = atoi(optarg);
+            break;
+        case 'm':
+            response_cache_bytes = atol(optarg);
+            break;
+        case 'b':
+            buffer_pool_bytes = atol(optarg);
+            break;
+        case 'k':
+            reactor::m_idle_timeout = atoi(optarg) * 1000;
+            break;
+        case 't':
+            reactor::m_header_timeout = atoi(optarg) * 1000;
+            break;
+        case 'w':
+            reactor::m_write_timeout = atoi(optarg) * 1000;
+            break;
+        case 'e':
+            if (strcmp(optarg, "uring") == 0) {
+                engine = reactor::ENGINE_URING;
+            } else if (strcmp(optarg, "coro") == 0) {
+                engine = reactor::ENGINE_CORO;
+            } else if (strcmp(optarg, "epoll") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'l':
+            reactor::m_backlog = atoi(optarg);
+            break;
+        case 'a':
+            reactor::m_accept_batch = atoi(optarg);
+            break;
+        case 'd':
+            reactor::m_defer_accept = atoi(optarg);
+            break;
+        case 'o':
+            reactor::m_fastopen = atoi(optarg);
+            break;
+        case 's':
+            shed_target = atoi(optarg);
+            break;
+        case 'i':
+            shed_interval = atoi(optarg);
+            break;
+        case 'n':
+            reactor::m_run_inline = true;
+            break;
+        case 'z':
+            reactor::m_bulk_size = atol(optarg);
+            break;
+        case 'q':
+            http_conn::m_write_quantum = atol(optarg);
+            break;
+        case 'L':
+            delete http_conn::m_access_log;
+            http_conn::m_access_log = access_log::create(optarg);
+            if (!http_conn::m_access_log) {
+                printf("bad access log: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'T':
+            worker_number = atoi(optarg);
+            break;
+        case 'Q':
+            max_requests = atoi(optarg);
+            break;
+        case 'A':
+            if (!cpu_topology::parse_mode(optarg, affinity)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'R':
+            delete http_conn::m_rate_limit;
+            http_conn::m_rate_limit = rate_limit::create(optarg);
+            if (!http_conn::m_rate_limit) {
+                printf("bad rate limit: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'U':
+            if (!upload::configure(optarg)) {
+                printf("bad upload directory: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            if (!upstream::add(optarg)) {
+                printf("bad upstream: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || reactor_number <= 0 || fd_cache_size < 0 || response_cache_bytes < 0 || buffer_pool_bytes < 0
+        || reactor::m_idle_timeout <= 0 || reactor::m_header_timeout <= 0 || reactor::m_write_timeout <= 0
+        || reactor::m_backlog <= 0 || reactor::m_accept_batch <= 0 || reactor::m_defer_accept < 0
+        || reactor::m_fastopen < 0 || shed_target < 0 || shed_interval <= 0
+        || reactor::m_bulk_size < 0 || http_conn::m_write_quantum < 0 || worker_number <= 0 || max_requests <= 0) {
+        usage(argv[0]);
         return 1;
     }
-//    const char* ip = argv[1];
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
+    if (engine != reactor::ENGINE_EPOLL && upstream::count() > 0) {
+        printf("proxy needs the epoll engine, falling back to epoll\n");
+        engine = reactor::ENGINE_EPOLL;
+    }
 
     addsig(SIGPIPE, SIG_IGN);
-
-    threadpool<http_conn> *pool = NULL;
-    try {
-        pool = new threadpool<http_conn>;
-    }
-    catch (...) {
+    if (!reactor::init_stop()) {
+        printf("create the stop eventfd failed\n");
         return 1;
     }
+    addsig(SIGTERM, stop_server);
+    addsig(SIGINT, stop_server);
+    if (http_conn::m_access_log) {
+        addsig(SIGUSR1, reopen_log);
+        if (!http_conn::m_access_log->start()) {
+            printf("start the access log thread failed\n");
+            return 1;
+        }
+    }
 
-    http_conn *users = new http_conn[MAX_FD];
-    assert(users);
-    int user_count = 0;
+    /*
+     * 不绑定时所有reactor共用一个线程池. 绑定时每个用到的NUMA节点一个线程池, 节点上的reactor只投递给本节点的工作线程,
+     * 连接的缓冲区由本节点的线程分配和访问, 请求不会跨节点搬运. CPU模式下每个节点先给reactor分CPU, 工作线程接着往后排.
+     */
+    cpu_topology topology;
+    int nodes = affinity == cpu_topology::NONE ? 1 : std::min(topology.nodes(), reactor_number);
+    std::vector<threadpool<http_conn> *> pools(nodes, (threadpool<http_conn> *) NULL);
+    for (int n = 0; n < nodes; ++n) {
+        int reactors_here = (reactor_number - n + nodes - 1) / nodes;
+        int workers_here = std::max(1, worker_number / nodes + (n < worker_number % nodes ? 1 : 0));
+        std::vector<placement> places;
+        for (int i = 0; i < workers_here; ++i) {
+            places.push_back(topology.place(affinity, n, reactors_here + i));
+        }
+        try {
+            pools[n] = new threadpool<http_conn>(workers_here, max_requests, places);
+        }
+        catch (...) {
+            return 1;
+        }
+    }
+
+    http_conn::m_file_cache = new file_cache(doc_root, fd_cache_size);
+    if (!http_conn::m_file_cache->start()) {
+        printf("inotify unavailable, file cache disabled\n");
+    }
+    if (response_cache_bytes > 0) {
+        http_conn::m_response_cache = new response_cache(response_cache_bytes);
+    }
 
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(listenfd >= 0);
+    http_conn::m_buffer_pool = new buffer_pool(buffer_pool_bytes, nodes);
 
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero(&address, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = htonl(INADDR_ANY);
-    address.sin_port = htons(port);
+    //-s 0关闭按排队时间拒绝, 线程池队列满时仍然回503
+    http_conn::m_overload = new overload(shed_target * 1000UL, shed_interval * 1000UL);
 
-    int flag = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-    ret = bind(listenfd, (struct sockaddr *) &address, sizeof(address));
-    assert(ret >= 0);
+    http_conn::m_stats = new stats;
+    http_conn::m_stats->add_gauge("connections_active", [] { return (long) http_conn::m_user_count.load(); });
+    http_conn::m_stats->add_gauge("threadpool_queue", [pools] {
+        long n = 0;
+        for (size_t i = 0; i < pools.size(); ++i) {
+            n += pools[i]->size();
+        }
+        return n;
+    });
+    http_conn::m_stats->add_gauge("overloaded", [] { return (long) http_conn::m_overload->overloaded(); });
+    http_conn::m_stats->add_gauge("queue_delay_last_us", [] { return (long) http_conn::m_overload->last_sojourn(); });
+    http_conn::m_stats->add_gauge("buffer_pool_bytes", [] { return http_conn::m_buffer_pool->in_use(); });
+    if (http_conn::m_rate_limit) {
+        http_conn::m_stats->add_gauge("rate_limit_addresses", [] { return http_conn::m_rate_limit->tracked(); });
+    }
+    if (http_conn::m_access_log) {
+        http_conn::m_stats->add_gauge("access_log_dropped", [] { return http_conn::m_access_log->dropped(); });
+    }
+    if (http_conn::m_response_cache) {
+        http_conn::m_stats->add_gauge("response_cache_hits", [] {
+            return (long) http_conn::m_response_cache->hits();
+        });
+        http_conn::m_stats->add_gauge("response_cache_misses", [] {
+            return (long) http_conn::m_response_cache->misses();
+        });
+    }
 
-    ret = listen(listenfd, 20);
-    assert(ret >= 0);
+    //路由表在reactor启动前建好, 之后只读
+    add_builtin_routes();
+    router::compile();
 
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
-    assert(epollfd != -1);
-    addfd(epollfd, listenfd, false);
-    http_conn::m_epollfd = epollfd;
+    http_conn *users = new http_conn[MAX_FD];
+    assert(users);
 
-    while (true) {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-        if ((number < 0) && (errno != EINTR)) {
-            printf("epoll failure\n");
-            break;
+    reactor **reactors = new reactor *[reactor_number];
+    for (int i = 0; i < reactor_number; ++i) {
+        try {
+            reactors[i] = new reactor(port, reactor_number > 1, users, pools[i % nodes], engine);
+            reactors[i]->place(topology.place(affinity, i % nodes, i / nodes));
         }
-
-        for (int i = 0; i < number; ++i) {
-            int sockfd = events[i].data.fd;
-            if (sockfd == listenfd) {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr *) &client_address, &client_addrlength);
-                if (connfd < 0) {
-                    printf("errno is: %d\n", errno);
-                    continue;
-                }
-                if (http_conn::m_user_count >= MAX_FD) {
-                    show_error(connfd, "Internal server busy");
-                    continue;
-                }
-
-                users[connfd].init(connfd, client_address);
-            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                users[sockfd].close_conn();
-            } else if (events[i].events & EPOLLIN) {
-                if (users[sockfd].read()) {
-                    pool->append(users + sockfd);
-                } else {
-                    users[sockfd].close_conn();
-                }
-            } else if (events[i].events & EPOLLOUT) {
-                if (!users[sockfd].write()) {
-                    users[sockfd].close_conn();
-                }
-            } else {}
+        catch (...) {
+            if (i == 0 && engine == reactor::ENGINE_URING) {
+                //内核不支持或被禁用了io_uring, 退回epoll
+                printf("io_uring unavailable, falling back to epoll\n");
+                engine = reactor::ENGINE_EPOLL;
+                --i;
+                continue;
+            }
+            printf("create the %dth reactor failed\n", i);
+            return 1;
+        }
+    }
+    for (int i = 1; i < reactor_number; ++i) {
+        if (!reactors[i]->start()) {
+            printf("start the %dth reactor failed\n", i);
+            return 1;
         }
     }
 
-    close(epollfd);
-    close(listenfd);
+    reactors[0]->run();
+
+    //退出顺序: 先等reactor, 再等工作线程处理完手上的请求, 之后连接只有本线程访问, 逐个关闭(未完成的上传删掉临时文件)
+    for (int i = 1; i < reactor_number; ++i) {
+        reactors[i]->join();
+    }
+    for (int n = 0; n < nodes; ++n) {
+        delete pools[n];
+    }
+    for (int i = 0; i < reactor_number; ++i) {
+        delete reactors[i];
+    }
+    delete[] reactors;
+    for (int fd = 0; fd < MAX_FD; ++fd) {
+        users[fd].close_conn();
+    }
     delete[] users;
-    delete pool;
+    delete http_conn::m_buffer_pool;
+    delete http_conn::m_stats;
+    delete http_conn::m_overload;
+    delete http_conn::m_response_cache;
+    delete http_conn::m_file_cache;
+    delete http_conn::m_access_log;
+    delete http_conn::m_rate_limit;
+    upstream::clear();
+    router::clear();
     return 0;
 }
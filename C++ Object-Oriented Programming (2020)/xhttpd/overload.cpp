@@ -0,0 +1,57 @@
+#include <string.h>
+
+#include "overload.h"
+
+static const char overload_response[] =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 20\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "Service Unavailable\n";
+
+overload::overload(uint64_t target_us, uint64_t interval_us) :
+        m_target(target_us), m_interval(interval_us), m_window_end(0), m_window_min(UINT64_MAX), m_last(0),
+        m_last_time(0), m_overloaded(false) {
+}
+
+void overload::observe(uint64_t sojourn_us, uint64_t now_us) {
+    if (m_target == 0) {
+        return;
+    }
+    m_last.store(sojourn_us, std::memory_order_relaxed);
+    m_last_time.store(now_us, std::memory_order_relaxed);
+
+    uint64_t min = m_window_min.load(std::memory_order_relaxed);
+    while (sojourn_us < min && !m_window_min.compare_exchange_weak(min, sojourn_us, std::memory_order_relaxed)) {
+    }
+
+    //窗口结束时由抢到的那个线程做判断并开始下一个窗口
+    uint64_t end = m_window_end.load(std::memory_order_relaxed);
+    if (now_us < end || !m_window_end.compare_exchange_strong(end, now_us + m_interval, std::memory_order_relaxed)) {
+        return;
+    }
+    min = m_window_min.exchange(UINT64_MAX, std::memory_order_relaxed);
+    if (end != 0) {
+        m_overloaded.store(min != UINT64_MAX && min > m_target, std::memory_order_relaxed);
+    }
+}
+
+/* 超过一个interval没有新的报告, 最近的等待时间已经过时, 不再据此拒绝 */
+bool overload::admit(uint64_t now_us) const {
+    if (!m_overloaded.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    if (now_us > m_last_time.load(std::memory_order_relaxed) + m_interval) {
+        return true;
+    }
+    return m_last.load(std::memory_order_relaxed) <= m_target;
+}
+
+const char *overload::response() {
+    return overload_response;
+}
+
+int overload::response_length() {
+    return sizeof(overload_response) - 1;
+}
@@ -0,0 +1,39 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+ * CoDel风格的过载判断: 工作线程每取到一个任务就报告它在队列里等了多久(sojourn).
+ * 一个interval内最小的等待时间都超过target, 说明队列里有排不掉的积压(突发造成的短暂排队不算),
+ * 进入过载状态; 过载时最近一次的等待时间仍超过target, reactor就直接回503, 把排队时间压回target附近.
+ * 任意线程可调用, 只用relaxed原子量.
+ */
+class overload {
+public:
+    overload(uint64_t target_us, uint64_t interval_us);
+
+    void observe(uint64_t sojourn_us, uint64_t now_us);
+
+    bool admit(uint64_t now_us) const;
+
+    bool overloaded() const { return m_overloaded.load(std::memory_order_relaxed); }
+
+    uint64_t last_sojourn() const { return m_last.load(std::memory_order_relaxed); }
+
+    static const char *response();
+
+    static int response_length();
+
+private:
+    uint64_t                m_target;       //可以接受的排队时间(us), 0为不限制
+    uint64_t                m_interval;     //判断积压的窗口(us)
+    std::atomic<uint64_t>   m_window_end;   //当前窗口的结束时间
+    std::atomic<uint64_t>   m_window_min;   //当前窗口里最小的等待时间
+    std::atomic<uint64_t>   m_last;         //最近一次的等待时间
+    std::atomic<uint64_t>   m_last_time;    //最近一次报告的时间
+    std::atomic<bool>       m_overloaded;
+};
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "http_parser.h"
+
+/* 典型浏览器请求, 头部约600字节 */
+static const char *sample =
+    "GET /static/js/app.3f9c2d1e.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; _ga=GA1.2.1234567890.1697000000\r\n"
+    "If-None-Match: \"5f2a-64e1c3b0\"\r\n"
+    "If-Modified-Since: Sun, 20 Aug 2023 08:00:00 GMT\r\n"
+    "\r\n";
+
+/* 改造前的解析: 逐字节找CRLF, 再用strncasecmp逐个比较头部名(去掉了未知头部的printf) */
+static int legacy_parse(char *buf, int len) {
+    int checked = 0, start = 0, found = 0;
+    while (true) {
+        for (; checked < len; ++checked) {
+            if (buf[checked] == '\r' && checked + 1 < len && buf[checked + 1] == '\n') {
+                buf[checked++] = '\0';
+                buf[checked++] = '\0';
+                break;
+            }
+        }
+        char *text = buf + start;
+        start = checked;
+        if (text[0] == '\0' || checked >= len) {
+            return found;
+        }
+        if (strncasecmp(text, "Connection:", 11) == 0) {
+            text += 11;
+            text += strspn(text, " \t");
+            found += strcasecmp(text, "keep-alive") == 0;
+        } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
+            text += 15;
+            text += strspn(text, " \t");
+            found += atol(text) > 0;
+        } else if (strncasecmp(text, "Host:", 5) == 0) {
+            text += 5;
+            text += strspn(text, " \t");
+            found += text[0] != '\0';
+        }
+    }
+}
+
+static int table_parse(char *buf, int len, find_eol_fn find) {
+    header_field headers[HEADER_COUNT];
+    memset(headers, 0, sizeof(headers));
+    const char *end = buf + len;
+    char *text = buf;
+    int found = 0;
+    while (true) {
+        char *eol = (char *) find(text, end);
+        if (eol + 1 >= end) {
+            return found;
+        }
+        eol[0] = '\0';
+        eol[1] = '\0';
+        if (text[0] == '\0') {
+            return found;
+        }
+        char *colon = (char *) memchr(text, ':', eol - text);
+        if (colon) {
+            header_id id = lookup_header(text, colon - text);
+            if (id != HEADER_UNKNOWN) {
+                char *value = colon + 1;
+                value += strspn(value, " \t");
+                headers[id].value = value;
+                headers[id].length = eol - value;
+                ++found;
+            }
+        }
+        text = eol + 2;
+    }
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template<typename F>
+static void run(const char *name, long rounds, F parse) {
+    int len = strlen(sample);
+    char buf[2048];
+    long found = 0;
+    double start = now();
+    for (long i = 0; i < rounds; ++i) {
+        memcpy(buf, sample, len);
+        found += parse(buf, len);
+    }
+    double elapsed = now() - start;
+    printf("%-10s %10.1f %12.1f %10ld\n", name, elapsed / rounds * 1e9, (double) len * rounds / elapsed / 1e6,
+           found / rounds);
+}
+
+struct legacy {
+    int operator()(char *buf, int len) const { return legacy_parse(buf, len); }
+};
+
+struct table {
+    find_eol_fn find;
+
+    int operator()(char *buf, int len) const { return table_parse(buf, len, find); }
+};
+
+int main(int argc, char *argv[]) {
+    long rounds = argc > 1 ? atol(argv[1]) : 2000000;
+    if (rounds <= 0) {
+        printf("usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-10s %10s %12s %10s\n", "parser", "ns/req", "MB/s", "headers");
+    run("legacy", rounds, legacy());
+    table scalar = {find_eol_scalar};
+    run("scalar", rounds, scalar);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        table sse42 = {find_eol_sse42};
+        run("sse4.2", rounds, sse42);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        table avx2 = {find_eol_avx2};
+        run("avx2", rounds, avx2);
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <brotli/encode.h>
+#include <zlib.h>
+
+/*
+ * 离线生成预压缩文件: 遍历目录, 给每个值得压缩的文件在旁边生成.gz和.br, 多线程并行.
+ * 压缩后不比原文件小的不生成; 已有的压缩文件比原文件新时跳过(-f强制重新生成).
+ * xhttpd只用不比原文件旧的压缩文件, 原文件更新后重新跑一遍即可.
+ */
+struct task {
+    std::string path;
+    off_t       size;
+};
+
+struct options {
+    int     threads;
+    off_t   min_size;       //小于这个大小的文件不压缩
+    bool    force;
+    bool    gzip;
+    bool    brotli;
+};
+
+static options opts = {4, 256, false, true, true};
+static std::vector<task> tasks;
+static std::atomic<size_t> next_task(0);
+static std::atomic<long> bytes_in(0);
+static std::atomic<long> bytes_gz(0);
+static std::atomic<long> bytes_br(0);
+static std::atomic<int> files_done(0);
+static std::atomic<int> files_failed(0);
+
+/* 本身已经压缩过的格式, 再压缩没有收益 */
+static const char *skip_suffixes[] = {
+        ".gz", ".br", ".zip", ".bz2", ".xz", ".zst", ".7z", ".rar",
+        ".png", ".jpg", ".jpeg", ".gif", ".webp", ".avif", ".ico",
+        ".mp3", ".mp4", ".webm", ".ogg", ".woff", ".woff2", ".pdf"
+};
+
+static bool compressible(const char *path) {
+    size_t len = strlen(path);
+    for (size_t i = 0; i < sizeof(skip_suffixes) / sizeof(skip_suffixes[0]); ++i) {
+        size_t n = strlen(skip_suffixes[i]);
+        if (len > n && strcasecmp(path + len - n, skip_suffixes[i]) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool up_to_date(const std::string &sidecar, const struct stat &st) {
+    struct stat sst;
+    return stat(sidecar.c_str(), &sst) == 0 && sst.st_mtime >= st.st_mtime;
+}
+
+static int collect(const char *path, const struct stat *st, int type, struct FTW *) {
+    if (type == FTW_F && S_ISREG(st->st_mode) && st->st_size >= opts.min_size && compressible(path)) {
+        task t = {path, st->st_size};
+        tasks.push_back(t);
+    }
+    return 0;
+}
+
+static bool read_file(const std::string &path, std::string &data) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        data.append(buf, n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+/* 先写临时文件再rename, xhttpd不会读到写了一半的压缩文件 */
+static bool write_file(const std::string &path, const std::string &data, mode_t mode) {
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode & 0777);
+    if (fd < 0) {
+        return false;
+    }
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t n = write(fd, data.data() + off, data.size() - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        off += n;
+    }
+    if (close(fd) < 0 || off != data.size() || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool compress_gzip(const std::string &in, std::string &out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out.resize(deflateBound(&zs, in.size()));
+    zs.next_in = (Bytef *) in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef *) &out[0];
+    zs.avail_out = out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+static bool compress_brotli(const std::string &in, std::string &out) {
+    size_t size = BrotliEncoderMaxCompressedSize(in.size());
+    out.resize(size ? size : in.size() + 1024);
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, in.size(),
+                               (const uint8_t *) in.data(), &size, (uint8_t *) &out[0])) {
+        return false;
+    }
+    out.resize(size);
+    return true;
+}
+
+/* 压缩结果不比原文件小时删掉旧的压缩文件, 免得xhttpd继续发一个过期的版本 */
+static bool build(const task &t, const struct stat &st, const std::string &data, const char *suffix,
+                  bool (*compress)(const std::string &, std::string &), std::atomic<long> &total) {
+    std::string sidecar = t.path + suffix;
+    if (!opts.force && up_to_date(sidecar, st)) {
+        return true;
+    }
+    std::string out;
+    if (!compress(data, out)) {
+        return false;
+    }
+    if (out.size() >= data.size()) {
+        unlink(sidecar.c_str());
+        return true;
+    }
+    total += out.size();
+    return write_file(sidecar, out, st.st_mode);
+}
+
+static void *worker(void *) {
+    while (true) {
+        size_t index = next_task++;
+        if (index >= tasks.size()) {
+            break;
+        }
+        const task &t = tasks[index];
+        struct stat st;
+        std::string data;
+        if (stat(t.path.c_str(), &st) < 0 || !read_file(t.path, data)) {
+            printf("read %s failed: %s\n", t.path.c_str(), strerror(errno));
+            ++files_failed;
+            continue;
+        }
+        bool ok = true;
+        if (opts.gzip) {
+            ok = build(t, st, data, ".gz", compress_gzip, bytes_gz) && ok;
+        }
+        if (opts.brotli) {
+            ok = build(t, st, data, ".br", compress_brotli, bytes_br) && ok;
+        }
+        if (!ok) {
+            printf("compress %s failed\n", t.path.c_str());
+            ++files_failed;
+            continue;
+        }
+        bytes_in += data.size();
+        ++files_done;
+    }
+    return NULL;
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [-j threads] [-m min_size] [-f] [-G] [-B] doc_root\n"
+           "       -f rebuild up-to-date sidecars, -G skip .gz, -B skip .br\n", basename((char *) name));
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "j:m:fGB")) != -1) {
+        switch (opt) {
+        case 'j':
+            opts.threads = atoi(optarg);
+            break;
+        case 'm':
+            opts.min_size = atol(optarg);
+            break;
+        case 'f':
+            opts.force = true;
+            break;
+        case 'G':
+            opts.gzip = false;
+            break;
+        case 'B':
+            opts.brotli = false;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || opts.threads <= 0 || opts.min_size < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (nftw(argv[optind], collect, 64, FTW_PHYS) != 0) {
+        printf("walk %s failed: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    std::vector<pthread_t> threads(opts.threads);
+    for (int i = 0; i < opts.threads; ++i) {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+            printf("create the %dth thread failed\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < opts.threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%d files, %d failed, %ld bytes in", files_done.load(), files_failed.load(), bytes_in.load());
+    if (opts.gzip) {
+        printf(", %ld bytes gzip", bytes_gz.load());
+    }
+    if (opts.brotli) {
+        printf(", %ld bytes brotli", bytes_br.load());
+    }
+    printf("\n");
+    return files_failed.load() ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+#include <atomic>
+#include <list>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "locker.h"
+#include "threadpool.h"
+
+/* 改造前的线程池: std::list + 互斥锁 + 信号量, 作为对照组 */
+template<typename T>
+class locked_pool {
+public:
+    explicit locked_pool(int thread_number, int max_requests = 10000) : m_max_requests(max_requests) {
+        for (int i = 0; i < thread_number; ++i) {
+            pthread_t tid;
+            pthread_create(&tid, NULL, worker, this);
+            pthread_detach(tid);
+        }
+    }
+
+    bool append(T *request) {
+        m_queuelocker.lock();
+        if (m_workqueue.size() > (size_t) m_max_requests) {
+            m_queuelocker.unlock();
+            return false;
+        }
+        m_workqueue.push_back(request);
+        m_queuelocker.unlock();
+        m_queuestat.post();
+        return true;
+    }
+
+private:
+    static void *worker(void *arg) {
+        locked_pool *pool = (locked_pool *) arg;
+        while (true) {
+            pool->m_queuestat.wait();
+            pool->m_queuelocker.lock();
+            if (pool->m_workqueue.empty()) {
+                pool->m_queuelocker.unlock();
+                continue;
+            }
+            T *request = pool->m_workqueue.front();
+            pool->m_workqueue.pop_front();
+            pool->m_queuelocker.unlock();
+            request->process();
+        }
+        return NULL;
+    }
+
+    int             m_max_requests;
+    std::list<T*>   m_workqueue;
+    locker          m_queuelocker;
+    sem             m_queuestat;
+};
+
+struct task {
+    static std::atomic<long> done;
+
+    void process() {
+        done.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+std::atomic<long> task::done(0);
+
+struct producer_arg {
+    void *pool;
+    task *tasks;
+    long count;
+};
+
+template<typename P>
+void *produce(void *arg) {
+    producer_arg *p = (producer_arg *) arg;
+    P *pool = (P *) p->pool;
+    for (long i = 0; i < p->count; ++i) {
+        while (!pool->append(p->tasks + i)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 线程池对象在进程退出前不析构: 两种池的工作线程都是detach的 */
+template<typename P>
+double run(int threads, int producers, long total, task *tasks) {
+    P *pool = new P(threads);
+    task::done = 0;
+    pthread_t *tids = new pthread_t[producers];
+    producer_arg *args = new producer_arg[producers];
+    long per = total / producers;
+
+    double start = now();
+    for (int i = 0; i < producers; ++i) {
+        args[i].pool = pool;
+        args[i].tasks = tasks + i * per;
+        args[i].count = per;
+        pthread_create(tids + i, NULL, produce<P>, args + i);
+    }
+    for (int i = 0; i < producers; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    while (task::done.load() < per * producers) {
+        sched_yield();
+    }
+    double elapsed = now() - start;
+
+    delete[] tids;
+    delete[] args;
+    return per * producers / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    long total = argc > 1 ? atol(argv[1]) : 1000000;
+    int producers = argc > 2 ? atoi(argv[2]) : 1;
+    if (total <= 0 || producers <= 0) {
+        printf("usage: %s [tasks] [producers]\n", argv[0]);
+        return 1;
+    }
+
+    task *tasks = new task[total];
+    printf("%8s %14s %14s\n", "threads", "locked Mops/s", "ws Mops/s");
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        double old_rate = run<locked_pool<task> >(threads, producers, total, tasks);
+        double new_rate = run<threadpool<task> >(threads, producers, total, tasks);
+        printf("%8d %14.3f %14.3f\n", threads, old_rate, new_rate);
+    }
+    delete[] tasks;
+    return 0;
+}
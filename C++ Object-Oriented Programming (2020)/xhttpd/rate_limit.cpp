@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rate_limit.h"
+
+static const char rate_limit_response[] =
+        "HTTP/1.1 429 Too Many Requests\r\n"
+        "Content-Length: 18\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "Too Many Requests\n";
+
+static const uint32_t UNIT = 1000;      //一个令牌
+
+rate_limit::rate_limit(unsigned rate, unsigned burst, int slots) :
+        m_rate(rate), m_capacity(burst * UNIT), m_tracked(0) {
+    int per_shard = 1;
+    m_shard_bits = 0;
+    while (per_shard * SHARDS < slots) {
+        per_shard <<= 1;
+        ++m_shard_bits;
+    }
+    m_shard_mask = per_shard - 1;
+    //空槽的桶是满的, 被占用时不用再初始化
+    m_slots = new slot[per_shard * SHARDS];
+    for (int i = 0; i < per_shard * SHARDS; ++i) {
+        m_slots[i].key.store(0, std::memory_order_relaxed);
+        m_slots[i].state.store(m_capacity, std::memory_order_relaxed);
+    }
+}
+
+rate_limit::~rate_limit() {
+    delete[] m_slots;
+}
+
+rate_limit *rate_limit::create(const char *spec) {
+    char *end = NULL;
+    long rate = strtol(spec, &end, 10);
+    long burst = rate;
+    long slots = 65536;
+    if (*end == ',') {
+        burst = strtol(end + 1, &end, 10);
+    }
+    if (*end == ',') {
+        slots = strtol(end + 1, &end, 10);
+    }
+    //令牌数以千分之一为单位存在32位里
+    if (*end != '\0' || rate <= 0 || burst <= 0 || burst > 4000000 || rate > 4000000 || slots < SHARDS
+        || slots > (1L << 26)) {
+        return NULL;
+    }
+    return new rate_limit(rate, burst, slots);
+}
+
+/* 按经过的时间补充后的令牌数; 其它线程写进去的时间可能比now稍晚, 这时不补 */
+uint32_t rate_limit::tokens(uint64_t state, uint32_t now) const {
+    uint32_t last = (uint32_t) (state >> 32);
+    uint64_t tokens = (uint32_t) state;
+    int32_t elapsed = (int32_t) (now - last);
+    if (elapsed > 0) {
+        tokens += (uint64_t) elapsed * m_rate;
+    }
+    return tokens < m_capacity ? (uint32_t) tokens : m_capacity;
+}
+
+rate_limit::slot *rate_limit::find(in_addr_t addr, uint32_t now) {
+    uint32_t hash = addr * 0x9E3779B1U;
+    slot *shard = m_slots + ((hash >> 26) << m_shard_bits);
+    slot *idle = NULL;
+    in_addr_t idle_key = 0;
+    for (int i = 0; i < MAX_PROBE && i <= m_shard_mask; ++i) {
+        slot &s = shard[(hash + i) & m_shard_mask];
+        in_addr_t key = s.key.load(std::memory_order_acquire);
+        if (key == addr) {
+            return &s;
+        }
+        if (key == 0) {
+            //空槽后面不会有这个地址, 占用它; 被别的线程抢先时再看一眼是不是同一个地址
+            if (s.key.compare_exchange_strong(key, addr, std::memory_order_acq_rel)) {
+                m_tracked.fetch_add(1, std::memory_order_relaxed);
+                return &s;
+            }
+            if (key == addr) {
+                return &s;
+            }
+            continue;
+        }
+        if (!idle && tokens(s.state.load(std::memory_order_relaxed), now) == m_capacity) {
+            idle = &s;
+            idle_key = key;
+        }
+    }
+    if (idle && idle->key.compare_exchange_strong(idle_key, addr, std::memory_order_acq_rel)) {
+        return idle;
+    }
+    return NULL;
+}
+
+bool rate_limit::admit(in_addr_t addr, uint64_t now_us) {
+    uint32_t now = (uint32_t) (now_us / 1000);
+    slot *s = find(addr, now);
+    if (!s) {
+        return true;
+    }
+    uint64_t state = s->state.load(std::memory_order_relaxed);
+    while (true) {
+        uint32_t left = tokens(state, now);
+        if (left < UNIT) {
+            //不写回: 下次从同一个时间点补充, 不丢不足一毫秒的部分
+            return false;
+        }
+        uint32_t last = (uint32_t) (state >> 32);
+        uint32_t stamp = (int32_t) (now - last) > 0 ? now : last;
+        uint64_t next = (uint64_t) stamp << 32 | (left - UNIT);
+        if (s->state.compare_exchange_weak(state, next, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+bool rate_limit::limited(in_addr_t addr, uint64_t now_us) {
+    uint32_t now = (uint32_t) (now_us / 1000);
+    uint32_t hash = addr * 0x9E3779B1U;
+    slot *shard = m_slots + ((hash >> 26) << m_shard_bits);
+    for (int i = 0; i < MAX_PROBE && i <= m_shard_mask; ++i) {
+        slot &s = shard[(hash + i) & m_shard_mask];
+        in_addr_t key = s.key.load(std::memory_order_acquire);
+        if (key == addr) {
+            return tokens(s.state.load(std::memory_order_relaxed), now) < UNIT;
+        }
+        if (key == 0) {
+            break;
+        }
+    }
+    return false;
+}
+
+const char *rate_limit::response() {
+    return rate_limit_response;
+}
+
+int rate_limit::response_length() {
+    return sizeof(rate_limit_response) - 1;
+}
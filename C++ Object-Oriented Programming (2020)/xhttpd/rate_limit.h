@@ -0,0 +1,59 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <atomic>
+
+/*
+ * 按客户端IP的令牌桶限速: 每个IP每秒补rate个令牌, 最多攒burst个, reactor每处理一批请求(流水线上一起到的算一批)用一个.
+ * 表按地址的哈希分成SHARDS段, 每段是一个开放寻址的数组, 只在段内线性探测, 探测最多MAX_PROBE个槽.
+ * 槽的key和桶的状态(上次补充的时间和剩余令牌)各是一个原子量, 补充和取令牌是一次CAS, 没有锁.
+ * 槽不会变回空: 空闲到令牌已经补满的桶和新建的一样, 新地址探测不到空槽时直接接管它(惰性淘汰);
+ * 接管和原来的地址取令牌同时发生时, 最多有一个令牌算错了地址. 整段都满且都不空闲时放行.
+ */
+class rate_limit {
+public:
+    static const int SHARDS = 64;
+    static const int MAX_PROBE = 16;
+
+    /* slots向上取整到SHARDS的2的幂倍 */
+    rate_limit(unsigned rate, unsigned burst, int slots);
+
+    ~rate_limit();
+
+    /* 格式: rate[,burst[,slots]], burst默认等于rate */
+    static rate_limit *create(const char *spec);
+
+    /* 取一个令牌, 没有令牌时返回false */
+    bool admit(in_addr_t addr, uint64_t now_us);
+
+    /* 只看不取: 这个地址的令牌已经用完 */
+    bool limited(in_addr_t addr, uint64_t now_us);
+
+    long tracked() const { return m_tracked.load(std::memory_order_relaxed); }
+
+    static const char *response();
+
+    static int response_length();
+
+private:
+    struct slot {
+        std::atomic<in_addr_t>  key;        //0表示空槽
+        std::atomic<uint64_t>   state;      //高32位是上次补充的时间(ms), 低32位是剩余的千分之一令牌数
+    };
+
+    slot *find(in_addr_t addr, uint32_t now);
+
+    uint32_t tokens(uint64_t state, uint32_t now) const;
+
+private:
+    uint32_t                m_rate;         //每毫秒补充的千分之一令牌数, 数值上等于每秒的令牌数
+    uint32_t                m_capacity;     //burst个令牌, 单位是千分之一令牌
+    int                     m_shard_mask;   //每段的槽数减一
+    int                     m_shard_bits;   //每段槽数的位数
+    slot                    *m_slots;
+    std::atomic<long>       m_tracked;      //被占用过的槽数
+};
+
+#endif
@@ -0,0 +1,453 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <exception>
+
+#include "reactor.h"
+
+extern void addfd(int epollfd, int fd, bool one_shot);
+extern void modfd(int epollfd, int fd, int ev);
+
+int reactor::m_idle_timeout = 60 * 1000;
+int reactor::m_header_timeout = 10 * 1000;
+int reactor::m_write_timeout = 30 * 1000;
+int reactor::m_backlog = 1024;
+int reactor::m_accept_batch = 64;
+int reactor::m_defer_accept = 0;
+int reactor::m_fastopen = 0;
+bool reactor::m_run_inline = false;
+off_t reactor::m_bulk_size = http_conn::SENDFILE_THRESHOLD;
+int reactor::m_stop_fd = -1;
+
+static void show_error(int connfd, const char *info) {
+    printf("%s", info);
+    send(connfd, info, strlen(info), 0);
+    close(connfd);
+}
+
+long reactor::now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+reactor::reactor(int port, bool reuse_port, http_conn *users, threadpool<http_conn> *pool, engine type) :
+        m_listenfd(-1), m_epollfd(-1), m_users(users), m_pool(pool), m_thread(0), m_now(now_ms()),
+        m_timers(m_now), m_ring(NULL), m_states(NULL), m_accepting(false),
+        m_accept_more(false), m_stopping(false), m_accepted(0), m_proxies(NULL), m_waiting(NULL) {
+    m_place.node = 0;
+    m_listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    if (m_listenfd < 0) {
+        throw std::exception();
+    }
+
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    int flag = 1;
+    setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    if (reuse_port) {
+        setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+    }
+    //连接建立后等到有数据再交给accept, 只连不发的客户端不会占用连接
+    if (m_defer_accept > 0
+        && setsockopt(m_listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &m_defer_accept, sizeof(m_defer_accept)) < 0) {
+        printf("TCP_DEFER_ACCEPT unavailable\n");
+    }
+    if (m_fastopen > 0 && setsockopt(m_listenfd, IPPROTO_TCP, TCP_FASTOPEN, &m_fastopen, sizeof(m_fastopen)) < 0) {
+        printf("TCP_FASTOPEN unavailable\n");
+    }
+    if (bind(m_listenfd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(m_listenfd, m_backlog) < 0) {
+        close(m_listenfd);
+        throw std::exception();
+    }
+
+    if (type == ENGINE_URING) {
+        if (!init_uring()) {
+            delete m_ring;
+            close(m_listenfd);
+            throw std::exception();
+        }
+        return;
+    }
+
+    m_epollfd = epoll_create(5);
+    if (m_epollfd == -1) {
+        close(m_listenfd);
+        throw std::exception();
+    }
+    addfd(m_epollfd, m_listenfd, false);
+    if (m_stop_fd != -1) {
+        addfd(m_epollfd, m_stop_fd, false);
+    }
+
+    if (type == ENGINE_CORO) {
+        m_waiting = new io_op *[MAX_FD];
+        memset(m_waiting, 0, sizeof(io_op *) * MAX_FD);
+        return;
+    }
+    m_proxies = new proxy_exchange *[MAX_FD];
+    memset(m_proxies, 0, sizeof(proxy_exchange *) * MAX_FD);
+    m_idle.resize(upstream::count());
+}
+
+/* 事件循环已经退出; 客户端连接不在这里关, 只清理reactor自己持有的 */
+reactor::~reactor() {
+    for (size_t i = 0; i < m_idle.size(); ++i) {
+        for (size_t j = 0; j < m_idle[i].size(); ++j) {
+            close(m_idle[i][j]);
+        }
+    }
+    for (int fd = 0; m_proxies && fd < MAX_FD; ++fd) {
+        proxy_exchange *ex = m_proxies[fd];
+        if (ex && ex->client == m_users + fd) {
+            close_upstream(ex);
+            proxy_release(ex);
+        }
+    }
+    delete[] m_proxies;
+    delete[] m_waiting;
+    //先关io_uring, 内核取消在途操作之后再释放它们用的缓冲区
+    delete m_ring;
+    for (int fd = 0; m_states && fd < MAX_FD; ++fd) {
+        if (m_states[fd].chunk) {
+            http_conn::m_buffer_pool->free(m_states[fd].chunk, m_states[fd].chunk_size);
+        }
+    }
+    delete[] m_states;
+    if (m_epollfd != -1) {
+        close(m_epollfd);
+    }
+    close(m_listenfd);
+}
+
+bool reactor::start() {
+    return pthread_create(&m_thread, NULL, worker, this) == 0;
+}
+
+void reactor::join() {
+    if (m_thread) {
+        pthread_join(m_thread, NULL);
+        m_thread = 0;
+    }
+}
+
+void *reactor::worker(void *arg) {
+    reactor *r = (reactor *) arg;
+    r->run();
+    return r;
+}
+
+/*
+ * 监听socket是ET的, 一次通知必须把全连接队列取空, 否则剩下的要等下一个新连接才会被取走.
+ * 但一轮最多取m_accept_batch个, 免得连接风暴时已有连接的事件迟迟得不到处理; 返回true表示还没取完.
+ */
+bool reactor::accept_conn() {
+    int accepted = 0;
+    bool more = false;
+    while (true) {
+        if (accepted >= m_accept_batch) {
+            more = true;
+            http_conn::m_stats->add(stats::ACCEPT_CAPPED);
+            break;
+        }
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        int connfd = accept4(m_listenfd, (struct sockaddr *) &client_address, &client_addrlength,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("errno is: %d\n", errno);
+                http_conn::m_stats->add(stats::ACCEPT_FAILED);
+            }
+            break;
+        }
+        ++accepted;
+        if (http_conn::m_user_count >= MAX_FD) {
+            show_error(connfd, "Internal server busy");
+            continue;
+        }
+        if (over_limit(client_address)) {
+            close(connfd);
+            continue;
+        }
+
+        if (m_waiting) {
+            //协程引擎自己注册事件, 见serve_coro()
+            m_users[connfd].init(connfd, client_address, -1);
+            arm(m_users + connfd, m_idle_timeout);
+            serve_coro(connfd);
+            continue;
+        }
+        m_users[connfd].init(connfd, client_address, m_epollfd);
+        arm(m_users + connfd, m_idle_timeout);
+    }
+    if (accepted > 0) {
+        http_conn::m_stats->add(stats::CONNECTIONS_ACCEPTED, accepted);
+        http_conn::m_stats->add(stats::ACCEPT_WAKEUPS);
+    }
+    return more;
+}
+
+/* 请求交给谁处理: 开了m_run_inline就先在本线程试, 已经判定要阻塞的直接进线程池 */
+void reactor::submit(http_conn *conn, uint64_t now) {
+    if (!admit_request(conn, now)) {
+        throttle(conn);
+        return;
+    }
+    if (m_run_inline && !conn->deferred()) {
+        serve_inline(conn, now);
+    } else {
+        dispatch(conn, now);
+    }
+}
+
+/* 热文件和小响应在这里一次做完: 省掉入队、唤醒工作线程和EPOLLOUT的一轮等待 */
+void reactor::serve_inline(http_conn *conn, uint64_t now) {
+    unsigned generation = conn->generation();
+    conn->handle(true);
+    if (conn->generation() != generation) {
+        return;
+    }
+    http_conn::m_stats->add(stats::INLINE_BATCHES);
+    if (conn->deferred()) {
+        http_conn::m_stats->add(stats::INLINE_DEFERRED);
+    }
+    if (conn->writing()) {
+        on_writable(conn);
+    } else if (conn->deferred()) {
+        dispatch(conn, now);
+    } else if (conn->proxy_ready()) {
+        start_proxy(conn);
+    }
+}
+
+void reactor::on_writable(http_conn *conn) {
+    //代理中的连接可写了, 或者工作线程把解析好的代理请求交回来
+    proxy_exchange *ex = m_proxies[conn - m_users];
+    if (ex) {
+        if (ex->blocked && ex->fd != -1) {
+            watch_upstream(ex->fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+        }
+        ex->blocked = false;
+        proxy_read(ex);
+        return;
+    }
+    if (conn->proxy_ready()) {
+        start_proxy(conn);
+        return;
+    }
+
+    bool ok = conn->write();
+    if (!conn->writing()) {
+        //整批响应发完, 读缓冲区里剩下的请求从现在开始计时
+        uint64_t now = stats::now_us();
+        http_conn::m_stats->record(stats::PHASE_RESPONSE, now - conn->m_arrival);
+        conn->m_arrival = now;
+    }
+    if (!ok) {
+        conn->close_conn();
+    } else if (conn->writing()) {
+        arm(conn, m_write_timeout);
+    } else if (conn->proxy_ready()) {
+        start_proxy(conn);
+    } else if (conn->pending()) {
+        arm(conn, m_header_timeout);
+        submit(conn, conn->m_arrival);
+    } else {
+        arm(conn, conn->idle() ? m_idle_timeout : m_header_timeout);
+    }
+}
+
+void reactor::dispatch(http_conn *conn, uint64_t now) {
+    if (!http_conn::m_overload->admit(now)) {
+        shed(conn);
+        return;
+    }
+    //在mark_busy()之前估计, 之后连接归工作线程所有
+    bool bulk = m_bulk_size > 0 && conn->estimate_size() >= m_bulk_size;
+    conn->m_dispatched = now;
+    conn->mark_busy();
+    if (!m_pool->append(conn, bulk)) {
+        conn->unmark_busy();
+        shed(conn);
+    } else if (bulk) {
+        http_conn::m_stats->add(stats::BULK_DISPATCHED);
+    }
+}
+
+/*
+ * 过载或队列满时不进线程池, 在reactor线程里直接发预先生成的503并关闭连接, 让客户端按Retry-After退避.
+ * 请求已经被read()读空, 关闭时不会因为接收缓冲区里有数据而发RST冲掉这个响应.
+ */
+void reactor::shed(http_conn *conn) {
+    int sockfd = conn - m_users;
+    send(sockfd, overload::response(), overload::response_length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    http_conn::m_stats->add(stats::STATUS_503);
+    conn->close_conn();
+}
+
+/* 令牌已经用完的地址新建连接时直接关掉, 不占用http_conn和缓冲区 */
+bool reactor::over_limit(const sockaddr_in &addr) {
+    if (!http_conn::m_rate_limit || !http_conn::m_rate_limit->limited(addr.sin_addr.s_addr, stats::now_us())) {
+        return false;
+    }
+    http_conn::m_stats->add(stats::CONNECTIONS_LIMITED);
+    return true;
+}
+
+/*
+ * 新的一批请求开始处理前在reactor线程里取一个令牌, 每个引擎都在这里取, 解析器不再计数.
+ * 正在收请求体、流式响应或推迟到线程池的请求已经取过了.
+ */
+bool reactor::admit_request(http_conn *conn, uint64_t now) {
+    return !http_conn::m_rate_limit || !conn->awaiting_request()
+           || http_conn::m_rate_limit->admit(conn->peer().sin_addr.s_addr, now);
+}
+
+/* 和shed()一样在reactor线程里回预先生成的429并关闭连接, 超限的客户端不会占用工作线程 */
+void reactor::throttle(http_conn *conn) {
+    int sockfd = conn - m_users;
+    send(sockfd, rate_limit::response(), rate_limit::response_length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    http_conn::m_stats->add(stats::STATUS_429);
+    conn->close_conn();
+}
+
+/* 设置连接的到期时间; 时间轮里已有更早到期的条目时只改deadline, 等那个条目到期时再按deadline补排 */
+void reactor::arm(http_conn *conn, long timeout) {
+    long deadline = m_now + timeout;
+    conn->m_timer.deadline = deadline;
+    if (conn->m_timer.queued == 0 || deadline < conn->m_timer.queued) {
+        conn->m_timer.queued = deadline;
+        m_timers.schedule(conn, conn->generation(), deadline, deadline);
+    }
+}
+
+/*
+ * 时间轮条目到期. 连接在线程池里时只能看generation和busy, 其余状态可能正被工作线程改写,
+ * 所以先推迟一个刻度; busy为0时只有本线程会碰这个连接.
+ */
+void reactor::expire(http_conn *conn, unsigned generation, long key) {
+    if (conn->generation() != generation) {
+        return;
+    }
+    if (conn->busy()) {
+        m_timers.schedule(conn, generation, key, m_now + m_timers.tick());
+        return;
+    }
+    if (conn->m_timer.queued != key) {
+        return;
+    }
+
+    conn->m_timer.queued = 0;
+    if (conn->m_timer.deadline > m_now) {
+        conn->m_timer.queued = conn->m_timer.deadline;
+        m_timers.schedule(conn, generation, conn->m_timer.deadline, conn->m_timer.deadline);
+        return;
+    }
+    if (m_proxies && m_proxies[conn - m_users]) {
+        proxy_timeout(m_proxies[conn - m_users]);
+        return;
+    }
+    http_conn::m_stats->add(stats::CONNECTIONS_TIMEOUT);
+    close_conn(conn - m_users);
+}
+
+void reactor::close_conn(int sockfd) {
+    if (m_ring) {
+        uring_close(sockfd);
+    } else if (m_waiting) {
+        coro_cancel(sockfd);
+    } else if (m_proxies[sockfd]) {
+        proxy_abort(m_proxies[sockfd]);
+    } else {
+        m_users[sockfd].close_conn();
+    }
+}
+
+bool reactor::init_stop() {
+    m_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return m_stop_fd != -1;
+}
+
+void reactor::request_stop() {
+    uint64_t one = 1;
+    if (m_stop_fd != -1 && write(m_stop_fd, &one, sizeof(one)) < 0) {
+        //计数器满了也是可读的, 忽略
+    }
+}
+
+void reactor::run() {
+    cpu_topology::bind(m_place);
+    if (m_ring) {
+        run_uring();
+    } else if (m_waiting) {
+        run_coro();
+    } else {
+        run_epoll();
+    }
+}
+
+void reactor::run_epoll() {
+    while (!m_stopping) {
+        int timeout = m_accept_more ? 0 : m_timers.timeout(now_ms());
+        int number = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, timeout);
+        if ((number < 0) && (errno != EINTR)) {
+            printf("epoll failure\n");
+            break;
+        }
+        m_now = now_ms();
+
+        for (int i = 0; i < number; ++i) {
+            int sockfd = (int) (m_events[i].data.u64 & 0xffffffff);
+            http_conn *conn = m_users + sockfd;
+            if (m_events[i].data.u64 & UPSTREAM_TAG) {
+                on_upstream(sockfd, m_events[i].events);
+            } else if (sockfd == m_listenfd) {
+                m_accept_more = true;
+            } else if (sockfd == m_stop_fd) {
+                m_stopping = true;
+            } else if (m_events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                close_conn(sockfd);
+            } else if (m_events[i].events & EPOLLIN) {
+                bool fresh = conn->idle();
+                if (conn->read()) {
+                    uint64_t now = stats::now_us();
+                    if (fresh) {
+                        arm(conn, m_header_timeout);
+                        conn->m_arrival = now;
+                    } else if (conn->streaming()) {
+                        //上传按有没有进展算超时, 不限制整个请求体的接收时间
+                        arm(conn, m_header_timeout);
+                    }
+                    submit(conn, now);
+                } else {
+                    conn->close_conn();
+                }
+            } else if (m_events[i].events & EPOLLOUT) {
+                on_writable(conn);
+            } else {}
+        }
+        //先处理完已有连接的事件再接新连接
+        if (m_accept_more) {
+            m_accept_more = accept_conn();
+        }
+
+        m_timers.advance(m_now, [this](http_conn *conn, unsigned generation, long key) {
+            expire(conn, generation, key);
+        });
+    }
+}
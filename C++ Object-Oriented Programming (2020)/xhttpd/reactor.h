@@ -0,0 +1,297 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include "threadpool.h"
+#include "http_conn.h"
+#include "timing_wheel.h"
+#include "io_ring.h"
+#include "upstream.h"
+#include "coro.h"
+
+#define MAX_FD 65536
+#define MAX_EVENT_NUMBER 10000
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024
+#define URING_BUFFER_SIZE 4096
+#define UPSTREAM_TAG (1ULL << 32)
+#define MAX_IDLE_UPSTREAM 32
+
+/*
+ * 每个reactor一个线程, 有三种I/O引擎, 启动时选择:
+ * epoll: 就绪通知 + 线程池处理请求;
+ * io_uring: accept/recv/send/读文件都走提交队列, 请求在本线程里直接处理, 一次io_uring_enter批量提交所有连接的操作.
+ * coro: 也是epoll, 但每个连接是一个协程, 收请求、处理、发响应按顺序写在serve_coro()里, 请求在本线程里直接处理.
+ * 反向代理只用于epoll引擎, 到上游的连接池每个reactor一份.
+ * request_stop()之后各reactor退出事件循环: 协程引擎先把所有协程跑完, 代理和io_uring的在途操作在析构时清理,
+ * 连接由调用者在线程池停下后统一关闭.
+ */
+class reactor {
+public:
+    enum engine {
+        ENGINE_EPOLL = 0,
+        ENGINE_URING,
+        ENGINE_CORO
+    };
+
+    reactor(int port, bool reuse_port, http_conn *users, threadpool<http_conn> *pool, engine type = ENGINE_EPOLL);
+
+    ~reactor();
+
+    bool start();
+
+    void join();
+
+    void run();
+
+    /* 事件循环线程绑定的位置, 在start()/run()之前设置 */
+    void place(const placement &p) { m_place = p; }
+
+    /* 在创建reactor之前调用一次 */
+    static bool init_stop();
+
+    /* 可以在信号处理函数里调用 */
+    static void request_stop();
+
+public:
+    static int m_idle_timeout;      //keep-alive连接两个请求之间的空闲超时(ms)
+    static int m_header_timeout;    //从收到请求第一个字节到读完请求的超时(ms)
+    static int m_write_timeout;     //响应发不出去(对端不读)的超时(ms)
+    static int m_backlog;           //listen的backlog, 实际还受net.core.somaxconn限制
+    static int m_accept_batch;      //epoll引擎每轮最多accept的连接数
+    static int m_defer_accept;      //TCP_DEFER_ACCEPT(s), 0为不开启
+    static int m_fastopen;          //TCP_FASTOPEN的队列长度, 0为不开启
+    static bool m_run_inline;       //epoll引擎在reactor线程里直接处理不会阻塞的请求
+    static off_t m_bulk_size;       //预估响应不小于这么多字节的请求排在小请求后面, 0为不区分(FIFO)
+    static int m_stop_fd;           //退出通知的eventfd, 每个reactor都在监听, 写入后一直可读
+
+    static long now_ms();
+
+private:
+    /* io_uring引擎里一个连接的在途操作 */
+    struct uring_state {
+        int             inflight;       //已提交还没完成的操作数, 不为0时不能关fd
+        bool            closing;        //等在途操作完成后再关
+        char*           chunk;          //从大文件读出来待发送的数据
+        int             chunk_size;
+        struct msghdr   msg;            //在途的sendmsg参数
+    };
+
+    /* 一次代理请求, 客户端fd和上游fd在m_proxies里都指向它 */
+    struct proxy_exchange {
+        upstream*       up;
+        http_conn*      client;
+        int             fd;             //到上游的连接, -1表示没有
+        int             state;
+        bool            reused;         //从连接池里取的, 可能已经被上游关掉了
+        bool            received;       //收到过上游的数据
+        bool            blocked;        //在等客户端可写
+        bool            keep_upstream;  //响应结束后上游连接可以放回连接池
+        bool            keep_client;
+        int             status;
+        std::string     request;
+        size_t          request_sent;
+        std::string     head;           //改写后发给客户端的响应头
+        size_t          head_sent;
+        off_t           sent;           //已经发给客户端的字节数
+        char*           buf;            //从上游读到还没发给客户端的数据
+        int             buf_size;
+        int             buf_start;
+        int             buf_end;
+        body_framer     body;
+    };
+
+    enum proxy_state {
+        PROXY_CONNECTING = 0,
+        PROXY_SENDING,
+        PROXY_READING,          //等响应头
+        PROXY_STREAMING         //响应头已生成, 转发响应体
+    };
+
+    /*
+     * 协程引擎里的一次I/O: co_await时先直接做系统调用, 只有EAGAIN才挂起;
+     * 之后fd每次就绪由reactor重试, 直到有结果才恢复协程. 超时时以-ETIMEDOUT恢复.
+     */
+    struct io_op {
+        enum kind {
+            RECV = 0,
+            WRITEV,
+            SENDFILE
+        };
+
+        reactor*                r;
+        int                     fd;
+        int                     type;
+        char*                   buf;
+        size_t                  len;
+        const struct iovec*     iov;
+        int                     iov_count;
+        int                     file_fd;
+        off_t                   offset;
+        ssize_t                 result;     //字节数或-errno
+        std::coroutine_handle<> waiter;
+
+        ssize_t attempt();
+
+        bool await_ready() {
+            result = attempt();
+            return result != -EAGAIN;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            waiter = h;
+            r->m_waiting[fd] = this;
+        }
+
+        ssize_t await_resume() const { return result; }
+    };
+
+    /* 让出reactor线程, 本轮事件处理完后再继续 */
+    struct yield_op {
+        reactor* r;
+
+        bool await_ready() const { return false; }
+
+        void await_suspend(std::coroutine_handle<> h) { r->m_ready.push_back(h); }
+
+        void await_resume() const {}
+    };
+
+    enum uring_op {
+        OP_ACCEPT = 0,
+        OP_RECV,
+        OP_SEND,
+        OP_READ,
+        OP_SEND_FILE,
+        OP_STOP
+    };
+
+    static void *worker(void *arg);
+
+    void run_epoll();
+
+    void run_uring();
+
+    bool init_uring();
+
+    void close_conn(int sockfd);
+
+    void on_completion(const io_uring_cqe &cqe);
+
+    void on_recv(int sockfd, const io_uring_cqe &cqe);
+
+    void on_send(int sockfd, int op, const io_uring_cqe &cqe);
+
+    void accept_uring(int connfd);
+
+    void serve_uring(int sockfd);
+
+    bool submit_accept();
+
+    void submit_recv(int sockfd);
+
+    void submit_send(int sockfd);
+
+    void uring_close(int sockfd);
+
+    void uring_release(int sockfd);
+
+    void start_proxy(http_conn *conn);
+
+    void proxy_connect(proxy_exchange *ex);
+
+    void on_upstream(int fd, unsigned events);
+
+    void proxy_send(proxy_exchange *ex);
+
+    void proxy_read(proxy_exchange *ex);
+
+    bool proxy_parse_head(proxy_exchange *ex);
+
+    bool proxy_flush(proxy_exchange *ex);
+
+    void proxy_finish(proxy_exchange *ex);
+
+    void proxy_failed(proxy_exchange *ex, int status);
+
+    void proxy_error(proxy_exchange *ex, int status);
+
+    void proxy_timeout(proxy_exchange *ex);
+
+    void proxy_abort(proxy_exchange *ex);
+
+    void proxy_release(proxy_exchange *ex);
+
+    void close_upstream(proxy_exchange *ex);
+
+    void watch_upstream(int fd, unsigned events, int op = EPOLL_CTL_MOD);
+
+    void drop_idle(int fd);
+
+    bool accept_conn();
+
+    void run_coro();
+
+    void on_coro_event(int sockfd, unsigned events);
+
+    void coro_cancel(int sockfd, int error = -ETIMEDOUT);
+
+    void drain_coro();
+
+    detached_task serve_coro(int sockfd);
+
+    task<bool> write_all(http_conn *conn);
+
+    io_op read_some(int fd, char *buf, size_t len);
+
+    io_op write_some(int fd, const struct iovec *iov, int count);
+
+    io_op send_file(int fd, int file_fd, off_t offset, size_t count);
+
+    void submit(http_conn *conn, uint64_t now);
+
+    void serve_inline(http_conn *conn, uint64_t now);
+
+    void on_writable(http_conn *conn);
+
+    void dispatch(http_conn *conn, uint64_t now);
+
+    void shed(http_conn *conn);
+
+    bool over_limit(const sockaddr_in &addr);
+
+    bool admit_request(http_conn *conn, uint64_t now);
+
+    void throttle(http_conn *conn);
+
+    void arm(http_conn *conn, long timeout);
+
+    void expire(http_conn *conn, unsigned generation, long key);
+
+private:
+    int                     m_listenfd;     //监听socket
+    int                     m_epollfd;      //epoll内核事件表
+    http_conn*              m_users;        //按fd索引的连接表
+    threadpool<http_conn>*  m_pool;         //线程池
+    pthread_t               m_thread;       //事件循环线程
+    long                    m_now;          //本轮epoll_wait返回的时间(ms)
+    timing_wheel<http_conn> m_timers;       //本reactor所有连接的超时
+    io_ring*                m_ring;         //io_uring引擎, epoll引擎时为NULL
+    uring_state*            m_states;       //io_uring引擎按fd索引的连接状态
+    bool                    m_accepting;    //multishot accept在途
+    bool                    m_accept_more;  //上一轮accept到了上限, 队列里可能还有连接
+    bool                    m_stopping;     //收到退出通知, 本轮结束后退出事件循环
+    placement               m_place;
+    int                     m_accepted;     //本轮accept的连接数
+    proxy_exchange**        m_proxies;      //按fd索引的代理请求, 客户端和上游的fd都在里面
+    std::vector<std::vector<int> > m_idle;  //按upstream::index()分的空闲上游连接
+    io_op**                 m_waiting;      //协程引擎按fd索引的挂起操作, 其它引擎为NULL
+    std::vector<std::coroutine_handle<> > m_ready;  //让出后等下一轮继续的协程
+    epoll_event             m_events[MAX_EVENT_NUMBER];
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "reactor.h"
+
+/*
+ * reactor的协程引擎.
+ * 连接fd只在accept后注册一次EPOLLIN|EPOLLOUT|EPOLLET, 之后不再epoll_ctl: 协程总是先做系统调用,
+ * EAGAIN之后才等通知, 满足边沿触发的要求; 通知到的fd上没有在等的操作就忽略.
+ * 协程只在本线程里运行, 任何时刻每个连接的协程要么在运行, 要么挂在m_waiting或m_ready上.
+ */
+
+ssize_t reactor::io_op::attempt() {
+    while (true) {
+        ssize_t n;
+        if (type == RECV) {
+            n = recv(fd, buf, len, 0);
+        } else if (type == WRITEV) {
+            n = writev(fd, iov, iov_count);
+        } else {
+            //发出去多少由http_conn::advance()推进偏移, 这里不改offset
+            off_t off = offset;
+            n = sendfile(fd, file_fd, &off, len);
+        }
+        if (n >= 0) {
+            return n;
+        }
+        if (errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+reactor::io_op reactor::read_some(int fd, char *buf, size_t len) {
+    io_op op{};
+    op.r = this;
+    op.fd = fd;
+    op.type = io_op::RECV;
+    op.buf = buf;
+    op.len = len;
+    return op;
+}
+
+reactor::io_op reactor::write_some(int fd, const struct iovec *iov, int count) {
+    io_op op{};
+    op.r = this;
+    op.fd = fd;
+    op.type = io_op::WRITEV;
+    op.iov = iov;
+    op.iov_count = count;
+    return op;
+}
+
+reactor::io_op reactor::send_file(int fd, int file_fd, off_t offset, size_t count) {
+    io_op op{};
+    op.r = this;
+    op.fd = fd;
+    op.type = io_op::SENDFILE;
+    op.file_fd = file_fd;
+    op.offset = offset;
+    op.len = count;
+    return op;
+}
+
+void reactor::run_coro() {
+    std::vector<std::coroutine_handle<> > ready;
+    while (!m_stopping) {
+        int timeout = m_accept_more || !m_ready.empty() ? 0 : m_timers.timeout(now_ms());
+        int number = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, timeout);
+        if ((number < 0) && (errno != EINTR)) {
+            printf("epoll failure\n");
+            break;
+        }
+        m_now = now_ms();
+
+        for (int i = 0; i < number; ++i) {
+            int sockfd = m_events[i].data.fd;
+            if (sockfd == m_listenfd) {
+                m_accept_more = true;
+            } else if (sockfd == m_stop_fd) {
+                m_stopping = true;
+            } else {
+                on_coro_event(sockfd, m_events[i].events);
+            }
+        }
+        //上一轮让出的协程排在本轮的就绪事件之后
+        ready.swap(m_ready);
+        for (size_t i = 0; i < ready.size(); ++i) {
+            ready[i].resume();
+        }
+        ready.clear();
+        if (m_accept_more) {
+            m_accept_more = accept_conn();
+        }
+
+        m_timers.advance(m_now, [this](http_conn *conn, unsigned generation, long key) {
+            expire(conn, generation, key);
+        });
+    }
+    drain_coro();
+}
+
+/*
+ * 退出前把所有协程跑完: 挂起的操作以-ECANCELED恢复, 协程自己关闭连接、释放帧.
+ * 让出的协程恢复后可能接着发数据, 再次挂起时下一轮取消, 直到一个都不剩. 最后归还本线程缓存的帧.
+ */
+void reactor::drain_coro() {
+    std::vector<std::coroutine_handle<> > ready;
+    bool running = true;
+    while (running) {
+        running = false;
+        for (int fd = 0; fd < MAX_FD; ++fd) {
+            if (m_waiting[fd]) {
+                coro_cancel(fd, -ECANCELED);
+                running = true;
+            }
+        }
+        ready.swap(m_ready);
+        for (size_t i = 0; i < ready.size(); ++i) {
+            ready[i].resume();
+            running = true;
+        }
+        ready.clear();
+    }
+    frame_pool::release();
+}
+
+void reactor::on_coro_event(int sockfd, unsigned events) {
+    io_op *op = m_waiting[sockfd];
+    if (!op) {
+        return;
+    }
+    unsigned wanted = op->type == io_op::RECV ? EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR
+                                              : EPOLLOUT | EPOLLHUP | EPOLLERR;
+    if (!(events & wanted)) {
+        return;
+    }
+    op->result = op->attempt();
+    if (op->result == -EAGAIN) {
+        return;
+    }
+    m_waiting[sockfd] = NULL;
+    op->waiter.resume();
+}
+
+/* 超时或退出: 以error恢复挂起的操作, 由协程自己关闭连接; 在m_ready里的协程正在发数据, 不用管 */
+void reactor::coro_cancel(int sockfd, int error) {
+    io_op *op = m_waiting[sockfd];
+    if (!op) {
+        return;
+    }
+    m_waiting[sockfd] = NULL;
+    op->result = error;
+    op->waiter.resume();
+}
+
+/*
+ * 一个连接从accept到关闭: 收数据, 请求头收齐后解析并生成响应, 发完这一批, 再处理流水线上剩下的请求.
+ * 超时的设置和epoll引擎相同; 请求在本线程里直接处理, 包括读冷文件.
+ */
+detached_task reactor::serve_coro(int sockfd) {
+    http_conn *conn = m_users + sockfd;
+    epoll_event event;
+    event.data.u64 = 0;
+    event.data.fd = sockfd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    if (epoll_ctl(m_epollfd, EPOLL_CTL_ADD, sockfd, &event) < 0) {
+        conn->close_conn();
+        co_return;
+    }
+
+    while (true) {
+        int space = 0;
+        char *buf = conn->read_space(space);
+        if (!buf) {
+            break;
+        }
+        ssize_t n = co_await read_some(sockfd, buf, space);
+        if (n <= 0) {
+            break;
+        }
+        if (conn->idle()) {
+            arm(conn, m_header_timeout);
+            conn->m_arrival = stats::now_us();
+        } else if (conn->streaming()) {
+            //上传按有没有进展算超时, 不限制整个请求体的接收时间
+            arm(conn, m_header_timeout);
+        }
+        conn->commit_read(n);
+        if (!conn->head_ready(n)) {
+            continue;
+        }
+
+        bool ok = true;
+        do {
+            if (!admit_request(conn, stats::now_us())) {
+                throttle(conn);
+                co_return;
+            }
+            unsigned generation = conn->generation();
+            conn->handle();
+            if (conn->generation() != generation) {
+                //解析时已经关闭了连接(请求超过缓冲区上限)
+                co_return;
+            }
+            if (!conn->writing()) {
+                //请求体还没收完; 上传每收一个QUANTUM让出一轮, socket里一直有数据时也不会占着reactor
+                if (conn->streaming()) {
+                    co_await yield_op{this};
+                }
+                break;
+            }
+            arm(conn, m_write_timeout);
+            ok = co_await write_all(conn);
+            uint64_t now = stats::now_us();
+            http_conn::m_stats->record(stats::PHASE_RESPONSE, now - conn->m_arrival);
+            conn->m_arrival = now;
+            ok = ok && conn->finish_write();
+        } while (ok && conn->pending());
+        if (!ok) {
+            break;
+        }
+        arm(conn, conn->idle() ? m_idle_timeout : m_header_timeout);
+    }
+    conn->close_conn();
+}
+
+/* 发完攒好的一批响应: 内存里的部分writev, 大文件sendfile, 每发满一个写配额让出一次 */
+task<bool> reactor::write_all(http_conn *conn) {
+    int sockfd = conn - m_users;
+    off_t quantum = http_conn::m_write_quantum;
+    off_t sent = 0;
+    while (conn->writing()) {
+        if (quantum > 0 && sent >= quantum) {
+            http_conn::m_stats->add(stats::WRITE_YIELDS);
+            co_await yield_op{this};
+            sent = 0;
+        }
+        const struct iovec *iov = NULL;
+        int count = conn->send_iov(iov);
+        ssize_t n;
+        if (count > 0) {
+            n = co_await write_some(sockfd, iov, count);
+        } else {
+            off_t len = conn->send_left();
+            if (quantum > 0 && len > quantum - sent) {
+                len = quantum - sent;
+            }
+            n = co_await send_file(sockfd, conn->send_fd(), conn->send_offset(), len);
+        }
+        if (n <= 0) {
+            co_return false;
+        }
+        conn->advance(n, count == 0);
+        //和其它引擎一样, 写超时从最近一次有进展算起
+        arm(conn, m_write_timeout);
+        sent += n;
+    }
+    co_return true;
+}
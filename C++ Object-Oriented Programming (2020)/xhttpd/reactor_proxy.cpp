@@ -0,0 +1,436 @@
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "reactor.h"
+
+/*
+ * reactor的反向代理, 只用于epoll引擎, 全部在reactor线程里完成.
+ * 工作线程解析出要转发的请求后注册EPOLLOUT把连接交回来(见http_conn::proxy_ready()),
+ * 这里从本reactor的连接池里取一个到上游的空闲连接(没有就新建), 发请求, 读响应头改写后转给客户端,
+ * 响应体边读边发: 客户端发不动时停止读上游, 每个请求最多占一个缓冲区.
+ * 超时借用客户端连接在时间轮里的条目: 等上游时按上游的connect/read超时, 等客户端时按m_write_timeout.
+ * 上游的fd也注册在本reactor的epoll里(水平触发, 不用ONESHOT), data带UPSTREAM_TAG以和客户端区分.
+ */
+
+extern void modfd(int epollfd, int fd, int ev);
+
+void reactor::watch_upstream(int fd, unsigned events, int op) {
+    epoll_event event;
+    event.data.u64 = UPSTREAM_TAG | (unsigned) fd;
+    event.events = events;
+    epoll_ctl(m_epollfd, op, fd, &event);
+}
+
+void reactor::start_proxy(http_conn *conn) {
+    proxy_exchange *ex = new proxy_exchange;
+    ex->up = conn->proxy_target();
+    ex->client = conn;
+    ex->fd = -1;
+    ex->state = PROXY_CONNECTING;
+    ex->reused = false;
+    ex->received = false;
+    ex->blocked = false;
+    ex->keep_upstream = false;
+    ex->keep_client = conn->proxy_keep_alive();
+    ex->status = 0;
+    ex->request_sent = 0;
+    ex->head_sent = 0;
+    ex->sent = 0;
+    ex->buf = NULL;
+    ex->buf_size = 0;
+    ex->buf_start = 0;
+    ex->buf_end = 0;
+    conn->proxy_request(ex->request);
+    m_proxies[conn - m_users] = ex;
+    http_conn::m_stats->add(stats::PROXY_REQUESTS);
+
+    if (!ex->up->available(m_now)) {
+        proxy_error(ex, 502);
+        return;
+    }
+    proxy_connect(ex);
+}
+
+void reactor::proxy_connect(proxy_exchange *ex) {
+    std::vector<int> &idle = m_idle[ex->up->index()];
+    bool in_progress = false;
+    int fd;
+    if (!idle.empty()) {
+        fd = idle.back();
+        idle.pop_back();
+        ex->reused = true;
+        http_conn::m_stats->add(stats::UPSTREAM_REUSED);
+    } else {
+        fd = ex->up->connect_nonblocking(in_progress);
+        if (fd >= MAX_FD) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            http_conn::m_stats->add(stats::UPSTREAM_FAILURES);
+            ex->up->failed(m_now);
+            proxy_error(ex, 502);
+            return;
+        }
+        ex->reused = false;
+        watch_upstream(fd, EPOLLOUT, EPOLL_CTL_ADD);
+        http_conn::m_stats->add(stats::UPSTREAM_CONNECTS);
+    }
+    ex->fd = fd;
+    m_proxies[fd] = ex;
+
+    if (in_progress) {
+        ex->state = PROXY_CONNECTING;
+        watch_upstream(fd, EPOLLOUT);
+        arm(ex->client, ex->up->connect_timeout());
+        return;
+    }
+    ex->state = PROXY_SENDING;
+    proxy_send(ex);
+}
+
+void reactor::on_upstream(int fd, unsigned events) {
+    proxy_exchange *ex = m_proxies[fd];
+    if (!ex) {
+        //空闲连接上有事件: 上游关闭了连接, 或者发来了不属于任何请求的数据
+        drop_idle(fd);
+        return;
+    }
+    //连接或发请求时出错直接算失败; 读响应时已经收到的数据还要转发, 错误交给recv()报告
+    if ((events & (EPOLLERR | EPOLLHUP)) && (ex->state == PROXY_CONNECTING || ex->state == PROXY_SENDING)) {
+        proxy_failed(ex, 502);
+        return;
+    }
+    if (ex->state == PROXY_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            proxy_failed(ex, 502);
+            return;
+        }
+        ex->state = PROXY_SENDING;
+    }
+    if (ex->state == PROXY_SENDING) {
+        proxy_send(ex);
+    } else {
+        proxy_read(ex);
+    }
+}
+
+void reactor::proxy_send(proxy_exchange *ex) {
+    while (ex->request_sent < ex->request.size()) {
+        ssize_t n = send(ex->fd, ex->request.data() + ex->request_sent, ex->request.size() - ex->request_sent,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                watch_upstream(ex->fd, EPOLLOUT);
+                arm(ex->client, ex->up->read_timeout());
+                return;
+            }
+            proxy_failed(ex, 502);
+            return;
+        }
+        ex->request_sent += n;
+    }
+
+    if (!ex->buf) {
+        ex->buf = http_conn::m_buffer_pool->alloc(buffer_pool::MAX_SIZE, ex->buf_size);
+        if (!ex->buf) {
+            proxy_error(ex, 503);
+            return;
+        }
+    }
+    ex->state = PROXY_READING;
+    watch_upstream(ex->fd, EPOLLIN | EPOLLRDHUP);
+    arm(ex->client, ex->up->read_timeout());
+}
+
+/* 先把手上的数据发给客户端, 再从上游读; 客户端发不动时停下, 等它可写后由on_writable()回到这里 */
+void reactor::proxy_read(proxy_exchange *ex) {
+    while (true) {
+        if (!proxy_flush(ex)) {
+            return;
+        }
+        if (ex->state == PROXY_STREAMING && ex->body.done()) {
+            proxy_finish(ex);
+            return;
+        }
+
+        ssize_t n = recv(ex->fd, ex->buf + ex->buf_end, ex->buf_size - ex->buf_end, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                watch_upstream(ex->fd, EPOLLIN | EPOLLRDHUP);
+                arm(ex->client, ex->up->read_timeout());
+                return;
+            }
+            proxy_failed(ex, 502);
+            return;
+        }
+        if (n == 0) {
+            if (ex->state == PROXY_STREAMING && ex->body.framing() == body_framer::UNTIL_CLOSE) {
+                ex->keep_upstream = false;
+                proxy_finish(ex);
+                return;
+            }
+            //响应头没收完或者响应体不完整
+            proxy_failed(ex, 502);
+            return;
+        }
+        ex->received = true;
+
+        if (ex->state == PROXY_READING) {
+            ex->buf_end += n;
+            if (!proxy_parse_head(ex)) {
+                return;
+            }
+            continue;
+        }
+        long used = ex->body.consume(ex->buf + ex->buf_end, n);
+        if (used < 0) {
+            proxy_failed(ex, 502);
+            return;
+        }
+        if (used < n) {
+            //响应之后还有多余的数据, 这个上游连接不能再用
+            ex->keep_upstream = false;
+        }
+        ex->buf_end += used;
+    }
+}
+
+/* 缓冲区开头是上游的响应头; 返回false表示已经出错处理掉了 */
+bool reactor::proxy_parse_head(proxy_exchange *ex) {
+    upstream_head head;
+    int len = parse_upstream_head(ex->buf, ex->buf_end, head);
+    if (len == 0 && ex->buf_end < ex->buf_size) {
+        return true;
+    }
+    if (len <= 0 || head.status == 101) {
+        proxy_failed(ex, 502);
+        return false;
+    }
+    if (head.status < 200) {
+        //100 Continue之类的中间响应不转发, 接着等最终响应
+        memmove(ex->buf, ex->buf + len, ex->buf_end - len);
+        ex->buf_end -= len;
+        return proxy_parse_head(ex);
+    }
+
+    if (ex->client->proxy_head() || head.status == 204 || head.status == 304) {
+        ex->body.init(body_framer::NONE);
+    } else if (head.chunked) {
+        ex->body.init(body_framer::CHUNKED);
+    } else if (head.content_length >= 0) {
+        ex->body.init(body_framer::LENGTH, head.content_length);
+    } else {
+        //只能靠上游关闭来判断响应结束, 客户端那边也只能关闭连接
+        ex->body.init(body_framer::UNTIL_CLOSE);
+        ex->keep_client = false;
+    }
+    ex->keep_upstream = head.keep_alive && ex->body.framing() != body_framer::UNTIL_CLOSE;
+    ex->status = head.status;
+    rewrite_upstream_head(ex->buf, head, ex->keep_client, ex->head);
+    ex->state = PROXY_STREAMING;
+
+    long used = ex->body.consume(ex->buf + len, ex->buf_end - len);
+    if (used < 0) {
+        proxy_failed(ex, 502);
+        return false;
+    }
+    if (used < ex->buf_end - len) {
+        ex->keep_upstream = false;
+    }
+    ex->buf_start = len;
+    ex->buf_end = len + used;
+    return true;
+}
+
+/* 把改写后的响应头和缓冲区里的响应体发给客户端; 返回false表示发不动或者出错了 */
+bool reactor::proxy_flush(proxy_exchange *ex) {
+    if (ex->state != PROXY_STREAMING) {
+        return true;
+    }
+    int sockfd = ex->client - m_users;
+    while (true) {
+        struct iovec iov[2];
+        int count = 0;
+        if (ex->head_sent < ex->head.size()) {
+            iov[count].iov_base = (char *) ex->head.data() + ex->head_sent;
+            iov[count].iov_len = ex->head.size() - ex->head_sent;
+            ++count;
+        }
+        if (ex->buf_end > ex->buf_start) {
+            iov[count].iov_base = ex->buf + ex->buf_start;
+            iov[count].iov_len = ex->buf_end - ex->buf_start;
+            ++count;
+        }
+        if (count == 0) {
+            ex->buf_start = 0;
+            ex->buf_end = 0;
+            return true;
+        }
+
+        ssize_t n = writev(sockfd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                //客户端发不动, 先不读上游, 数据积压在上游的socket缓冲区里.
+                //上游fd从epoll里摘掉: 掩码为0也会报告EPOLLERR/EPOLLHUP, 上游断开后水平触发会让reactor空转
+                if (ex->fd != -1 && !ex->blocked) {
+                    watch_upstream(ex->fd, 0, EPOLL_CTL_DEL);
+                }
+                ex->blocked = true;
+                modfd(m_epollfd, sockfd, EPOLLOUT);
+                arm(ex->client, m_write_timeout);
+                return false;
+            }
+            proxy_abort(ex);
+            return false;
+        }
+        http_conn::m_stats->add(stats::BYTES_SENT, n);
+        ex->sent += n;
+        size_t from_head = ex->head.size() - ex->head_sent;
+        if ((size_t) n < from_head) {
+            from_head = n;
+        }
+        ex->head_sent += from_head;
+        ex->buf_start += n - from_head;
+    }
+}
+
+/* 响应转发完: 上游连接放回连接池, 客户端连接接着处理下一个请求 */
+void reactor::proxy_finish(proxy_exchange *ex) {
+    http_conn *conn = ex->client;
+    if (ex->fd != -1) {
+        std::vector<int> &idle = m_idle[ex->up->index()];
+        m_proxies[ex->fd] = NULL;
+        if (ex->keep_upstream && idle.size() < MAX_IDLE_UPSTREAM) {
+            watch_upstream(ex->fd, EPOLLIN | EPOLLRDHUP);
+            idle.push_back(ex->fd);
+        } else {
+            close(ex->fd);
+        }
+        ex->fd = -1;
+        ex->up->succeeded();
+    }
+    http_conn::m_stats->count_status(ex->status);
+    uint64_t now = stats::now_us();
+    conn->log_access(ex->status, ex->sent, now);
+    bool keep_alive = ex->keep_client;
+    proxy_release(ex);
+
+    http_conn::m_stats->record(stats::PHASE_RESPONSE, now - conn->m_arrival);
+    conn->m_arrival = now;
+    if (!conn->finish_proxy(keep_alive)) {
+        conn->close_conn();
+    } else if (conn->pending()) {
+        arm(conn, m_header_timeout);
+        submit(conn, conn->m_arrival);
+    } else {
+        arm(conn, conn->idle() ? m_idle_timeout : m_header_timeout);
+    }
+}
+
+/*
+ * 和上游的交互出错. 还没收到任何数据的复用连接可能只是已经被上游关掉了, 换一个连接重试;
+ * 响应头还没发给客户端时回错误页, 否则只能断开客户端.
+ */
+void reactor::proxy_failed(proxy_exchange *ex, int status) {
+    if (ex->reused && !ex->received) {
+        close_upstream(ex);
+        ex->request_sent = 0;
+        ex->buf_end = 0;
+        proxy_connect(ex);
+        return;
+    }
+    http_conn::m_stats->add(stats::UPSTREAM_FAILURES);
+    ex->up->failed(m_now);
+    if (ex->state == PROXY_STREAMING) {
+        proxy_abort(ex);
+        return;
+    }
+    proxy_error(ex, status);
+}
+
+void reactor::proxy_error(proxy_exchange *ex, int status) {
+    close_upstream(ex);
+    const char *title = status == 504 ? "Gateway Timeout" : status == 503 ? "Service Unavailable" : "Bad Gateway";
+    char buf[256];
+    int body_len = strlen(title) + 1;
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n%s\n", status, title,
+             body_len, ex->keep_client ? "keep-alive" : "close", title);
+    ex->head = buf;
+    ex->head_sent = 0;
+    ex->buf_start = 0;
+    ex->buf_end = 0;
+    ex->status = status;
+    ex->state = PROXY_STREAMING;
+    ex->body.init(body_framer::NONE);
+    proxy_read(ex);
+}
+
+void reactor::proxy_timeout(proxy_exchange *ex) {
+    if (ex->blocked) {
+        http_conn::m_stats->add(stats::CONNECTIONS_TIMEOUT);
+        proxy_abort(ex);
+        return;
+    }
+    http_conn::m_stats->add(stats::UPSTREAM_FAILURES);
+    ex->up->failed(m_now);
+    if (ex->state == PROXY_STREAMING) {
+        proxy_abort(ex);
+        return;
+    }
+    proxy_error(ex, 504);
+}
+
+/* 两边都关掉, 上游连接不放回连接池 */
+void reactor::proxy_abort(proxy_exchange *ex) {
+    http_conn *conn = ex->client;
+    close_upstream(ex);
+    proxy_release(ex);
+    conn->close_conn();
+}
+
+void reactor::proxy_release(proxy_exchange *ex) {
+    if (ex->buf) {
+        http_conn::m_buffer_pool->free(ex->buf, ex->buf_size);
+    }
+    m_proxies[ex->client - m_users] = NULL;
+    delete ex;
+}
+
+void reactor::close_upstream(proxy_exchange *ex) {
+    if (ex->fd != -1) {
+        m_proxies[ex->fd] = NULL;
+        close(ex->fd);
+        ex->fd = -1;
+    }
+}
+
+void reactor::drop_idle(int fd) {
+    for (size_t i = 0; i < m_idle.size(); ++i) {
+        std::vector<int> &idle = m_idle[i];
+        for (size_t j = 0; j < idle.size(); ++j) {
+            if (idle[j] == fd) {
+                idle[j] = idle.back();
+                idle.pop_back();
+                close(fd);
+                return;
+            }
+        }
+    }
+}
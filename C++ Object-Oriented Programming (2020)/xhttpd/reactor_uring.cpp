@@ -0,0 +1,346 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+
+#include "reactor.h"
+
+/*
+ * reactor的io_uring引擎.
+ * 每个连接同一时刻只有一组在途操作: 要么一个recv(用provided buffer, 不占连接的缓冲区),
+ * 要么一条发送链 sendmsg(响应头和内存里的内容) -> read(大文件的一块) -> send(这一块), 用IOSQE_IO_LINK串起来,
+ * 前一个出错或没写完时后面的被内核取消(-ECANCELED), 整条链结束后再按剩余的字节数重新提交.
+ * 本轮所有连接新填的sqe和等待完成合并成一次io_uring_enter.
+ */
+
+static inline unsigned long long make_user_data(int fd, int op) {
+    return ((unsigned long long) fd << 8) | op;
+}
+
+bool reactor::init_uring() {
+    m_ring = new io_ring;
+    if (!m_ring->init(URING_ENTRIES) || !m_ring->setup_buffers(0, URING_BUFFERS, URING_BUFFER_SIZE)) {
+        return false;
+    }
+    m_states = new uring_state[MAX_FD];
+    memset(m_states, 0, sizeof(uring_state) * MAX_FD);
+    return true;
+}
+
+void reactor::run_uring() {
+    //退出通知: eventfd一旦写入就一直可读, 单次poll就够
+    io_uring_sqe *sqe = m_stop_fd != -1 ? m_ring->get_sqe() : NULL;
+    if (sqe) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = m_stop_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = make_user_data(m_stop_fd, OP_STOP);
+    }
+    while (!m_stopping) {
+        if (!m_accepting) {
+            m_accepting = submit_accept();
+        }
+        int ret = m_ring->submit(1, m_timers.timeout(now_ms()));
+        if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            printf("io_uring failure\n");
+            break;
+        }
+        m_now = now_ms();
+
+        m_accepted = 0;
+        m_ring->for_each_cqe([this](const io_uring_cqe &cqe) {
+            on_completion(cqe);
+        });
+        if (m_accepted > 0) {
+            http_conn::m_stats->add(stats::CONNECTIONS_ACCEPTED, m_accepted);
+            http_conn::m_stats->add(stats::ACCEPT_WAKEUPS);
+        }
+
+        m_timers.advance(m_now, [this](http_conn *conn, unsigned generation, long key) {
+            expire(conn, generation, key);
+        });
+    }
+}
+
+void reactor::on_completion(const io_uring_cqe &cqe) {
+    int sockfd = (int) (cqe.user_data >> 8);
+    int op = (int) (cqe.user_data & 0xff);
+    if (op == OP_STOP) {
+        m_stopping = true;
+        return;
+    }
+    if (op == OP_ACCEPT) {
+        if (cqe.res >= 0) {
+            ++m_accepted;
+            accept_uring(cqe.res);
+        } else {
+            printf("errno is: %d\n", -cqe.res);
+            http_conn::m_stats->add(stats::ACCEPT_FAILED);
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            m_accepting = false;
+        }
+        return;
+    }
+
+    --m_states[sockfd].inflight;
+    if (op == OP_RECV) {
+        on_recv(sockfd, cqe);
+    } else {
+        on_send(sockfd, op, cqe);
+    }
+}
+
+/* multishot accept的地址缓冲区会被后续连接覆盖, 所以不传地址, 需要时再getpeername */
+void reactor::accept_uring(int connfd) {
+    if (http_conn::m_user_count >= MAX_FD) {
+        close(connfd);
+        return;
+    }
+    struct sockaddr_in client_address;
+    socklen_t client_addrlength = sizeof(client_address);
+    memset(&client_address, 0, sizeof(client_address));
+    getpeername(connfd, (struct sockaddr *) &client_address, &client_addrlength);
+    if (over_limit(client_address)) {
+        close(connfd);
+        return;
+    }
+
+    memset(&m_states[connfd], 0, sizeof(uring_state));
+    m_users[connfd].init(connfd, client_address, -1);
+    arm(m_users + connfd, m_idle_timeout);
+    submit_recv(connfd);
+}
+
+void reactor::on_recv(int sockfd, const io_uring_cqe &cqe) {
+    uring_state &st = m_states[sockfd];
+    bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+    unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    if (st.closing || cqe.res <= 0) {
+        if (has_buffer) {
+            m_ring->recycle_buffer(bid);
+        }
+        if (st.closing) {
+            uring_release(sockfd);
+        } else if (cqe.res == -ENOBUFS) {
+            submit_recv(sockfd);
+        } else {
+            uring_close(sockfd);
+        }
+        return;
+    }
+
+    http_conn *conn = m_users + sockfd;
+    bool fresh = conn->idle();
+    bool ok = conn->feed(m_ring->buffer(bid), cqe.res);
+    m_ring->recycle_buffer(bid);
+    if (!ok) {
+        uring_close(sockfd);
+        return;
+    }
+    if (fresh) {
+        arm(conn, m_header_timeout);
+        conn->m_arrival = stats::now_us();
+    } else if (conn->streaming()) {
+        arm(conn, m_header_timeout);
+    }
+    serve_uring(sockfd);
+}
+
+void reactor::on_send(int sockfd, int op, const io_uring_cqe &cqe) {
+    uring_state &st = m_states[sockfd];
+    http_conn *conn = m_users + sockfd;
+    if (st.closing) {
+        uring_release(sockfd);
+        return;
+    }
+    if (cqe.res < 0 && cqe.res != -ECANCELED) {
+        uring_close(sockfd);
+        return;
+    }
+    if (op == OP_READ && cqe.res == 0) {
+        //文件被截短了
+        uring_close(sockfd);
+        return;
+    }
+    if (op != OP_READ && cqe.res > 0) {
+        conn->advance(cqe.res, op == OP_SEND_FILE);
+    }
+    if (st.inflight > 0) {
+        return;
+    }
+
+    if (conn->writing()) {
+        arm(conn, m_write_timeout);
+        submit_send(sockfd);
+        return;
+    }
+
+    uint64_t now = stats::now_us();
+    http_conn::m_stats->record(stats::PHASE_RESPONSE, now - conn->m_arrival);
+    conn->m_arrival = now;
+    if (st.chunk) {
+        http_conn::m_buffer_pool->free(st.chunk, st.chunk_size);
+        st.chunk = NULL;
+    }
+    if (!conn->finish_write()) {
+        uring_close(sockfd);
+        return;
+    }
+    if (conn->pending()) {
+        arm(conn, m_header_timeout);
+        serve_uring(sockfd);
+        return;
+    }
+    arm(conn, conn->idle() ? m_idle_timeout : m_header_timeout);
+    submit_recv(sockfd);
+}
+
+/* 解析并生成响应; 有东西要发就提交发送链, 否则继续收(请求还没收完) */
+void reactor::serve_uring(int sockfd) {
+    http_conn *conn = m_users + sockfd;
+    if (!admit_request(conn, stats::now_us())) {
+        throttle(conn);
+        memset(&m_states[sockfd], 0, sizeof(uring_state));
+        return;
+    }
+    unsigned generation = conn->generation();
+    conn->handle();
+    if (conn->generation() != generation) {
+        //处理过程中已经关闭了连接
+        memset(&m_states[sockfd], 0, sizeof(uring_state));
+        return;
+    }
+    if (conn->writing()) {
+        arm(conn, m_write_timeout);
+        submit_send(sockfd);
+    } else {
+        submit_recv(sockfd);
+    }
+}
+
+bool reactor::submit_accept() {
+    io_uring_sqe *sqe = m_ring->get_sqe();
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(m_listenfd, OP_ACCEPT);
+    return true;
+}
+
+void reactor::submit_recv(int sockfd) {
+    io_uring_sqe *sqe = m_ring->get_sqe();
+    if (!sqe) {
+        uring_close(sockfd);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sockfd;
+    sqe->len = m_ring->buffer_size();
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = make_user_data(sockfd, OP_RECV);
+    ++m_states[sockfd].inflight;
+}
+
+/* 一次提交整条发送链: 剩余的iov一个sendmsg, 文件部分读一块发一块 */
+void reactor::submit_send(int sockfd) {
+    uring_state &st = m_states[sockfd];
+    http_conn *conn = m_users + sockfd;
+    const struct iovec *iov = NULL;
+    int count = conn->send_iov(iov);
+    off_t file_left = conn->send_left();
+    for (int i = 0; i < count; ++i) {
+        file_left -= iov[i].iov_len;
+    }
+
+    io_uring_sqe *last = NULL;
+    if (count > 0) {
+        io_uring_sqe *sqe = m_ring->get_sqe();
+        if (!sqe) {
+            uring_close(sockfd);
+            return;
+        }
+        memset(&st.msg, 0, sizeof(st.msg));
+        st.msg.msg_iov = (struct iovec *) iov;
+        st.msg.msg_iovlen = count;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sockfd;
+        sqe->addr = (unsigned long) &st.msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = make_user_data(sockfd, OP_SEND);
+        ++st.inflight;
+        last = sqe;
+    }
+    if (file_left <= 0) {
+        return;
+    }
+
+    if (!st.chunk) {
+        st.chunk = http_conn::m_buffer_pool->alloc(buffer_pool::MAX_SIZE, st.chunk_size);
+    }
+    io_uring_sqe *read = st.chunk ? m_ring->get_sqe() : NULL;
+    io_uring_sqe *send = read ? m_ring->get_sqe() : NULL;
+    if (!send) {
+        if (read) {
+            read->opcode = IORING_OP_NOP;
+            read->user_data = make_user_data(sockfd, OP_READ);
+            ++st.inflight;
+        }
+        uring_close(sockfd);
+        return;
+    }
+    unsigned len = file_left < st.chunk_size ? (unsigned) file_left : (unsigned) st.chunk_size;
+    if (last) {
+        last->flags |= IOSQE_IO_LINK;
+    }
+    read->opcode = IORING_OP_READ;
+    read->fd = conn->send_fd();
+    read->addr = (unsigned long) st.chunk;
+    read->len = len;
+    read->off = conn->send_offset();
+    read->flags = IOSQE_IO_LINK;
+    read->user_data = make_user_data(sockfd, OP_READ);
+    send->opcode = IORING_OP_SEND;
+    send->fd = sockfd;
+    send->addr = (unsigned long) st.chunk;
+    send->len = len;
+    send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    send->user_data = make_user_data(sockfd, OP_SEND_FILE);
+    st.inflight += 2;
+}
+
+/* 还有在途操作时先shutdown让它们尽快结束, 等最后一个完成再真正关闭(fd号在此之前不会被复用) */
+void reactor::uring_close(int sockfd) {
+    uring_state &st = m_states[sockfd];
+    if (st.closing) {
+        return;
+    }
+    if (st.inflight > 0) {
+        st.closing = true;
+        shutdown(sockfd, SHUT_RDWR);
+        return;
+    }
+    st.closing = true;
+    uring_release(sockfd);
+}
+
+void reactor::uring_release(int sockfd) {
+    uring_state &st = m_states[sockfd];
+    if (st.inflight > 0) {
+        return;
+    }
+    if (st.chunk) {
+        http_conn::m_buffer_pool->free(st.chunk, st.chunk_size);
+    }
+    memset(&st, 0, sizeof(st));
+    m_users[sockfd].close_conn();
+}
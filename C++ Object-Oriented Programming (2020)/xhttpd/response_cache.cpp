@@ -0,0 +1,65 @@
+#include "response_cache.h"
+
+static size_t cost(const std::string &key, const response_ref &response) {
+    return 2 * key.size() + response->data.size() + sizeof(cached_response);
+}
+
+response_cache::response_cache(size_t budget) :
+        m_shard_budget(budget / RESPONSE_CACHE_SHARDS), m_hits(0), m_misses(0) {
+    for (int i = 0; i < RESPONSE_CACHE_SHARDS; ++i) {
+        m_shards[i].bytes = 0;
+    }
+}
+
+response_cache::shard &response_cache::shard_of(const std::string &key) {
+    return m_shards[std::hash<std::string>()(key) % RESPONSE_CACHE_SHARDS];
+}
+
+void response_cache::erase(shard &s, std::unordered_map<std::string, shard::value>::iterator it) {
+    s.bytes -= cost(it->first, it->second.first);
+    s.lru.erase(it->second.second);
+    s.map.erase(it);
+}
+
+response_ref response_cache::lookup(const std::string &key) {
+    shard &s = shard_of(key);
+    s.lock.lock();
+    std::unordered_map<std::string, shard::value>::iterator it = s.map.find(key);
+    if (it == s.map.end()) {
+        s.lock.unlock();
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        return response_ref();
+    }
+    if (it->second.first->source->stale.load(std::memory_order_acquire)) {
+        erase(s, it);
+        s.lock.unlock();
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        return response_ref();
+    }
+    s.lru.splice(s.lru.begin(), s.lru, it->second.second);
+    response_ref ref = it->second.first;
+    s.lock.unlock();
+    m_hits.fetch_add(1, std::memory_order_relaxed);
+    return ref;
+}
+
+void response_cache::insert(const std::string &key, const response_ref &response) {
+    size_t size = cost(key, response);
+    if (size > m_shard_budget || response->source->stale.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    shard &s = shard_of(key);
+    s.lock.lock();
+    std::unordered_map<std::string, shard::value>::iterator it = s.map.find(key);
+    if (it != s.map.end()) {
+        erase(s, it);
+    }
+    while (!s.lru.empty() && s.bytes + size > m_shard_budget) {
+        erase(s, s.map.find(s.lru.back()));
+    }
+    s.lru.push_front(key);
+    s.map[key] = shard::value(response, s.lru.begin());
+    s.bytes += size;
+    s.lock.unlock();
+}
@@ -0,0 +1,58 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+#include "file_cache.h"
+
+#define RESPONSE_CACHE_SHARDS 16
+
+/* 小文件的完整响应: 状态行 + 响应头 + 文件内容, 连续存放 */
+struct cached_response {
+    file_ref        source;     //生成响应时的文件元数据, 失效后响应也作废
+    std::string     data;
+};
+
+typedef std::shared_ptr<cached_response> response_ref;
+
+class response_cache {
+public:
+    static const off_t MAX_FILE_SIZE = 64 * 1024;
+
+    explicit response_cache(size_t budget);
+
+    response_ref lookup(const std::string &key);
+
+    void insert(const std::string &key, const response_ref &response);
+
+    unsigned long hits() const { return m_hits.load(std::memory_order_relaxed); }
+
+    unsigned long misses() const { return m_misses.load(std::memory_order_relaxed); }
+
+private:
+    struct shard {
+        typedef std::list<std::string> lru_list;
+        typedef std::pair<response_ref, lru_list::iterator> value;
+
+        locker                                  lock;
+        std::unordered_map<std::string, value>  map;
+        lru_list                                lru;    //表头为最近使用
+        size_t                                  bytes;  //当前占用内存
+    };
+
+    shard &shard_of(const std::string &key);
+
+    void erase(shard &s, std::unordered_map<std::string, shard::value>::iterator it);
+
+private:
+    size_t                      m_shard_budget;     //每个分片的内存上限
+    shard                       m_shards[RESPONSE_CACHE_SHARDS];
+    std::atomic<unsigned long>  m_hits;
+    std::atomic<unsigned long>  m_misses;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include <string.h>
+#include <map>
+
+#include "router.h"
+
+std::vector<route> router::m_routes;
+std::vector<router::entry> router::m_entries;
+std::vector<router::node> router::m_nodes;
+std::vector<int> router::m_next;
+std::vector<int> router::m_table;
+
+bool router::add(unsigned methods, const char *prefix, const route_handler &handler, bool inline_ok) {
+    if (prefix[0] != '/' || strchr(prefix, '?') || !handler || methods == 0 || methods >= (1U << MAX_METHODS)) {
+        return false;
+    }
+    route r;
+    r.handler = handler;
+    r.prefix_len = (int) strlen(prefix);
+    r.inline_ok = inline_ok;
+    entry e;
+    e.prefix = prefix;
+    e.methods = methods;
+    e.route = (int) m_routes.size();
+    m_routes.push_back(r);
+    m_entries.push_back(e);
+    return true;
+}
+
+/* 先用std::map建一棵普通的trie, 再把每个节点的子节点摊平成m_next里的一段 */
+void router::compile() {
+    std::vector<std::map<unsigned char, int> > children(1);
+    std::vector<int> routes(1, -1);
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+        const entry &e = m_entries[i];
+        int n = 0;
+        for (size_t j = 0; j < e.prefix.size(); ++j) {
+            unsigned char c = e.prefix[j];
+            std::map<unsigned char, int>::iterator it = children[n].find(c);
+            if (it != children[n].end()) {
+                n = it->second;
+                continue;
+            }
+            children[n][c] = (int) children.size();
+            n = (int) children.size();
+            children.push_back(std::map<unsigned char, int>());
+            routes.push_back(-1);
+        }
+        if (routes[n] == -1) {
+            routes[n] = (int) m_table.size() / MAX_METHODS;
+            m_table.resize(m_table.size() + MAX_METHODS, -1);
+        }
+        for (int m = 0; m < MAX_METHODS; ++m) {
+            if (e.methods & (1U << m)) {
+                m_table[routes[n] * MAX_METHODS + m] = e.route;
+            }
+        }
+    }
+
+    m_nodes.resize(children.size());
+    m_next.clear();
+    for (size_t n = 0; n < children.size(); ++n) {
+        node &nd = m_nodes[n];
+        nd.routes = routes[n];
+        nd.base = (int) m_next.size();
+        if (children[n].empty()) {
+            nd.lo = 0;
+            nd.span = 0;
+            continue;
+        }
+        nd.lo = children[n].begin()->first;
+        nd.span = (unsigned short) (children[n].rbegin()->first - nd.lo + 1);
+        m_next.resize(m_next.size() + nd.span, -1);
+        for (std::map<unsigned char, int>::iterator it = children[n].begin(); it != children[n].end(); ++it) {
+            m_next[nd.base + it->first - nd.lo] = it->second;
+        }
+    }
+}
+
+const route *router::match(int method, const char *url) {
+    if (m_nodes.empty()) {
+        return NULL;
+    }
+    const route *best = NULL;
+    const unsigned char *p = (const unsigned char *) url;
+    int n = 0;
+    while (true) {
+        const node &nd = m_nodes[n];
+        if (nd.routes >= 0 && m_table[nd.routes * MAX_METHODS + method] >= 0) {
+            best = &m_routes[m_table[nd.routes * MAX_METHODS + method]];
+        }
+        unsigned offset = (unsigned) *p - nd.lo;
+        if (*p == '\0' || *p == '?' || offset >= nd.span || m_next[nd.base + offset] < 0) {
+            return best;
+        }
+        n = m_next[nd.base + offset];
+        ++p;
+    }
+}
+
+void router::clear() {
+    m_routes.clear();
+    m_entries.clear();
+    m_nodes.clear();
+    m_next.clear();
+    m_table.clear();
+}
@@ -0,0 +1,73 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class http_conn;
+
+/* 流式响应的数据源, 见http_conn::reply_stream(); 响应结束或连接关闭时delete */
+class response_stream {
+public:
+    virtual ~response_stream() {}
+
+    /* 用http_conn::write_chunk()写一批分块, 返回false表示写完了; 上一批发出去之后才会再调用 */
+    virtual bool produce(http_conn &conn) = 0;
+};
+
+/* 处理函数用http_conn::reply()或reply_stream()生成响应, 什么都没回的当作500 */
+typedef std::function<void(http_conn &conn)> route_handler;
+
+struct route {
+    route_handler   handler;
+    int             prefix_len;
+    bool            inline_ok;      //不会阻塞, epoll引擎-n时可以在reactor线程里直接调用
+};
+
+/*
+ * 进程内的处理函数, 按方法和URL前缀注册. 所有路由注册完后compile()成一棵按字节分支的trie,
+ * 每个节点的子节点是一段连续字节范围上的数组, 之后只读.
+ * 匹配时沿URL逐字节往下走, 每步一次减法和一次数组下标, 记下最后一个有这个方法的路由的节点(最长前缀),
+ * 不做字符串比较. 路由先于反向代理、上传和静态文件匹配.
+ */
+class router {
+public:
+    static const int MAX_METHODS = 16;
+
+    /* methods是按http_conn::METHOD编号的位, prefix以'/'开头且不含'?'; 同一前缀同一方法后注册的生效 */
+    static bool add(unsigned methods, const char *prefix, const route_handler &handler, bool inline_ok = false);
+
+    /* 在reactor启动前调用一次 */
+    static void compile();
+
+    /* url到'?'为止的最长前缀匹配, 没有匹配的返回NULL */
+    static const route *match(int method, const char *url);
+
+    static int count() { return (int) m_routes.size(); }
+
+    static void clear();
+
+private:
+    struct entry {
+        std::string prefix;
+        unsigned    methods;
+        int         route;
+    };
+
+    struct node {
+        unsigned char   lo;         //子节点的字节范围[lo, lo + span)
+        unsigned short  span;
+        int             base;       //这段范围在m_next里的起点
+        int             routes;     //在m_table里的行, -1表示这个节点上没有路由
+    };
+
+private:
+    static std::vector<route>   m_routes;
+    static std::vector<entry>   m_entries;
+    static std::vector<node>    m_nodes;    //m_nodes[0]是根, 对应空前缀
+    static std::vector<int>     m_next;     //子节点编号, -1表示没有
+    static std::vector<int>     m_table;    //每行MAX_METHODS个路由编号, -1表示这个方法没有
+};
+
+#endif
@@ -0,0 +1,231 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory>
+#include <new>
+
+#include "stats.h"
+
+static const char *counter_names[stats::COUNTER_COUNT] = {
+        "requests_200",
+        "requests_201",
+        "requests_204",
+        "requests_206",
+        "requests_304",
+        "requests_400",
+        "requests_403",
+        "requests_404",
+        "requests_411",
+        "requests_413",
+        "requests_416",
+        "requests_429",
+        "requests_500",
+        "requests_502",
+        "requests_503",
+        "requests_504",
+        "bytes_sent",
+        "bytes_uploaded",
+        "upload_failures",
+        "connections_accepted",
+        "connections_timeout",
+        "accept_wakeups",
+        "accept_capped",
+        "accept_failed",
+        "connections_limited",
+        "inline_batches",
+        "inline_deferred",
+        "proxy_requests",
+        "upstream_connects",
+        "upstream_reused",
+        "upstream_failures",
+        "bulk_dispatched",
+        "write_yields"
+};
+
+static const char *phase_names[stats::PHASE_COUNT] = {
+        "queue",
+        "handle",
+        "response"
+};
+
+static const double quantiles[] = {50, 90, 99, 99.9};
+
+stats::stats() : m_start(now_us()) {
+    for (int i = 0; i < MAX_THREADS; ++i) {
+        m_slots[i].store(NULL, std::memory_order_relaxed);
+    }
+}
+
+stats::~stats() {
+    for (int i = 0; i < MAX_THREADS; ++i) {
+        slot *s = m_slots[i].load(std::memory_order_relaxed);
+        if (s) {
+            s->~slot();
+            ::free(s);
+        }
+    }
+}
+
+/* 每个线程第一次记录时分配自己的槽, 按缓存行对齐, 不和别的线程的槽共享缓存行 */
+stats::slot *stats::create(int index) {
+    void *mem = NULL;
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(slot)) != 0) {
+        throw std::bad_alloc();
+    }
+    slot *s = new(mem) slot;
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        s->counters[i].store(0, std::memory_order_relaxed);
+    }
+    slot *expected = NULL;
+    if (!m_slots[index].compare_exchange_strong(expected, s, std::memory_order_acq_rel)) {
+        //只有溢出后共用最后一个槽的线程会走到这里
+        s->~slot();
+        ::free(s);
+        return expected;
+    }
+    return s;
+}
+
+void stats::count_status(int status) {
+    switch (status) {
+    case 200:
+        add(STATUS_200);
+        break;
+    case 201:
+        add(STATUS_201);
+        break;
+    case 204:
+        add(STATUS_204);
+        break;
+    case 206:
+        add(STATUS_206);
+        break;
+    case 304:
+        add(STATUS_304);
+        break;
+    case 400:
+        add(STATUS_400);
+        break;
+    case 403:
+        add(STATUS_403);
+        break;
+    case 404:
+        add(STATUS_404);
+        break;
+    case 411:
+        add(STATUS_411);
+        break;
+    case 413:
+        add(STATUS_413);
+        break;
+    case 416:
+        add(STATUS_416);
+        break;
+    case 429:
+        add(STATUS_429);
+        break;
+    case 500:
+        add(STATUS_500);
+        break;
+    case 502:
+        add(STATUS_502);
+        break;
+    case 503:
+        add(STATUS_503);
+        break;
+    case 504:
+        add(STATUS_504);
+        break;
+    default:
+        break;
+    }
+}
+
+void stats::add_gauge(const char *name, const std::function<long()> &read) {
+    m_gauges.push_back(std::make_pair(name, read));
+}
+
+void stats::collect(snapshot &out) const {
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        out.counters[i] = 0;
+    }
+    for (int i = 0; i < MAX_THREADS; ++i) {
+        const slot *s = m_slots[i].load(std::memory_order_acquire);
+        if (!s) {
+            continue;
+        }
+        for (int j = 0; j < COUNTER_COUNT; ++j) {
+            out.counters[j] += s->counters[j].load(std::memory_order_relaxed);
+        }
+        for (int j = 0; j < PHASE_COUNT; ++j) {
+            out.latency[j].merge(s->latency[j]);
+        }
+    }
+    out.uptime = (now_us() - m_start) / 1000000;
+}
+
+static void append(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(std::string &out, const char *format, ...) {
+    char line[256];
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(line, sizeof(line), format, arg_list);
+    va_end(arg_list);
+    if (len > 0) {
+        out.append(line, len < (int) sizeof(line) ? len : sizeof(line) - 1);
+    }
+}
+
+/* 一行一个"名字 值", 直方图按quantile标签展开 */
+std::string stats::text() const {
+    std::unique_ptr<snapshot> snap(new snapshot);
+    collect(*snap);
+
+    std::string out;
+    append(out, "uptime_seconds %ld\n", snap->uptime);
+    for (size_t i = 0; i < m_gauges.size(); ++i) {
+        append(out, "%s %ld\n", m_gauges[i].first, m_gauges[i].second());
+    }
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        append(out, "%s %lu\n", counter_names[i], (unsigned long) snap->counters[i]);
+    }
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        const histogram &h = snap->latency[i];
+        append(out, "latency_%s_us_count %lu\n", phase_names[i], (unsigned long) h.count());
+        append(out, "latency_%s_us_mean %.1f\n", phase_names[i], h.mean());
+        for (size_t j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); ++j) {
+            append(out, "latency_%s_us{quantile=\"%g\"} %lu\n", phase_names[i], quantiles[j] / 100,
+                   (unsigned long) h.percentile(quantiles[j]));
+        }
+        append(out, "latency_%s_us_max %lu\n", phase_names[i], (unsigned long) h.max());
+    }
+    return out;
+}
+
+std::string stats::json() const {
+    std::unique_ptr<snapshot> snap(new snapshot);
+    collect(*snap);
+
+    std::string out;
+    append(out, "{\"uptime_seconds\":%ld,\"gauges\":{", snap->uptime);
+    for (size_t i = 0; i < m_gauges.size(); ++i) {
+        append(out, "%s\"%s\":%ld", i ? "," : "", m_gauges[i].first, m_gauges[i].second());
+    }
+    out += "},\"counters\":{";
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        append(out, "%s\"%s\":%lu", i ? "," : "", counter_names[i], (unsigned long) snap->counters[i]);
+    }
+    out += "},\"latency_us\":{";
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        const histogram &h = snap->latency[i];
+        append(out, "%s\"%s\":{\"count\":%lu,\"mean\":%.1f", i ? "," : "", phase_names[i],
+               (unsigned long) h.count(), h.mean());
+        for (size_t j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); ++j) {
+            append(out, ",\"p%g\":%lu", quantiles[j], (unsigned long) h.percentile(quantiles[j]));
+        }
+        append(out, ",\"max\":%lu}", (unsigned long) h.max());
+    }
+    out += "}}\n";
+    return out;
+}
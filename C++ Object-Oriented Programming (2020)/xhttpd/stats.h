@@ -0,0 +1,141 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "histogram.h"
+#include "workqueue.h"
+
+/*
+ * 运行时统计: 每个线程一个按缓存行对齐的槽, 计数器和延迟直方图只由本线程写,
+ * 热路径上是一次TLS读加几次普通load/store, 没有锁和lock前缀; 读取/__stats时才把所有槽合并.
+ * 连接数、队列长度这类瞬时值用gauge在读取时现算.
+ */
+class stats {
+public:
+    static const int MAX_THREADS = 128;
+
+    enum counter {
+        STATUS_200 = 0,
+        STATUS_201,
+        STATUS_204,
+        STATUS_206,
+        STATUS_304,
+        STATUS_400,
+        STATUS_403,
+        STATUS_404,
+        STATUS_411,
+        STATUS_413,
+        STATUS_416,
+        STATUS_429,
+        STATUS_500,
+        STATUS_502,
+        STATUS_503,
+        STATUS_504,
+        BYTES_SENT,
+        BYTES_UPLOADED,         //写进上传文件的请求体, 只算成功的上传
+        UPLOAD_FAILURES,        //建临时文件、写盘或改名失败, 回了500的上传
+        CONNECTIONS_ACCEPTED,
+        CONNECTIONS_TIMEOUT,
+        ACCEPT_WAKEUPS,         //accept到连接的轮数, connections_accepted除以它就是每轮平均accept数
+        ACCEPT_CAPPED,          //一轮accept到了上限, 留到下一轮继续
+        ACCEPT_FAILED,
+        CONNECTIONS_LIMITED,    //accept时来源地址的令牌已经用完, 直接关闭的
+        INLINE_BATCHES,         //在reactor线程里直接处理的批次
+        INLINE_DEFERRED,        //其中遇到要阻塞的请求, 转给线程池的
+        PROXY_REQUESTS,
+        UPSTREAM_CONNECTS,      //新建的上游连接
+        UPSTREAM_REUSED,        //从连接池里取的上游连接
+        UPSTREAM_FAILURES,      //连接失败、超时或响应不完整
+        BULK_DISPATCHED,        //按预估大小排进大请求队列的
+        WRITE_YIELDS,           //发满一个写配额后让出reactor线程
+        COUNTER_COUNT
+    };
+
+    /* 请求的各个阶段 */
+    enum phase {
+        PHASE_QUEUE = 0,    //reactor投递到工作线程开始处理
+        PHASE_HANDLE,       //工作线程解析请求、生成响应
+        PHASE_RESPONSE,     //收到请求第一个字节到响应全部发出
+        PHASE_COUNT
+    };
+
+    stats();
+
+    ~stats();
+
+    void add(counter c, uint64_t n = 1);
+
+    void record(phase p, uint64_t us);
+
+    void count_status(int status);
+
+    /* 只在启动阶段注册, 之后只读 */
+    void add_gauge(const char *name, const std::function<long()> &read);
+
+    std::string text() const;
+
+    std::string json() const;
+
+    static uint64_t now_us();
+
+private:
+    struct slot {
+        std::atomic<uint64_t>   counters[COUNTER_COUNT];
+        histogram               latency[PHASE_COUNT];
+    };
+
+    struct snapshot {
+        uint64_t                counters[COUNTER_COUNT];
+        histogram               latency[PHASE_COUNT];
+        long                    uptime;
+    };
+
+    static int thread_index();
+
+    slot *local();
+
+    slot *create(int index);
+
+    void collect(snapshot &out) const;
+
+private:
+    std::atomic<slot*>                                      m_slots[MAX_THREADS];
+    std::vector<std::pair<const char*, std::function<long()> > > m_gauges;
+    long                                                    m_start;    //启动时间(us)
+};
+
+/* 超过MAX_THREADS的线程共用最后一个槽, 那部分计数可能丢失 */
+inline int stats::thread_index() {
+    static std::atomic<int> next(0);
+    static thread_local int index = next.fetch_add(1, std::memory_order_relaxed);
+    return index < MAX_THREADS ? index : MAX_THREADS - 1;
+}
+
+inline stats::slot *stats::local() {
+    int index = thread_index();
+    slot *s = m_slots[index].load(std::memory_order_acquire);
+    return s ? s : create(index);
+}
+
+inline void stats::add(counter c, uint64_t n) {
+    std::atomic<uint64_t> &value = local()->counters[c];
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void stats::record(phase p, uint64_t us) {
+    local()->latency[p].record(us);
+}
+
+inline uint64_t stats::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+#endif
@@ -1,43 +1,73 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
+#include <atomic>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <vector>
 #include "locker.h"
+#include "workqueue.h"
+#include "topology.h"
+
+#define STEAL_BATCH 32
+#define BULK_EVERY 8
+
+/*
+ * 按预估大小分两条注入队列: 小请求优先, 大请求(append时bulk为true)只在没有小请求时处理.
+ * 防止大请求饿死: 大请求排着队时, 每个线程连续处理BULK_EVERY个小请求后必须取一个大请求.
+ * places给出时第i个线程按places[i % places.size()]绑定CPU; 析构时唤醒所有线程, 等它们处理完手上的请求后join,
+ * 队列里还没取走的请求丢弃, 由调用者关闭对应的连接.
+ * 环形队列的容量会向上取整成2的幂, 取走的任务还会进各线程的本地队列, 所以排队总数单独计数, 两条队列合计不超过max_requests.
+ */
 
 template<typename T>
 class threadpool {
 public:
-    threadpool(int thread_number = 4, int max_requests = 10000);
+    threadpool(int thread_number = 4, int max_requests = 10000,
+               const std::vector<placement> &places = std::vector<placement>());
 
     ~threadpool();
 
-    bool append(T *request);
+    bool append(T *request, bool bulk = false);
+
+    size_t size() const;
 
 private:
     static void *worker(void *arg);
 
     void run();
 
+    void stop();
+
+    T *take(int index, int &streak);
+
 private:
-    int             m_thread_number;    //线程数
-    int             m_max_requests;     //最大请求量
-    pthread_t*      m_threads;          //线程
-    std::list<T*>   m_workqueue;        //任务队列
-    locker          m_queuelocker;      //锁
-    sem             m_queuestat;        //条件变量
-    bool            m_stop;             //线程池状态
+    int                 m_thread_number;    //线程数
+    int                 m_max_requests;     //最大请求量
+    pthread_t*          m_threads;          //线程
+    std::vector<placement> m_places;        //每个线程的位置, 为空时不绑定
+    mpmc_ring<T*>       m_workqueue;        //任务注入队列
+    mpmc_ring<T*>       m_bulkqueue;        //大请求的注入队列
+    ws_deque<T*>*       m_local;            //每个线程的工作窃取队列
+    std::atomic<int>    m_next_index;       //线程编号
+    std::atomic<int>    m_idle;             //睡眠线程数
+    std::atomic<int>    m_queued;           //已投递还没开始处理的任务数
+    sem                 m_queuestat;        //唤醒睡眠线程
+    std::atomic<bool>   m_stop;             //线程池状态
 };
 
 template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests) :
-        m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(NULL) {
+threadpool<T>::threadpool(int thread_number, int max_requests, const std::vector<placement> &places) :
+        m_thread_number(thread_number), m_max_requests(max_requests), m_threads(NULL), m_places(places),
+        m_workqueue(max_requests > 0 ? max_requests + 1 : 2),
+        m_bulkqueue(max_requests > 0 ? max_requests + 1 : 2), m_local(NULL), m_next_index(0), m_idle(0),
+        m_queued(0), m_stop(false) {
     if ((thread_number <= 0) || (max_requests <= 0)) {
         throw std::exception();
     }
 
+    m_local = new ws_deque<T*>[m_thread_number];
     m_threads = new pthread_t[m_thread_number];
     if (!m_threads) {
         throw std::exception();
@@ -46,11 +76,11 @@ threadpool<T>::threadpool(int thread_number, int max_requests) :
     for (int i = 0; i < thread_number; ++i) {
         printf("create the %dth thread\n", i);
         if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
+            //已经建好的线程先停下来
+            m_thread_number = i;
+            stop();
             delete[] m_threads;
-            throw std::exception();
-        }
-        if (pthread_detach(m_threads[i])) {
-            delete[] m_threads;
+            delete[] m_local;
             throw std::exception();
         }
     }
@@ -58,23 +88,46 @@ threadpool<T>::threadpool(int thread_number, int max_requests) :
 
 template<typename T>
 threadpool<T>::~threadpool() {
+    stop();
     delete[] m_threads;
-    m_stop = true;
+    delete[] m_local;
 }
 
+/* 每个线程在发现m_stop之前最多再睡一次, 所以每个线程post一次就能全部唤醒 */
 template<typename T>
-bool threadpool<T>::append(T* request) {
-    m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests) {
-        m_queuelocker.unlock();
+void threadpool<T>::stop() {
+    m_stop.store(true);
+    for (int i = 0; i < m_thread_number; ++i) {
+        m_queuestat.post();
+    }
+    for (int i = 0; i < m_thread_number; ++i) {
+        pthread_join(m_threads[i], NULL);
+    }
+}
+
+template<typename T>
+bool threadpool<T>::append(T* request, bool bulk) {
+    if (m_queued.fetch_add(1, std::memory_order_relaxed) >= m_max_requests) {
+        m_queued.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (!(bulk ? m_bulkqueue : m_workqueue).push(request)) {
+        m_queued.fetch_sub(1, std::memory_order_relaxed);
         return false;
     }
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_idle.load(std::memory_order_relaxed) > 0) {
+        m_queuestat.post();
+    }
     return true;
 }
 
+/* 排队中还没开始处理的任务数, 包括已经被搬进本地队列的 */
+template<typename T>
+size_t threadpool<T>::size() const {
+    return m_queued.load(std::memory_order_relaxed);
+}
+
 template<typename T>
 void *threadpool<T>::worker(void *arg) {
     threadpool *pool = (threadpool *) arg;
@@ -82,21 +135,74 @@ void *threadpool<T>::worker(void *arg) {
     return pool;
 }
 
+template<typename T>
+T *threadpool<T>::take(int index, int &streak) {
+    T *request = NULL;
+    if (streak >= BULK_EVERY && m_bulkqueue.pop(request)) {
+        streak = 0;
+        return request;
+    }
+
+    if (m_local[index].pop(request)) {
+        ++streak;
+        return request;
+    }
+
+    if (m_workqueue.pop(request)) {
+        ++streak;
+        size_t batch = m_workqueue.size() / m_thread_number;
+        if (batch > STEAL_BATCH) {
+            batch = STEAL_BATCH;
+        }
+        T *extra = NULL;
+        while (batch-- > 0 && m_workqueue.pop(extra)) {
+            //本地队列满了就放回注入队列, 不能丢掉; 放回去的位置有刚腾出来的
+            if (!m_local[index].push(extra)) {
+                m_workqueue.push(extra);
+                break;
+            }
+        }
+        if (m_local[index].size() > 0 && m_idle.load(std::memory_order_relaxed) > 0) {
+            m_queuestat.post();
+        }
+        return request;
+    }
+
+    for (int i = 1; i < m_thread_number; ++i) {
+        if (m_local[(index + i) % m_thread_number].steal(request)) {
+            ++streak;
+            return request;
+        }
+    }
+
+    if (m_bulkqueue.pop(request)) {
+        streak = 0;
+        return request;
+    }
+    return NULL;
+}
+
 template<typename T>
 void threadpool<T>::run() {
+    int index = m_next_index++;
+    int streak = 0;     //上次取大请求之后连续处理的小请求数
+    if (!m_places.empty()) {
+        cpu_topology::bind(m_places[index % m_places.size()]);
+    }
     while (!m_stop) {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if (m_workqueue.empty()) {
-            m_queuelocker.unlock();
-            continue;
-        }
-        T *request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
+        T *request = take(index, streak);
         if (!request) {
-            continue;
+            m_idle++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            request = take(index, streak);
+            if (!request) {
+                m_queuestat.wait();
+                m_idle--;
+                continue;
+            }
+            m_idle--;
         }
+        m_queued.fetch_sub(1, std::memory_order_relaxed);
         request->process();
     }
 }
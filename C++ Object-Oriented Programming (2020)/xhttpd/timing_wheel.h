@@ -0,0 +1,100 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * 哈希时间轮: 到期时间按刻度散列到槽里, 超过一圈的用rounds记圈数, 插入和到期都是O(1).
+ * 条目不支持删除, 由调用方用(generation, key)判断条目是否仍然有效, 失效的条目到期时丢弃.
+ * 只能在一个线程里使用.
+ */
+template<typename T>
+class timing_wheel {
+public:
+    timing_wheel(long now, int slots = 512, int tick = 100);
+
+    void schedule(T *item, unsigned generation, long key, long expire);
+
+    int timeout(long now) const;
+
+    template<typename F>
+    void advance(long now, F handler);
+
+    int tick() const { return m_tick; }
+
+private:
+    struct entry {
+        T*          item;
+        unsigned    generation;
+        long        key;
+        long        rounds;
+    };
+
+    std::vector<std::vector<entry> >    m_slots;
+    int                                 m_tick;     //刻度(ms)
+    long                                m_current;  //当前刻度
+    long                                m_time;     //当前刻度对应的时间(ms)
+    size_t                              m_size;     //条目数, 含已失效的
+};
+
+template<typename T>
+timing_wheel<T>::timing_wheel(long now, int slots, int tick) :
+        m_slots(slots), m_tick(tick), m_current(0), m_time(now), m_size(0) {
+}
+
+template<typename T>
+void timing_wheel<T>::schedule(T *item, unsigned generation, long key, long expire) {
+    long ticks = (expire - m_time + m_tick - 1) / m_tick;
+    if (ticks < 1) {
+        ticks = 1;
+    }
+    long slots = m_slots.size();
+    entry e = {item, generation, key, (ticks - 1) / slots};
+    m_slots[(m_current + ticks) % slots].push_back(e);
+    ++m_size;
+}
+
+/* 距下一个刻度的毫秒数, 给epoll_wait当超时用; 没有条目时返回-1 */
+template<typename T>
+int timing_wheel<T>::timeout(long now) const {
+    if (m_size == 0) {
+        return -1;
+    }
+    long left = m_time + m_tick - now;
+    return left > 0 ? (int) left : 0;
+}
+
+/* 走过now之前的所有刻度, 对每个到期条目调用handler(item, generation, key) */
+template<typename T>
+template<typename F>
+void timing_wheel<T>::advance(long now, F handler) {
+    if (m_size == 0) {
+        m_time = now;
+        return;
+    }
+
+    std::vector<entry> due;
+    while (now - m_time >= m_tick) {
+        m_time += m_tick;
+        ++m_current;
+        std::vector<entry> &slot = m_slots[m_current % m_slots.size()];
+        due.swap(slot);
+        for (size_t i = 0; i < due.size(); ++i) {
+            if (due[i].rounds > 0) {
+                --due[i].rounds;
+                slot.push_back(due[i]);
+            } else {
+                --m_size;
+                handler(due[i].item, due[i].generation, due[i].key);
+            }
+        }
+        due.clear();
+        if (m_size == 0) {
+            m_time = now;
+            break;
+        }
+    }
+}
+
+#endif
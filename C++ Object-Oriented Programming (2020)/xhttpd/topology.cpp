@@ -0,0 +1,131 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <algorithm>
+
+#include "topology.h"
+#include "buffer_pool.h"
+
+cpu_topology::cpu_topology() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    DIR *d = opendir("/sys/devices/system/node");
+    if (d) {
+        std::vector<int> ids;
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+            int id;
+            char extra;
+            if (sscanf(ent->d_name, "node%d%c", &id, &extra) == 1) {
+                ids.push_back(id);
+            }
+        }
+        closedir(d);
+        std::sort(ids.begin(), ids.end());
+
+        for (size_t i = 0; i < ids.size(); ++i) {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+            FILE *f = fopen(path, "r");
+            if (!f) {
+                continue;
+            }
+            char line[1024];
+            std::vector<int> cpus, usable;
+            if (fgets(line, sizeof(line), f) && parse_list(line, cpus)) {
+                //只留下本进程能用的CPU(taskset、cgroup cpuset), 没有CPU的节点(只有内存)跳过
+                for (size_t j = 0; j < cpus.size(); ++j) {
+                    if (cpus[j] < CPU_SETSIZE && CPU_ISSET(cpus[j], &allowed)) {
+                        usable.push_back(cpus[j]);
+                    }
+                }
+            }
+            fclose(f);
+            if (!usable.empty()) {
+                m_nodes.push_back(usable);
+            }
+        }
+    }
+
+    if (m_nodes.empty()) {
+        std::vector<int> cpus;
+        for (int i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &allowed)) {
+                cpus.push_back(i);
+            }
+        }
+        m_nodes.push_back(cpus);
+    }
+}
+
+bool cpu_topology::parse_mode(const char *name, mode &m) {
+    if (strcmp(name, "none") == 0) {
+        m = NONE;
+    } else if (strcmp(name, "cpu") == 0) {
+        m = CPU;
+    } else if (strcmp(name, "node") == 0) {
+        m = NODE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* 格式: 0-3,8-11 */
+bool cpu_topology::parse_list(const char *text, std::vector<int> &cpus) {
+    const char *p = text;
+    while (*p && *p != '\n') {
+        char *end = NULL;
+        long lo = strtol(p, &end, 10);
+        if (end == p || lo < 0) {
+            return false;
+        }
+        long hi = lo;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo) {
+                return false;
+            }
+            p = end;
+        }
+        for (long i = lo; i <= hi; ++i) {
+            cpus.push_back((int) i);
+        }
+        if (*p == ',') {
+            ++p;
+        }
+    }
+    return !cpus.empty();
+}
+
+placement cpu_topology::place(mode m, int node, int index) const {
+    placement p;
+    p.node = node;
+    const std::vector<int> &cpus = m_nodes[node % m_nodes.size()];
+    if (m == CPU) {
+        p.cpus.push_back(cpus[index % cpus.size()]);
+    } else if (m == NODE) {
+        p.cpus = cpus;
+    }
+    return p;
+}
+
+void cpu_topology::bind(const placement &p) {
+    if (!p.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < p.cpus.size(); ++i) {
+            CPU_SET(p.cpus[i], &set);
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            printf("bind thread to node %d failed\n", p.node);
+        }
+    }
+    buffer_pool::set_local_node(p.node);
+}
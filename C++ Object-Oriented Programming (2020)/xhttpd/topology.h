@@ -0,0 +1,43 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <vector>
+
+/* 一个线程放在哪里: 绑定到cpus里的CPU(为空时不绑定), 缓冲区从node的空闲队列里取 */
+struct placement {
+    int                 node;
+    std::vector<int>    cpus;
+};
+
+/*
+ * 从/sys/devices/system/node读出每个NUMA节点的CPU, 读不到(没有NUMA或容器里没挂sysfs)时
+ * 当作一个节点, 包含当前进程能用的所有CPU. 只在启动时用.
+ */
+class cpu_topology {
+public:
+    enum mode {
+        NONE = 0,       //不绑定, 由调度器决定
+        CPU,            //每个线程绑一个CPU
+        NODE            //线程绑到整个节点, 节点内由调度器决定
+    };
+
+    cpu_topology();
+
+    static bool parse_mode(const char *name, mode &m);
+
+    int nodes() const { return (int) m_nodes.size(); }
+
+    /* 节点上第index个线程的位置; CPU模式下按节点内的CPU轮流分配 */
+    placement place(mode m, int node, int index) const;
+
+    /* 在调用线程上生效 */
+    static void bind(const placement &p);
+
+private:
+    static bool parse_list(const char *text, std::vector<int> &cpus);
+
+private:
+    std::vector<std::vector<int> > m_nodes;
+};
+
+#endif
@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "upload.h"
+
+std::string upload::m_prefix;
+std::string upload::m_dir;
+long upload::m_max_size = 0;
+
+bool upload::configure(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec || spec[0] != '/') {
+        return false;
+    }
+    m_prefix.assign(spec, eq - spec);
+    //前缀后面直接是文件名, /up不能匹配/upload.txt
+    if (m_prefix[m_prefix.size() - 1] != '/') {
+        m_prefix += '/';
+    }
+
+    std::string rest(eq + 1);
+    size_t comma = rest.find(',');
+    if (comma != std::string::npos) {
+        const char *max = rest.c_str() + comma + 1;
+        char *end = NULL;
+        m_max_size = strtol(max, &end, 10) * 1024 * 1024;
+        if (end == max || *end != '\0' || m_max_size < 0) {
+            return false;
+        }
+        rest.resize(comma);
+    }
+    while (rest.size() > 1 && rest[rest.size() - 1] == '/') {
+        rest.resize(rest.size() - 1);
+    }
+    struct stat st;
+    if (rest.empty() || stat(rest.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+    }
+    m_dir = rest;
+    return true;
+}
+
+bool upload::accepts(const char *url) {
+    return !m_prefix.empty() && strncmp(url, m_prefix.c_str(), m_prefix.size()) == 0;
+}
+
+/* 前缀后面只能是一个文件名: 不能有子目录, 不能以'.'开头(隐藏文件、..和临时文件) */
+upload *upload::create(const char *url, bool chunked, long length, int &status) {
+    const char *name = url + m_prefix.size();
+    size_t len = strcspn(name, "?");
+    if (len == 0 || name[0] == '.' || memchr(name, '/', len)) {
+        status = 403;
+        return NULL;
+    }
+    if (!chunked && m_max_size > 0 && length > m_max_size) {
+        status = 413;
+        return NULL;
+    }
+
+    upload *u = new upload;
+    u->m_path = m_dir + '/' + std::string(name, len);
+    u->m_temp = m_dir + "/.upload.XXXXXX";
+    u->m_fd = mkostemp(&u->m_temp[0], O_CLOEXEC);
+    if (u->m_fd < 0) {
+        u->m_temp.clear();
+        delete u;
+        status = 500;
+        return NULL;
+    }
+    u->m_body.init(chunked ? body_framer::CHUNKED : body_framer::LENGTH, length);
+    return u;
+}
+
+upload::upload() : m_fd(-1), m_received(0), m_status(0) {
+    m_pipe[0] = -1;
+    m_pipe[1] = -1;
+}
+
+/* 没有提交的临时文件删掉 */
+upload::~upload() {
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+    if (m_pipe[0] != -1) {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+    if (!m_temp.empty()) {
+        unlink(m_temp.c_str());
+    }
+}
+
+long upload::write(const char *data, long len) {
+    long used = 0;
+    while (used < len && !m_body.done()) {
+        long framing = 0;
+        long n = m_body.payload(data + used, len - used, framing);
+        if (n < 0) {
+            m_status = 400;
+            return -1;
+        }
+        used += framing;
+        if (n > 0 && !write_file(data + used, n)) {
+            return -1;
+        }
+        used += n;
+    }
+    return used;
+}
+
+/* chunked的请求体事先不知道大小, 超过上限时在这里发现 */
+bool upload::write_file(const char *data, long len) {
+    if (m_max_size > 0 && m_received + len > m_max_size) {
+        m_status = 413;
+        return false;
+    }
+    while (len > 0) {
+        ssize_t n = ::write(m_fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            m_status = 500;
+            return false;
+        }
+        data += n;
+        len -= n;
+        m_received += n;
+    }
+    return true;
+}
+
+/*
+ * socket -> 管道 -> 文件, 每次最多CHUNK字节. 管道每次都倒空, 所以第一步只会因为socket没数据而EAGAIN;
+ * 第二步写文件只受磁盘影响, 管道里搬进来的数据必须全部写完.
+ */
+long upload::splice_from(int sockfd, long max) {
+    if (m_pipe[0] == -1 && pipe2(m_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        m_status = 500;
+        return -1;
+    }
+    long len = m_body.remaining();
+    if (len > CHUNK) {
+        len = CHUNK;
+    }
+    if (len > max) {
+        len = max;
+    }
+
+    ssize_t n;
+    do {
+        n = splice(sockfd, NULL, m_pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    if (n <= 0) {
+        //对端关闭或连接出错, 没法回响应了
+        m_status = 0;
+        return -1;
+    }
+
+    for (long left = n; left > 0; ) {
+        ssize_t m = splice(m_pipe[0], NULL, m_fd, NULL, left, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR) {
+            continue;
+        }
+        if (m <= 0) {
+            m_status = 500;
+            return -1;
+        }
+        left -= m;
+    }
+    m_received += n;
+    m_body.skip(n);
+    return n;
+}
+
+/* 不fsync: 和普通的write一样交给内核回写, 崩溃时可能丢掉最近的上传 */
+bool upload::commit(bool &created) {
+    struct stat st;
+    created = stat(m_path.c_str(), &st) < 0;
+    if (fchmod(m_fd, 0644) < 0 || rename(m_temp.c_str(), m_path.c_str()) < 0) {
+        m_status = 500;
+        return false;
+    }
+    m_temp.clear();
+    return true;
+}
@@ -0,0 +1,69 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <sys/types.h>
+#include <string>
+#include "upstream.h"
+
+/*
+ * 上传: URL前缀下PUT/POST的请求体流式写进对应目录里的文件, 前缀和目录启动时用-U配置, 之后只读.
+ * 不管请求体多大, 每个上传只占一个临时文件和一对管道, 读缓冲区也不会因此变大:
+ * Content-Length的请求体用splice从socket经管道搬进文件, 不经过用户态;
+ * chunked的请求体在读缓冲区里由body_framer解码, 一段一段write进文件.
+ * 先写同目录下的临时文件, 收完后rename成目标文件, 中途失败就删掉, 目标文件不会只有半截.
+ */
+class upload {
+public:
+    static const long CHUNK = 64 * 1024;        //一次splice搬运的字节数, 等于管道的默认容量
+    static const long QUANTUM = 1024 * 1024;    //一次最多接收这么多, 之后让出线程, 等下一次EPOLLIN
+
+    /* 格式: prefix=dir[,max_mb], max_mb为0时不限制大小 */
+    static bool configure(const char *spec);
+
+    /* url在上传前缀下 */
+    static bool accepts(const char *url);
+
+    /* 文件名不合法(403)、超过大小上限(413)或建不了临时文件(500, 由调用方计入stats)时返回NULL, status为要回的状态码 */
+    static upload *create(const char *url, bool chunked, long length, int &status);
+
+    ~upload();
+
+    /* data里的请求体写进文件, 返回用掉的字节数(chunked时包含分块的框架), 出错返回-1 */
+    long write(const char *data, long len);
+
+    /* 从socket直接搬最多max字节进文件, 返回搬的字节数, socket暂时没有数据时返回0, 出错返回-1 */
+    long splice_from(int sockfd, long max);
+
+    /* 收完后改名成目标文件, created表示之前没有这个文件 */
+    bool commit(bool &created);
+
+    /* Content-Length的请求体才能splice, chunked的要解码 */
+    bool spliceable() const { return m_body.framing() == body_framer::LENGTH; }
+
+    bool done() const { return m_body.done(); }
+
+    long received() const { return m_received; }
+
+    /* 出错后要回的状态码, 0表示连接已经断了, 直接关闭 */
+    int status() const { return m_status; }
+
+private:
+    upload();
+
+    bool write_file(const char *data, long len);
+
+private:
+    static std::string  m_prefix;
+    static std::string  m_dir;
+    static long         m_max_size;     //单个文件的上限(字节), 0为不限制
+
+    std::string         m_path;
+    std::string         m_temp;         //临时文件, 提交后清空
+    int                 m_fd;
+    int                 m_pipe[2];      //splice用的管道, 第一次splice时才建
+    body_framer         m_body;
+    long                m_received;     //已经写进文件的字节数
+    int                 m_status;
+};
+
+#endif
@@ -0,0 +1,363 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "upstream.h"
+
+std::vector<upstream*> upstream::m_upstreams;
+
+upstream::upstream() :
+        m_index(0), m_addr_len(0), m_connect_timeout(DEFAULT_CONNECT_TIMEOUT), m_read_timeout(DEFAULT_READ_TIMEOUT),
+        m_failures(0), m_down_until(0) {
+    memset(&m_addr, 0, sizeof(m_addr));
+}
+
+bool upstream::add(const char *spec) {
+    upstream *up = new upstream;
+    if (!up->parse(spec)) {
+        delete up;
+        return false;
+    }
+    up->m_index = (int) m_upstreams.size();
+    m_upstreams.push_back(up);
+    return true;
+}
+
+void upstream::clear() {
+    for (size_t i = 0; i < m_upstreams.size(); ++i) {
+        delete m_upstreams[i];
+    }
+    m_upstreams.clear();
+}
+
+bool upstream::parse(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec || spec[0] != '/') {
+        return false;
+    }
+    m_prefix.assign(spec, eq - spec);
+
+    std::string rest(eq + 1);
+    size_t comma = rest.find(',');
+    if (comma != std::string::npos) {
+        const char *timeouts = rest.c_str() + comma + 1;
+        m_connect_timeout = atoi(timeouts);
+        const char *read = strchr(timeouts, ',');
+        if (read) {
+            m_read_timeout = atoi(read + 1);
+        }
+        rest.resize(comma);
+    }
+    if (m_connect_timeout <= 0 || m_read_timeout <= 0) {
+        return false;
+    }
+    m_name = rest;
+
+    if (rest.compare(0, 5, "unix:") == 0) {
+        sockaddr_un *addr = (sockaddr_un *) &m_addr;
+        std::string path = rest.substr(5);
+        if (path.empty() || path.size() >= sizeof(addr->sun_path)) {
+            return false;
+        }
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+        m_addr_len = sizeof(sockaddr_un);
+        return true;
+    }
+
+    //只在启动时解析一次主机名, 之后不再查DNS
+    size_t colon = rest.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        return false;
+    }
+    std::string host = rest.substr(0, colon);
+    std::string port = rest.substr(colon + 1);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = NULL;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+        return false;
+    }
+    memcpy(&m_addr, result->ai_addr, result->ai_addrlen);
+    m_addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+upstream *upstream::match(const char *url) {
+    upstream *best = NULL;
+    for (size_t i = 0; i < m_upstreams.size(); ++i) {
+        upstream *up = m_upstreams[i];
+        if (strncmp(url, up->m_prefix.c_str(), up->m_prefix.size()) == 0
+            && (!best || up->m_prefix.size() > best->m_prefix.size())) {
+            best = up;
+        }
+    }
+    return best;
+}
+
+/* 非阻塞连接, 返回fd; in_progress为true时要等可写后再查SO_ERROR */
+int upstream::connect_nonblocking(bool &in_progress) const {
+    int fd = socket(m_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (m_addr.ss_family != AF_UNIX) {
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+    in_progress = false;
+    if (connect(fd, (const sockaddr *) &m_addr, m_addr_len) < 0) {
+        //unix socket的监听队列满时返回EAGAIN, 当作连接失败
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        in_progress = true;
+    }
+    return fd;
+}
+
+bool upstream::available(long now) const {
+    return m_failures.load(std::memory_order_relaxed) < MAX_FAILURES
+           || now >= m_down_until.load(std::memory_order_relaxed);
+}
+
+void upstream::succeeded() {
+    if (m_failures.load(std::memory_order_relaxed) != 0) {
+        m_failures.store(0, std::memory_order_relaxed);
+    }
+}
+
+/* 不可用期间到期后放过去的探测请求又失败时, 直接再标记一个周期 */
+void upstream::failed(long now) {
+    if (m_failures.fetch_add(1, std::memory_order_relaxed) + 1 >= MAX_FAILURES) {
+        m_down_until.store(now + DOWN_TIME, std::memory_order_relaxed);
+    }
+}
+
+static bool header_is(const char *line, size_t name_len, const char *name) {
+    return strlen(name) == name_len && strncasecmp(line, name, name_len) == 0;
+}
+
+/* 逗号分隔的列表里有没有token, 不区分大小写 */
+static bool has_token(const char *value, const char *end, const char *token) {
+    size_t n = strlen(token);
+    for (const char *p = value; p + n <= end; ++p) {
+        if (strncasecmp(p, token, n) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int parse_upstream_head(const char *buf, int len, upstream_head &head) {
+    const char *end = (const char *) memmem(buf, len, "\r\n\r\n", 4);
+    if (!end) {
+        return 0;
+    }
+    head.length = end + 4 - buf;
+    head.content_length = -1;
+    head.chunked = false;
+
+    if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ') {
+        return -1;
+    }
+    bool http11 = buf[7] == '1';
+    head.status = atoi(buf + 9);
+    if (head.status < 100 || head.status > 999) {
+        return -1;
+    }
+    head.keep_alive = http11;
+
+    const char *line = (const char *) memchr(buf, '\n', head.length) + 1;
+    while (line < end) {
+        const char *eol = (const char *) memchr(line, '\r', end + 2 - line);
+        const char *colon = (const char *) memchr(line, ':', eol - line);
+        if (colon) {
+            size_t name_len = colon - line;
+            const char *value = colon + 1;
+            while (value < eol && (*value == ' ' || *value == '\t')) {
+                ++value;
+            }
+            if (header_is(line, name_len, "Content-Length")) {
+                char *num_end = NULL;
+                head.content_length = strtol(value, &num_end, 10);
+                if (num_end == value || head.content_length < 0) {
+                    return -1;
+                }
+            } else if (header_is(line, name_len, "Transfer-Encoding")) {
+                head.chunked = has_token(value, eol, "chunked");
+            } else if (header_is(line, name_len, "Connection")) {
+                if (has_token(value, eol, "close")) {
+                    head.keep_alive = false;
+                } else if (has_token(value, eol, "keep-alive")) {
+                    head.keep_alive = true;
+                }
+            }
+        }
+        line = eol + 2;
+    }
+    return head.length;
+}
+
+/* 版本统一成HTTP/1.1, 去掉逐跳的头部, Connection按和客户端的连接是否保持 */
+void rewrite_upstream_head(const char *buf, const upstream_head &head, bool keep_alive, std::string &out) {
+    const char *end = buf + head.length - 2;
+    const char *eol = (const char *) memchr(buf, '\r', end - buf);
+    out.assign("HTTP/1.1");
+    out.append(buf + 8, eol - buf - 8);
+    out += "\r\n";
+    for (const char *line = eol + 2; line < end; line = eol + 2) {
+        eol = (const char *) memchr(line, '\r', end - line);
+        const char *colon = (const char *) memchr(line, ':', eol - line);
+        size_t name_len = colon ? colon - line : 0;
+        if (header_is(line, name_len, "Connection") || header_is(line, name_len, "Keep-Alive")
+            || header_is(line, name_len, "Proxy-Connection")) {
+            continue;
+        }
+        out.append(line, eol - line + 2);
+    }
+    out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+void body_framer::init(mode m, long length) {
+    m_mode = m;
+    m_remaining = length;
+    m_digits = 0;
+    switch (m) {
+    case NONE:
+        m_state = DONE;
+        break;
+    case LENGTH:
+        m_state = length > 0 ? BODY : DONE;
+        break;
+    case CHUNKED:
+        m_state = SIZE;
+        m_remaining = 0;
+        break;
+    case UNTIL_CLOSE:
+        m_state = BODY;
+        break;
+    }
+}
+
+long body_framer::consume(const char *data, long len) {
+    if (m_mode == UNTIL_CLOSE) {
+        return len;
+    }
+    long i = 0;
+    while (i < len && m_state != DONE) {
+        if (m_state == BODY || m_state == DATA) {
+            long n = len - i < m_remaining ? len - i : m_remaining;
+            skip(n);
+            i += n;
+            continue;
+        }
+        if (!step(data[i++])) {
+            return -1;
+        }
+    }
+    return i;
+}
+
+long body_framer::payload(const char *data, long len, long &framing) {
+    long i = 0;
+    while (i < len && m_state != DONE && m_state != BODY && m_state != DATA) {
+        if (!step(data[i++])) {
+            return -1;
+        }
+    }
+    framing = i;
+    if (m_state != BODY && m_state != DATA) {
+        return 0;
+    }
+    long n = len - i < m_remaining ? len - i : m_remaining;
+    skip(n);
+    return n;
+}
+
+void body_framer::skip(long n) {
+    m_remaining -= n;
+    if (m_remaining == 0) {
+        m_state = m_state == BODY ? DONE : DATA_CR;
+    }
+}
+
+/* 分块框架(长度行、数据后的CRLF、trailer)的一个字节, 格式错误返回false */
+bool body_framer::step(char c) {
+    switch (m_state) {
+    case SIZE: {
+        int digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            digit = (c | 0x20) - 'a' + 10;
+        } else if (m_digits > 0 && (c == ';' || c == ' ' || c == '\t')) {
+            m_state = SIZE_EXT;
+            break;
+        } else if (m_digits > 0 && c == '\r') {
+            m_state = SIZE_LF;
+            break;
+        } else {
+            return false;
+        }
+        if (++m_digits > 15) {
+            return false;
+        }
+        m_remaining = m_remaining * 16 + digit;
+        break;
+    }
+    case SIZE_EXT:
+        if (c == '\r') {
+            m_state = SIZE_LF;
+        }
+        break;
+    case SIZE_LF:
+        if (c != '\n') {
+            return false;
+        }
+        m_digits = 0;
+        m_state = m_remaining > 0 ? DATA : TRAILER_START;
+        break;
+    case DATA_CR:
+        if (c != '\r') {
+            return false;
+        }
+        m_state = DATA_LF;
+        break;
+    case DATA_LF:
+        if (c != '\n') {
+            return false;
+        }
+        m_state = SIZE;
+        break;
+    case TRAILER_START:
+        m_state = c == '\r' ? TRAILER_LF : TRAILER_LINE;
+        break;
+    case TRAILER_LINE:
+        if (c == '\n') {
+            m_state = TRAILER_START;
+        }
+        break;
+    case TRAILER_LF:
+        if (c != '\n') {
+            return false;
+        }
+        m_state = DONE;
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
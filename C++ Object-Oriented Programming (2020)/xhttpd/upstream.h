@@ -0,0 +1,136 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/*
+ * 反向代理的上游: URL前缀 -> host:port 或 unix:/path, 启动时用-P配置, 之后只读.
+ * 健康状态所有reactor共用: 连续失败MAX_FAILURES次后标记为不可用DOWN_TIME毫秒,
+ * 期间的请求直接回502; 到期后放一个请求过去探测, 成功就恢复.
+ */
+class upstream {
+public:
+    static const int MAX_FAILURES = 3;
+    static const int DOWN_TIME = 10 * 1000;
+    static const int DEFAULT_CONNECT_TIMEOUT = 3 * 1000;
+    static const int DEFAULT_READ_TIMEOUT = 30 * 1000;
+
+    /* 格式: prefix=host:port[,connect_ms[,read_ms]] 或 prefix=unix:/path[,connect_ms[,read_ms]] */
+    static bool add(const char *spec);
+
+    /* 最长前缀匹配, 没有匹配的返回NULL */
+    static upstream *match(const char *url);
+
+    static int count() { return (int) m_upstreams.size(); }
+
+    static void clear();
+
+    int connect_nonblocking(bool &in_progress) const;
+
+    bool available(long now) const;
+
+    void succeeded();
+
+    void failed(long now);
+
+    int index() const { return m_index; }
+
+    const char *name() const { return m_name.c_str(); }
+
+    int connect_timeout() const { return m_connect_timeout; }
+
+    int read_timeout() const { return m_read_timeout; }
+
+private:
+    upstream();
+
+    bool parse(const char *spec);
+
+private:
+    static std::vector<upstream*> m_upstreams;
+
+    int                     m_index;
+    std::string             m_prefix;
+    std::string             m_name;             //配置里的地址, 打印用
+    sockaddr_storage        m_addr;
+    socklen_t               m_addr_len;
+    int                     m_connect_timeout;  //ms
+    int                     m_read_timeout;     //两次从上游读到数据之间的最长间隔(ms)
+    std::atomic<int>        m_failures;         //连续失败次数
+    std::atomic<long>       m_down_until;       //不可用到这个时间(ms)
+};
+
+/* 上游响应头里代理需要知道的部分 */
+struct upstream_head {
+    int     status;
+    long    content_length;     //-1表示没有
+    bool    chunked;
+    bool    keep_alive;         //上游连接能否复用
+    int     length;             //响应头的字节数(含最后的空行)
+};
+
+/* 解析buf开头的响应头: 返回响应头长度, 不完整返回0, 格式错误返回-1 */
+int parse_upstream_head(const char *buf, int len, upstream_head &head);
+
+/* 生成转给客户端的响应头 */
+void rewrite_upstream_head(const char *buf, const upstream_head &head, bool keep_alive, std::string &out);
+
+/*
+ * 只跟踪响应体的边界, 不改动数据: 上游的数据原样转给客户端, 同时判断响应到哪里结束,
+ * 结束后上游连接才能放回连接池. 上传的请求体也用它解码(payload()), 只有LENGTH和CHUNKED两种.
+ */
+class body_framer {
+public:
+    enum mode {
+        NONE = 0,       //没有响应体(HEAD, 204, 304)
+        LENGTH,         //Content-Length
+        CHUNKED,        //Transfer-Encoding: chunked
+        UNTIL_CLOSE     //读到上游关闭为止
+    };
+
+    void init(mode m, long length = 0);
+
+    /* 返回data里属于本响应的字节数, 格式错误返回-1 */
+    long consume(const char *data, long len);
+
+    /* 解码: 跳过data开头的分块框架(framing为跳过的字节数), 返回紧接着的一段数据的长度; 格式错误返回-1 */
+    long payload(const char *data, long len, long &framing);
+
+    /* 数据没经过用户态(splice)时直接推进n字节, n不超过remaining() */
+    void skip(long n);
+
+    /* LENGTH或当前chunk里还没收到的数据字节数 */
+    long remaining() const { return m_remaining; }
+
+    bool done() const { return m_state == DONE; }
+
+    mode framing() const { return m_mode; }
+
+private:
+    enum state {
+        SIZE = 0,
+        SIZE_EXT,
+        SIZE_LF,
+        DATA,
+        DATA_CR,
+        DATA_LF,
+        TRAILER_START,
+        TRAILER_LINE,
+        TRAILER_LF,
+        BODY,
+        DONE
+    };
+
+    bool step(char c);
+
+private:
+    mode    m_mode;
+    state   m_state;
+    long    m_remaining;    //LENGTH或当前chunk剩下的字节数
+    int     m_digits;
+};
+
+#endif
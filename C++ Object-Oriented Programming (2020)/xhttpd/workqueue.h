@@ -0,0 +1,206 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+
+#define CACHE_LINE_SIZE 64
+
+static inline size_t round_up_pow2(size_t n) {
+    size_t size = 1;
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+
+/* 有界多生产者多消费者环形队列(Vyukov), reactor向线程池投递任务用 */
+template<typename T>
+class mpmc_ring {
+public:
+    explicit mpmc_ring(size_t capacity);
+
+    ~mpmc_ring();
+
+    bool push(T data);
+
+    bool pop(T &data);
+
+    size_t size() const;
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    cell*                                       m_buffer;
+    size_t                                      m_mask;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_enqueue_pos;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_dequeue_pos;
+    char                                        m_pad[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+};
+
+template<typename T>
+mpmc_ring<T>::mpmc_ring(size_t capacity) : m_buffer(NULL), m_mask(0), m_enqueue_pos(0), m_dequeue_pos(0) {
+    if (capacity < 2) {
+        throw std::exception();
+    }
+    capacity = round_up_pow2(capacity);
+    m_buffer = new cell[capacity];
+    m_mask = capacity - 1;
+    for (size_t i = 0; i < capacity; ++i) {
+        m_buffer[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+template<typename T>
+mpmc_ring<T>::~mpmc_ring() {
+    delete[] m_buffer;
+}
+
+template<typename T>
+bool mpmc_ring<T>::push(T data) {
+    cell *c;
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        c = &m_buffer[pos & m_mask];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    c->data = data;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+bool mpmc_ring<T>::pop(T &data) {
+    cell *c;
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        c = &m_buffer[pos & m_mask];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    data = c->data;
+    c->seq.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+size_t mpmc_ring<T>::size() const {
+    size_t tail = m_enqueue_pos.load(std::memory_order_relaxed);
+    size_t head = m_dequeue_pos.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+/* 有界工作窃取双端队列(Chase-Lev), 属主线程在bottom端push/pop, 其他线程从top端steal */
+template<typename T>
+class ws_deque {
+public:
+    explicit ws_deque(size_t capacity = 256);
+
+    ~ws_deque();
+
+    bool push(T data);
+
+    bool pop(T &data);
+
+    bool steal(T &data);
+
+    size_t size() const;
+
+private:
+    std::atomic<T>*                             m_buffer;
+    long                                        m_mask;
+    alignas(CACHE_LINE_SIZE) std::atomic<long>  m_top;
+    alignas(CACHE_LINE_SIZE) std::atomic<long>  m_bottom;
+    char                                        m_pad[CACHE_LINE_SIZE - sizeof(std::atomic<long>)];
+};
+
+template<typename T>
+ws_deque<T>::ws_deque(size_t capacity) : m_buffer(NULL), m_mask(0), m_top(0), m_bottom(0) {
+    capacity = round_up_pow2(capacity);
+    m_buffer = new std::atomic<T>[capacity];
+    m_mask = (long) capacity - 1;
+}
+
+template<typename T>
+ws_deque<T>::~ws_deque() {
+    delete[] m_buffer;
+}
+
+template<typename T>
+bool ws_deque<T>::push(T data) {
+    long b = m_bottom.load(std::memory_order_relaxed);
+    long t = m_top.load(std::memory_order_acquire);
+    if (b - t > m_mask) {
+        return false;
+    }
+    m_buffer[b & m_mask].store(data, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_bottom.store(b + 1, std::memory_order_relaxed);
+    return true;
+}
+
+template<typename T>
+bool ws_deque<T>::pop(T &data) {
+    long b = m_bottom.load(std::memory_order_relaxed) - 1;
+    m_bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long t = m_top.load(std::memory_order_relaxed);
+    if (t > b) {
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    data = m_buffer[b & m_mask].load(std::memory_order_relaxed);
+    if (t == b) {
+        bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+template<typename T>
+bool ws_deque<T>::steal(T &data) {
+    long t = m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long b = m_bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+        return false;
+    }
+
+    data = m_buffer[t & m_mask].load(std::memory_order_relaxed);
+    return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+template<typename T>
+size_t ws_deque<T>::size() const {
+    long b = m_bottom.load(std::memory_order_relaxed);
+    long t = m_top.load(std::memory_order_relaxed);
+    return b > t ? (size_t) (b - t) : 0;
+}
+
+#endif